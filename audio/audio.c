@@ -483,7 +483,8 @@ static int audio_attach_capture (HWVoiceOut *hw)
         sw->empty = 1;
         sw->active = hw->enabled;
         sw->vol = nominal_volume;
-        sw->rate = st_rate_start (sw->info.freq, hw_cap->info.freq);
+        sw->rate = st_rate_start(sw->info.freq, hw_cap->info.freq,
+                                 audio_get_pdo_out(s->dev)->resampler);
         QLIST_INSERT_HEAD (&hw_cap->sw_head, sw, entries);
         QLIST_INSERT_HEAD (&hw->cap_head, sc, entries);
 #ifdef DEBUG_CAPTURE
@@ -2084,6 +2085,10 @@ static void audio_validate_per_direction_opts(
         pdo->has_format = true;
         pdo->format = AUDIO_FORMAT_S16;
     }
+    if (!pdo->has_resampler) {
+        pdo->has_resampler = true;
+        pdo->resampler = AUDIO_RESAMPLER_LINEAR;
+    }
 }
 
 static void audio_validate_opts(Audiodev *dev, Error **errp)
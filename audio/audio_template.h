@@ -115,9 +115,10 @@ static void glue (audio_pcm_sw_free_resources_, TYPE) (SW *sw)
 static int glue (audio_pcm_sw_alloc_resources_, TYPE) (SW *sw)
 {
     HW *hw = sw->hw;
+    AudiodevPerDirectionOptions *pdo = glue(audio_get_pdo_, TYPE)(sw->s->dev);
     uint64_t samples;
 
-    if (!glue(audio_get_pdo_, TYPE)(sw->s->dev)->mixing_engine) {
+    if (!pdo->mixing_engine) {
         return 0;
     }
 
@@ -147,9 +148,9 @@ static int glue (audio_pcm_sw_alloc_resources_, TYPE) (SW *sw)
     sw->resample_buf.pos = 0;
 
 #ifdef DAC
-    sw->rate = st_rate_start(sw->info.freq, hw->info.freq);
+    sw->rate = st_rate_start(sw->info.freq, hw->info.freq, pdo->resampler);
 #else
-    sw->rate = st_rate_start(hw->info.freq, sw->info.freq);
+    sw->rate = st_rate_start(hw->info.freq, sw->info.freq, pdo->resampler);
 #endif
 
     return 0;
@@ -25,11 +25,28 @@
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/memalign.h"
 #include "audio.h"
 
 #define AUDIO_CAP "mixeng"
 #include "audio_int.h"
 
+#include <math.h>
+
+/*
+ * The conversion, volume and mixing loops treat a buffer of st_samples as a
+ * flat array of interleaved channel values and work on MIXENG_BATCH values
+ * at a time.  The fixed-length inner loops are turned into vector code for
+ * the host's SIMD unit by the compiler; a scalar loop handles the tail.
+ */
+#define MIXENG_BATCH 16
+
+#ifdef FLOAT_MIXENG
+typedef mixeng_real mixeng_value;
+#else
+typedef int64_t mixeng_value;
+#endif
+
 /* 8 bit */
 #define ENDIAN_CONVERSION natural
 #define ENDIAN_CONVERT(v) (v)
@@ -401,18 +418,141 @@ void audio_sample_from_uint64(void *samples, int pos,
  * an (unsigned long) cast to make it safe.  MarkMLl 2/1/99
  */
 
+/*
+ * Windowed-sinc interpolation.
+ *
+ * The optional band-limited path keeps the same opos/ipos bookkeeping as
+ * the linear one, so st_rate_frames_in() and st_rate_frames_out() hold
+ * for both.  Each output frame is the dot product of the last SINC_TAPS
+ * input frames with a Kaiser-windowed sinc evaluated at the fractional
+ * output position; the kernel is tabulated for SINC_PHASES phases and
+ * linearly interpolated between neighbouring phases.  This adds a fixed
+ * delay of SINC_HALF_TAPS input frames.
+ *
+ * The history is kept as planar floats and every frame is stored twice,
+ * so a window never wraps and each channel is a single contiguous load.
+ * The dot products use the compiler's generic vector extension, which is
+ * lowered to SSE/AVX or NEON depending on the host.
+ */
+#define SINC_HALF_TAPS  8
+#define SINC_TAPS       (2 * SINC_HALF_TAPS)
+#define SINC_PHASE_BITS 8
+#define SINC_PHASES     (1 << SINC_PHASE_BITS)
+#define SINC_BETA       8.0
+
+typedef float sinc_vec __attribute__((vector_size(SINC_TAPS * sizeof(float))));
+
+struct sinc_filter {
+    sinc_vec coeffs[SINC_PHASES + 1];
+    float hist_l[2 * SINC_TAPS];
+    float hist_r[2 * SINC_TAPS];
+    unsigned int hist_pos;
+};
+
+/* zeroth order modified Bessel function of the first kind */
+static double sinc_bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+static struct sinc_filter *sinc_filter_new(int inrate, int outrate)
+{
+    struct sinc_filter *f = qemu_memalign(sizeof(sinc_vec), sizeof(*f));
+    /* cut off below the lower of the two Nyquist frequencies */
+    double cutoff = 0.95 * MIN(1.0, (double) outrate / inrate);
+    double norm = sinc_bessel_i0(SINC_BETA);
+    int phase, k;
+
+    for (phase = 0; phase <= SINC_PHASES; phase++) {
+        float taps[SINC_TAPS];
+        double sum = 0;
+
+        for (k = 0; k < SINC_TAPS; k++) {
+            double x = SINC_HALF_TAPS - 1 - k + (double) phase / SINC_PHASES;
+            double w = x / SINC_HALF_TAPS;
+            double h = cutoff;
+
+            if (x != 0) {
+                h = sin(M_PI * cutoff * x) / (M_PI * x);
+            }
+            w = w * w < 1 ? sinc_bessel_i0(SINC_BETA * sqrt(1 - w * w)) : 0;
+            taps[k] = h * w / norm;
+            sum += taps[k];
+        }
+        /* unity gain at DC for every phase */
+        for (k = 0; k < SINC_TAPS; k++) {
+            taps[k] /= sum;
+        }
+        memcpy(&f->coeffs[phase], taps, sizeof(taps));
+    }
+
+    memset(f->hist_l, 0, sizeof(f->hist_l));
+    memset(f->hist_r, 0, sizeof(f->hist_r));
+    f->hist_pos = 0;
+    return f;
+}
+
+static inline void sinc_push(struct sinc_filter *f, const struct st_sample *s)
+{
+    unsigned int pos = f->hist_pos;
+
+    f->hist_l[pos] = f->hist_l[pos + SINC_TAPS] = s->l;
+    f->hist_r[pos] = f->hist_r[pos + SINC_TAPS] = s->r;
+    f->hist_pos = (pos + 1) % SINC_TAPS;
+}
+
+static inline float sinc_dot(const float *hist, const sinc_vec *c)
+{
+    sinc_vec x;
+    float sum = 0;
+    int i;
+
+    memcpy(&x, hist, sizeof(x));
+    x *= *c;
+    for (i = 0; i < SINC_TAPS; i++) {
+        sum += x[i];
+    }
+    return sum;
+}
+
+/* @frac is the 32 bit fractional position between the last two frames */
+static inline void sinc_interpolate(struct sinc_filter *f, uint32_t frac,
+                                    struct st_sample *out)
+{
+    unsigned int phase = frac >> (32 - SINC_PHASE_BITS);
+    float t = (frac & ((1u << (32 - SINC_PHASE_BITS)) - 1)) *
+              (1.f / (1u << (32 - SINC_PHASE_BITS)));
+    sinc_vec c = f->coeffs[phase] +
+                 (f->coeffs[phase + 1] - f->coeffs[phase]) * t;
+
+    /* the oldest frame lives at hist_pos */
+    out->l = sinc_dot(&f->hist_l[f->hist_pos], &c);
+    out->r = sinc_dot(&f->hist_r[f->hist_pos], &c);
+}
+
 /* Private data */
 struct rate {
     uint64_t opos;
     uint64_t opos_inc;
     uint32_t ipos;              /* position in the input stream (integer) */
     struct st_sample ilast;          /* last sample in the input stream */
+    struct sinc_filter *sinc;   /* NULL for linear interpolation */
 };
 
 /*
  * Prepare processing.
  */
-void *st_rate_start (int inrate, int outrate)
+void *st_rate_start(int inrate, int outrate, AudioResampler resampler)
 {
     struct rate *rate = g_new0(struct rate, 1);
 
@@ -424,6 +564,10 @@ void *st_rate_start (int inrate, int outrate)
     rate->ipos = 0;
     rate->ilast.l = 0;
     rate->ilast.r = 0;
+
+    if (resampler == AUDIO_RESAMPLER_SINC && inrate != outrate) {
+        rate->sinc = sinc_filter_new(inrate, outrate);
+    }
     return rate;
 }
 
@@ -437,7 +581,10 @@ void *st_rate_start (int inrate, int outrate)
 
 void st_rate_stop (void *opaque)
 {
-    g_free (opaque);
+    struct rate *rate = opaque;
+
+    qemu_vfree(rate->sinc);
+    g_free (rate);
 }
 
 /**
@@ -525,21 +672,40 @@ void mixeng_clear (struct st_sample *buf, int len)
     memset (buf, 0, len * sizeof (struct st_sample));
 }
 
+#ifdef FLOAT_MIXENG
+#define MIXENG_UNITY 1.0f
+#define MIXENG_SCALE(v, vol) ((v) * (vol))
+#else
+#define MIXENG_UNITY (1LL << 32)
+#define MIXENG_SCALE(v, vol) (((v) * (vol)) >> 32)
+#endif
+
 void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
 {
+    mixeng_value *p = (mixeng_value *) buf;
+    mixeng_value v[MIXENG_BATCH];
+    int i = 0, j, n = len * 2;
+
     if (vol->mute) {
         mixeng_clear (buf, len);
         return;
     }
 
-    while (len--) {
-#ifdef FLOAT_MIXENG
-        buf->l = buf->l * vol->l;
-        buf->r = buf->r * vol->r;
-#else
-        buf->l = (buf->l * vol->l) >> 32;
-        buf->r = (buf->r * vol->r) >> 32;
-#endif
-        buf += 1;
+    /* guests usually play at full volume, which scales by exactly one */
+    if (vol->l == MIXENG_UNITY && vol->r == MIXENG_UNITY) {
+        return;
+    }
+
+    for (j = 0; j < MIXENG_BATCH; j += 2) {
+        v[j] = vol->l;
+        v[j + 1] = vol->r;
+    }
+    for (; i + MIXENG_BATCH <= n; i += MIXENG_BATCH) {
+        for (j = 0; j < MIXENG_BATCH; j++) {
+            p[i + j] = MIXENG_SCALE(p[i + j], v[j]);
+        }
+    }
+    for (; i < n; i++) {
+        p[i] = MIXENG_SCALE(p[i], v[i & 1]);
     }
 }
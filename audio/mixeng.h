@@ -25,6 +25,8 @@
 #ifndef QEMU_MIXENG_H
 #define QEMU_MIXENG_H
 
+#include "qapi/qapi-types-audio.h"
+
 #ifdef FLOAT_MIXENG
 typedef float mixeng_real;
 struct mixeng_volume { int mute; mixeng_real r; mixeng_real l; };
@@ -46,7 +48,7 @@ extern f_sample *mixeng_clip[2][2][2][3];
 extern t_sample *mixeng_conv_float[2];
 extern f_sample *mixeng_clip_float[2];
 
-void *st_rate_start (int inrate, int outrate);
+void *st_rate_start(int inrate, int outrate, AudioResampler resampler);
 void st_rate_flow(void *opaque, st_sample *ibuf, st_sample *obuf,
                   size_t *isamp, size_t *osamp);
 void st_rate_flow_mix(void *opaque, st_sample *ibuf, st_sample *obuf,
@@ -83,30 +83,34 @@ static inline int64_t glue (conv_, ET) (IN_T v)
 
 static inline IN_T glue (clip_, ET) (int64_t v)
 {
-    if (v >= 0x7fffffffLL) {
-        return IN_MAX;
-    } else if (v < -2147483648LL) {
-        return IN_MIN;
-    }
+    IN_T r;
 
 #ifdef SIGNED
-    return ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
+    r = ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
 #else
-    return ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
+    r = ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
 #endif
+
+    /* saturate with selects rather than early returns so loops vectorize */
+    r = v >= 0x7fffffffLL ? IN_MAX : r;
+    return v < -2147483648LL ? IN_MIN : r;
 }
 #endif
 
 static void glue (glue (conv_, ET), _to_stereo)
     (struct st_sample *dst, const void *src, int samples)
 {
-    struct st_sample *out = dst;
+    mixeng_value *out = (mixeng_value *) dst;
     IN_T *in = (IN_T *) src;
+    int i = 0, j, n = samples * 2;
 
-    while (samples--) {
-        out->l = glue (conv_, ET) (*in++);
-        out->r = glue (conv_, ET) (*in++);
-        out += 1;
+    for (; i + MIXENG_BATCH <= n; i += MIXENG_BATCH) {
+        for (j = 0; j < MIXENG_BATCH; j++) {
+            out[i + j] = glue (conv_, ET) (in[i + j]);
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = glue (conv_, ET) (in[i]);
     }
 }
 
@@ -127,12 +131,17 @@ static void glue (glue (conv_, ET), _to_mono)
 static void glue (glue (clip_, ET), _from_stereo)
     (void *dst, const struct st_sample *src, int samples)
 {
-    const struct st_sample *in = src;
+    const mixeng_value *in = (const mixeng_value *) src;
     IN_T *out = (IN_T *) dst;
-    while (samples--) {
-        *out++ = glue (clip_, ET) (in->l);
-        *out++ = glue (clip_, ET) (in->r);
-        in += 1;
+    int i = 0, j, n = samples * 2;
+
+    for (; i + MIXENG_BATCH <= n; i += MIXENG_BATCH) {
+        for (j = 0; j < MIXENG_BATCH; j++) {
+            out[i + j] = glue (clip_, ET) (in[i + j]);
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = glue (clip_, ET) (in[i]);
     }
 }
 
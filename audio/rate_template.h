@@ -47,10 +47,17 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
     oend = obuf + *osamp;
 
     if (rate->opos_inc == (1ULL + UINT_MAX)) {
-        int i, n = *isamp > *osamp ? *osamp : *isamp;
-        for (i = 0; i < n; i++) {
-            OP (obuf[i].l, ibuf[i].l);
-            OP (obuf[i].r, ibuf[i].r);
+        int i = 0, j, n = *isamp > *osamp ? *osamp : *isamp;
+        mixeng_value *o = (mixeng_value *) obuf;
+        const mixeng_value *in = (const mixeng_value *) ibuf;
+
+        for (; i + MIXENG_BATCH <= n * 2; i += MIXENG_BATCH) {
+            for (j = 0; j < MIXENG_BATCH; j++) {
+                OP (o[i + j], in[i + j]);
+            }
+        }
+        for (; i < n * 2; i++) {
+            OP (o[i], in[i]);
         }
         *isamp = n;
         *osamp = n;
@@ -71,6 +78,9 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
         while (rate->ipos <= (rate->opos >> 32)) {
             ilast = *ibuf++;
             rate->ipos++;
+            if (rate->sinc) {
+                sinc_push(rate->sinc, &ilast);
+            }
 
             /* See if we finished the input buffer yet */
             if (ibuf >= iend) {
@@ -83,8 +93,6 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
             break;
         }
 
-        icur = *ibuf;
-
         /* wrap ipos and opos around long before they overflow */
         if (rate->ipos >= 0x10001) {
             rate->ipos = 1;
@@ -92,19 +100,24 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
         }
 
         /* interpolate */
+        if (rate->sinc) {
+            sinc_interpolate(rate->sinc, rate->opos & UINT_MAX, &out);
+        } else {
+            icur = *ibuf;
 #ifdef FLOAT_MIXENG
 #ifdef RECIPROCAL
-        t = (rate->opos & UINT_MAX) * (1.f / UINT_MAX);
+            t = (rate->opos & UINT_MAX) * (1.f / UINT_MAX);
 #else
-        t = (rate->opos & UINT_MAX) / (mixeng_real) UINT_MAX;
+            t = (rate->opos & UINT_MAX) / (mixeng_real) UINT_MAX;
 #endif
-        out.l = (ilast.l * (1.0 - t)) + icur.l * t;
-        out.r = (ilast.r * (1.0 - t)) + icur.r * t;
+            out.l = (ilast.l * (1.0 - t)) + icur.l * t;
+            out.r = (ilast.r * (1.0 - t)) + icur.r * t;
 #else
-        t = rate->opos & 0xffffffff;
-        out.l = (ilast.l * ((int64_t) UINT_MAX - t) + icur.l * t) >> 32;
-        out.r = (ilast.r * ((int64_t) UINT_MAX - t) + icur.r * t) >> 32;
+            t = rate->opos & 0xffffffff;
+            out.l = (ilast.l * ((int64_t) UINT_MAX - t) + icur.l * t) >> 32;
+            out.r = (ilast.r * ((int64_t) UINT_MAX - t) + icur.r * t) >> 32;
 #endif
+        }
 
         /* output sample & increment position */
         OP (obuf->l, out.l);
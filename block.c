@@ -3874,6 +3874,7 @@ static BlockDriverState *bdrv_append_temp_snapshot(BlockDriverState *bs,
 {
     ERRP_GUARD();
     g_autofree char *tmp_filename = NULL;
+    const char *driver;
     int64_t total_size;
     QemuOpts *opts = NULL;
     BlockDriverState *bs_snapshot = NULL;
@@ -3892,27 +3893,37 @@ static BlockDriverState *bdrv_append_temp_snapshot(BlockDriverState *bs,
         goto out;
     }
 
-    /* Create the temporary image */
-    tmp_filename = create_tmp_file(errp);
-    if (!tmp_filename) {
+    driver = qdict_get_try_str(snapshot_options, "driver");
+    if (driver && !strcmp(driver, "ram-overlay")) {
+        /* Nothing to create, the overlay only lives in memory */
+        qdict_put_int(snapshot_options, BLOCK_OPT_SIZE, total_size);
+    } else if (driver && strcmp(driver, "qcow2")) {
+        error_setg(errp, "Temporary overlays can only use the qcow2 or "
+                   "ram-overlay driver");
         goto out;
-    }
+    } else {
+        /* Create the temporary image */
+        tmp_filename = create_tmp_file(errp);
+        if (!tmp_filename) {
+            goto out;
+        }
 
-    opts = qemu_opts_create(bdrv_qcow2.create_opts, NULL, 0,
-                            &error_abort);
-    qemu_opt_set_number(opts, BLOCK_OPT_SIZE, total_size, &error_abort);
-    ret = bdrv_create(&bdrv_qcow2, tmp_filename, opts, errp);
-    qemu_opts_del(opts);
-    if (ret < 0) {
-        error_prepend(errp, "Could not create temporary overlay '%s': ",
-                      tmp_filename);
-        goto out;
-    }
+        opts = qemu_opts_create(bdrv_qcow2.create_opts, NULL, 0,
+                                &error_abort);
+        qemu_opt_set_number(opts, BLOCK_OPT_SIZE, total_size, &error_abort);
+        ret = bdrv_create(&bdrv_qcow2, tmp_filename, opts, errp);
+        qemu_opts_del(opts);
+        if (ret < 0) {
+            error_prepend(errp, "Could not create temporary overlay '%s': ",
+                          tmp_filename);
+            goto out;
+        }
 
-    /* Prepare options QDict for the temporary file */
-    qdict_put_str(snapshot_options, "file.driver", "file");
-    qdict_put_str(snapshot_options, "file.filename", tmp_filename);
-    qdict_put_str(snapshot_options, "driver", "qcow2");
+        /* Prepare options QDict for the temporary file */
+        qdict_put_str(snapshot_options, "file.driver", "file");
+        qdict_put_str(snapshot_options, "file.filename", tmp_filename);
+        qdict_put_str(snapshot_options, "driver", "qcow2");
+    }
 
     bs_snapshot = bdrv_open(NULL, NULL, snapshot_options, flags, errp);
     snapshot_options = NULL;
@@ -4048,7 +4059,9 @@ bdrv_open_inherit(const char *filename, const char *reference, QDict *options,
     }
 
     if (flags & BDRV_O_SNAPSHOT) {
-        snapshot_options = qdict_new();
+        /* "snapshot.*" options are for the overlay, e.g. its driver */
+        qdict_extract_subqdict(options, &snapshot_options, "snapshot.");
+        qdict_extract_subqdict(bs->explicit_options, NULL, "snapshot.");
         bdrv_temp_snapshot_options(&snapshot_flags, snapshot_options,
                                    flags, options);
         /* Let bdrv_backing_options() override "read-only" */
@@ -4200,8 +4213,8 @@ bdrv_open_inherit(const char *filename, const char *reference, QDict *options,
     qobject_unref(options);
     options = NULL;
 
-    /* For snapshot=on, create a temporary qcow2 overlay. bs points to the
-     * temporary snapshot afterwards. */
+    /* For snapshot=on, create a temporary qcow2 or ram-overlay overlay. bs
+     * points to the temporary snapshot afterwards. */
     if (snapshot_flags) {
         BlockDriverState *snapshot_bs;
         snapshot_bs = bdrv_append_temp_snapshot(bs, snapshot_flags,
@@ -704,6 +704,7 @@ bool monitor_add_blk(BlockBackend *blk, const char *name, Error **errp)
     }
 
     blk->name = g_strdup(name);
+    trace_blk_acct_name(&blk->stats, blk->name);
     QTAILQ_INSERT_TAIL(&monitor_block_backends, blk, monitor_link);
     return true;
 }
@@ -1001,6 +1002,13 @@ int blk_attach_dev(BlockBackend *blk, DeviceState *dev)
     blk->dev = dev;
     blk_iostatus_reset(blk);
 
+    /* Drives that only have a device, like those of -blockdev */
+    if (trace_event_get_state_backends(TRACE_BLK_ACCT_NAME)) {
+        g_autofree char *id = blk_get_attached_dev_id(blk);
+
+        trace_blk_acct_name(&blk->stats, id);
+    }
+
     return 0;
 }
 
@@ -0,0 +1,721 @@
+/*
+ * Boot prefetch filter driver
+ *
+ * The filter records which parts of the image the guest reads during the
+ * first seconds after the node is opened, and saves that trace in a
+ * sidecar file.  When the node is opened again with the trace present,
+ * the same chunks are read ahead of the guest, with bounded concurrency,
+ * and kept in memory until the guest reads them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/*
+ * Trace file layout, all fields big endian:
+ *
+ *   magic[8], version (4), chunk size (4), image size (8), count (8),
+ *   followed by count chunk indices (8 each) in the order of first access
+ */
+#define BOOT_PREFETCH_MAGIC         "QEMUBPFT"
+#define BOOT_PREFETCH_VERSION       1
+#define BOOT_PREFETCH_HEADER_SIZE   32
+
+/* Keeps the trace file, and the time needed to replay it, reasonable */
+#define BOOT_PREFETCH_MAX_ENTRIES   (1024 * 1024)
+
+#define BOOT_PREFETCH_MAX_PARALLEL  64
+
+typedef struct PrefetchChunk {
+    uint64_t index;
+    uint8_t *data;
+    uint64_t consumed;  /* bytes the guest has read from it */
+    bool loading;
+    bool stale;         /* overwritten while loading, drop it when done */
+    BlockDriverState *bs;
+} PrefetchChunk;
+
+typedef struct BDRVBootPrefetchState {
+    char *trace_path;
+    uint32_t duration;
+    uint32_t chunk_size;
+    uint32_t max_parallel;
+    uint64_t cache_size;
+    int64_t size;
+
+    /* Set until the recording window ends */
+    bool active;
+    int64_t deadline_ms;
+    QEMUTimer *timer;
+
+    /* Recording */
+    unsigned long *seen;
+    uint64_t nb_chunks;
+    GArray *recorded;
+
+    /* Replay */
+    uint64_t *trace;
+    uint64_t trace_len;
+    uint64_t trace_next;
+    GHashTable *chunks;
+    CoQueue chunk_queue;    /* woken when a chunk finishes loading */
+    uint64_t cache_used;
+    uint32_t in_flight;
+    int quiesce_counter;
+    bool kick_scheduled;
+
+    /* Statistics */
+    uint64_t prefetched;
+    uint64_t hits;
+    uint64_t misses;
+} BDRVBootPrefetchState;
+
+#define BOOT_PREFETCH_OPT_TRACE         "trace"
+#define BOOT_PREFETCH_OPT_DURATION      "duration"
+#define BOOT_PREFETCH_OPT_CHUNK_SIZE    "chunk-size"
+#define BOOT_PREFETCH_OPT_MAX_PARALLEL  "max-parallel"
+#define BOOT_PREFETCH_OPT_CACHE_SIZE    "cache-size"
+
+static QemuOptsList runtime_opts = {
+    .name = "boot-prefetch",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = BOOT_PREFETCH_OPT_TRACE,
+            .type = QEMU_OPT_STRING,
+            .help = "file to save the access trace in",
+        },
+        {
+            .name = BOOT_PREFETCH_OPT_DURATION,
+            .type = QEMU_OPT_NUMBER,
+            .help = "seconds to record and prefetch for, default 60",
+        },
+        {
+            .name = BOOT_PREFETCH_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the trace, default 64k",
+        },
+        {
+            .name = BOOT_PREFETCH_OPT_MAX_PARALLEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of prefetch requests in flight, "
+                    "default 8",
+        },
+        {
+            .name = BOOT_PREFETCH_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum amount of prefetched data kept in memory, "
+                    "default 256M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void boot_prefetch_schedule_kick(BlockDriverState *bs);
+
+static void boot_prefetch_drop(BDRVBootPrefetchState *s, PrefetchChunk *c)
+{
+    g_hash_table_remove(s->chunks, &c->index);
+    s->cache_used -= s->chunk_size;
+    qemu_vfree(c->data);
+    g_free(c);
+}
+
+/*
+ * Load the trace of the previous boot.  A missing, stale or malformed
+ * trace is not an error, the image is then only recorded this time.
+ */
+static void boot_prefetch_load_trace(BDRVBootPrefetchState *s)
+{
+    g_autofree char *buf = NULL;
+    g_autoptr(GError) gerr = NULL;
+    gsize len;
+    uint64_t count, i;
+
+    if (!g_file_get_contents(s->trace_path, &buf, &len, &gerr)) {
+        if (!g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("boot-prefetch: could not read '%s': %s",
+                        s->trace_path, gerr->message);
+        }
+        return;
+    }
+
+    if (len < BOOT_PREFETCH_HEADER_SIZE ||
+        memcmp(buf, BOOT_PREFETCH_MAGIC, 8) ||
+        ldl_be_p(buf + 8) != BOOT_PREFETCH_VERSION) {
+        warn_report("boot-prefetch: '%s' is not a boot trace, ignoring it",
+                    s->trace_path);
+        return;
+    }
+    count = ldq_be_p(buf + 24);
+    if (count > BOOT_PREFETCH_MAX_ENTRIES ||
+        len != BOOT_PREFETCH_HEADER_SIZE + count * 8) {
+        warn_report("boot-prefetch: '%s' is truncated, ignoring it",
+                    s->trace_path);
+        return;
+    }
+    if (ldl_be_p(buf + 12) != s->chunk_size || ldq_be_p(buf + 16) != s->size) {
+        /* The image or the options changed, the trace will be replaced */
+        trace_boot_prefetch_trace_mismatch(s->trace_path);
+        return;
+    }
+
+    s->trace = g_new(uint64_t, count);
+    for (i = 0; i < count; i++) {
+        uint64_t index = ldq_be_p(buf + BOOT_PREFETCH_HEADER_SIZE + i * 8);
+
+        if (index >= s->nb_chunks) {
+            warn_report("boot-prefetch: '%s' is corrupt, ignoring it",
+                        s->trace_path);
+            g_free(s->trace);
+            s->trace = NULL;
+            return;
+        }
+        s->trace[i] = index;
+    }
+    s->trace_len = count;
+}
+
+static void boot_prefetch_save_trace(BDRVBootPrefetchState *s)
+{
+    g_autoptr(GError) gerr = NULL;
+    size_t len = BOOT_PREFETCH_HEADER_SIZE + s->recorded->len * 8;
+    g_autofree uint8_t *buf = g_malloc(len);
+    guint i;
+
+    memcpy(buf, BOOT_PREFETCH_MAGIC, 8);
+    stl_be_p(buf + 8, BOOT_PREFETCH_VERSION);
+    stl_be_p(buf + 12, s->chunk_size);
+    stq_be_p(buf + 16, s->size);
+    stq_be_p(buf + 24, s->recorded->len);
+    for (i = 0; i < s->recorded->len; i++) {
+        stq_be_p(buf + BOOT_PREFETCH_HEADER_SIZE + i * 8,
+                 g_array_index(s->recorded, uint64_t, i));
+    }
+
+    if (!g_file_set_contents(s->trace_path, (char *)buf, len, &gerr)) {
+        warn_report("boot-prefetch: could not save '%s': %s",
+                    s->trace_path, gerr->message);
+    }
+}
+
+/* End of the recording window: save the trace and drop the cache */
+static void boot_prefetch_finish(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    GHashTableIter iter;
+    PrefetchChunk *c;
+
+    if (!s->active) {
+        return;
+    }
+    s->active = false;
+    trace_boot_prefetch_finish(bs, s->recorded->len, s->prefetched, s->hits,
+                               s->misses);
+
+    if (s->recorded->len) {
+        boot_prefetch_save_trace(s);
+    }
+
+    /* Chunks still loading are dropped by their coroutine */
+    g_hash_table_iter_init(&iter, s->chunks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&c)) {
+        if (!c->loading) {
+            g_hash_table_iter_remove(&iter);
+            s->cache_used -= s->chunk_size;
+            qemu_vfree(c->data);
+            g_free(c);
+        }
+    }
+    g_free(s->trace);
+    s->trace = NULL;
+    s->trace_len = s->trace_next = 0;
+}
+
+static void boot_prefetch_timer_cb(void *opaque)
+{
+    boot_prefetch_finish(opaque);
+}
+
+static void boot_prefetch_timer_init(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    if (s->active) {
+        s->timer = aio_timer_new_with_attrs(ctx, QEMU_CLOCK_VIRTUAL,
+                                            SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                            boot_prefetch_timer_cb, bs);
+        timer_mod(s->timer, s->deadline_ms);
+    }
+}
+
+static void boot_prefetch_timer_del(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    if (s->timer) {
+        timer_free(s->timer);
+        s->timer = NULL;
+    }
+}
+
+static void coroutine_fn boot_prefetch_co_load(void *opaque)
+{
+    PrefetchChunk *c = opaque;
+    BlockDriverState *bs = c->bs;
+    BDRVBootPrefetchState *s = bs->opaque;
+    int64_t offset = c->index * s->chunk_size;
+    int64_t bytes = MIN(s->chunk_size, s->size - offset);
+    int ret = -ENOMEM;
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        c->data = qemu_try_blockalign(bs->file->bs, s->chunk_size);
+        if (c->data) {
+            ret = bdrv_co_pread(bs->file, offset, bytes, c->data, 0);
+        }
+    }
+    trace_boot_prefetch_load(bs, offset, bytes, ret);
+
+    c->loading = false;
+    if (ret < 0 || c->stale || !s->active) {
+        boot_prefetch_drop(s, c);
+    } else {
+        s->prefetched++;
+    }
+    qemu_co_queue_restart_all(&s->chunk_queue);
+
+    s->in_flight--;
+    boot_prefetch_schedule_kick(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Start loading trace entries, up to the concurrency and memory limits */
+static void boot_prefetch_kick(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    while (s->active && !s->quiesce_counter &&
+           s->in_flight < s->max_parallel &&
+           s->trace_next < s->trace_len &&
+           s->cache_used + s->chunk_size <= s->cache_size) {
+        uint64_t index = s->trace[s->trace_next++];
+        PrefetchChunk *c;
+
+        /* Chunks the guest read already will not be read again soon */
+        if (test_bit(index, s->seen) ||
+            g_hash_table_contains(s->chunks, &index)) {
+            continue;
+        }
+
+        c = g_new0(PrefetchChunk, 1);
+        c->index = index;
+        c->loading = true;
+        c->bs = bs;
+        g_hash_table_insert(s->chunks, &c->index, c);
+        s->cache_used += s->chunk_size;
+        s->in_flight++;
+
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs),
+                     qemu_coroutine_create(boot_prefetch_co_load, c));
+    }
+}
+
+static void boot_prefetch_kick_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    s->kick_scheduled = false;
+    boot_prefetch_kick(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+static void boot_prefetch_schedule_kick(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    if (s->active && s->trace_next < s->trace_len && !s->kick_scheduled) {
+        s->kick_scheduled = true;
+        bdrv_inc_in_flight(bs);
+        aio_bh_schedule_oneshot(bdrv_get_aio_context(bs),
+                                boot_prefetch_kick_bh, bs);
+    }
+}
+
+static int boot_prefetch_open(BlockDriverState *bs, QDict *options, int flags,
+                              Error **errp)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->trace_path = g_strdup(qemu_opt_get(opts, BOOT_PREFETCH_OPT_TRACE));
+    s->duration = qemu_opt_get_number(opts, BOOT_PREFETCH_OPT_DURATION, 60);
+    s->chunk_size = qemu_opt_get_size(opts, BOOT_PREFETCH_OPT_CHUNK_SIZE,
+                                      64 * KiB);
+    s->max_parallel = qemu_opt_get_number(opts,
+                                          BOOT_PREFETCH_OPT_MAX_PARALLEL, 8);
+    s->cache_size = qemu_opt_get_size(opts, BOOT_PREFETCH_OPT_CACHE_SIZE,
+                                      256 * MiB);
+    qemu_opts_del(opts);
+
+    if (!s->trace_path) {
+        error_setg(errp, "boot-prefetch requires the 'trace' option");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (!is_power_of_2(s->chunk_size) || s->chunk_size < BDRV_SECTOR_SIZE ||
+        s->chunk_size > 16 * MiB) {
+        error_setg(errp, "chunk-size must be a power of two between 512 "
+                   "and 16M");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->max_parallel < 1 || s->max_parallel > BOOT_PREFETCH_MAX_PARALLEL) {
+        error_setg(errp, "max-parallel must be between 1 and %d",
+                   BOOT_PREFETCH_MAX_PARALLEL);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->size = bdrv_getlength(bs->file->bs);
+    if (s->size < 0) {
+        error_setg_errno(errp, -s->size, "Could not get the image size");
+        ret = s->size;
+        goto fail;
+    }
+    s->nb_chunks = DIV_ROUND_UP(s->size, s->chunk_size);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    s->seen = bitmap_try_new(s->nb_chunks);
+    if (!s->seen) {
+        error_setg(errp, "Could not allocate the access bitmap");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->recorded = g_array_new(false, false, sizeof(uint64_t));
+    s->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_queue_init(&s->chunk_queue);
+
+    boot_prefetch_load_trace(s);
+    trace_boot_prefetch_open(bs, s->trace_path, s->trace_len);
+
+    s->active = true;
+    s->deadline_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                     (int64_t)s->duration * 1000;
+    boot_prefetch_timer_init(bs, bdrv_get_aio_context(bs));
+    boot_prefetch_schedule_kick(bs);
+    return 0;
+
+fail:
+    g_free(s->trace_path);
+    s->trace_path = NULL;
+    return ret;
+}
+
+static void boot_prefetch_close(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    boot_prefetch_timer_del(bs);
+    boot_prefetch_finish(bs);
+    assert(!g_hash_table_size(s->chunks));
+
+    g_hash_table_destroy(s->chunks);
+    g_array_free(s->recorded, true);
+    g_free(s->seen);
+    g_free(s->trace_path);
+}
+
+/*
+ * Wait for the chunks covering the request and copy them to qiov.  Returns
+ * false if any of them is not (or no longer) prefetched.
+ */
+static bool coroutine_fn
+boot_prefetch_co_read_cached(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, QEMUIOVector *qiov,
+                             size_t qiov_offset)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    uint64_t first = offset / s->chunk_size;
+    uint64_t last = (offset + bytes - 1) / s->chunk_size;
+    uint64_t index;
+    PrefetchChunk *c;
+
+retry:
+    for (index = first; index <= last; index++) {
+        c = g_hash_table_lookup(s->chunks, &index);
+        if (!c) {
+            return false;
+        }
+        if (c->loading) {
+            qemu_co_queue_wait(&s->chunk_queue, NULL);
+            goto retry;
+        }
+    }
+
+    /* No yield from here on, so the chunks stay around */
+    for (index = first; index <= last; index++) {
+        int64_t start = MAX(offset, index * s->chunk_size);
+        int64_t end = MIN(offset + bytes, (index + 1) * s->chunk_size);
+
+        c = g_hash_table_lookup(s->chunks, &index);
+        qemu_iovec_from_buf(qiov, qiov_offset + start - offset,
+                            c->data + start - index * s->chunk_size,
+                            end - start);
+        c->consumed += end - start;
+        if (c->consumed >= s->chunk_size ||
+            (index + 1) * s->chunk_size >= s->size) {
+            boot_prefetch_drop(s, c);
+        }
+    }
+    return true;
+}
+
+static void boot_prefetch_record(BDRVBootPrefetchState *s, int64_t offset,
+                                 int64_t bytes)
+{
+    uint64_t index;
+
+    for (index = offset / s->chunk_size;
+         index <= (offset + bytes - 1) / s->chunk_size &&
+         s->recorded->len < BOOT_PREFETCH_MAX_ENTRIES;
+         index++) {
+        if (!test_and_set_bit(index, s->seen)) {
+            g_array_append_val(s->recorded, index);
+        }
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, QEMUIOVector *qiov,
+                             size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    bool replaying = s->trace_len > 0;
+
+    if (s->active && bytes > 0) {
+        boot_prefetch_record(s, offset, bytes);
+        if (replaying) {
+            if (boot_prefetch_co_read_cached(bs, offset, bytes, qiov,
+                                             qiov_offset)) {
+                s->hits++;
+                boot_prefetch_schedule_kick(bs);
+                return 0;
+            }
+            s->misses++;
+        }
+    }
+
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+/* Drop prefetched data that a write makes out of date */
+static void boot_prefetch_invalidate(BlockDriverState *bs, int64_t offset,
+                                     int64_t bytes)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    uint64_t index;
+    PrefetchChunk *c;
+
+    if (!g_hash_table_size(s->chunks) || bytes <= 0) {
+        return;
+    }
+    for (index = offset / s->chunk_size;
+         index <= (offset + bytes - 1) / s->chunk_size; index++) {
+        c = g_hash_table_lookup(s->chunks, &index);
+        if (c && c->loading) {
+            c->stale = true;
+        } else if (c) {
+            boot_prefetch_drop(s, c);
+        }
+    }
+}
+
+/*
+ * Invalidate both before and after the write, so that chunks loaded while
+ * it is in flight are not kept either.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                              int64_t bytes, QEMUIOVector *qiov,
+                              size_t qiov_offset, BdrvRequestFlags flags)
+{
+    int ret;
+
+    boot_prefetch_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    boot_prefetch_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    boot_prefetch_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    boot_prefetch_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    boot_prefetch_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    boot_prefetch_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+boot_prefetch_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void boot_prefetch_drain_begin(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    s->quiesce_counter++;
+}
+
+static void boot_prefetch_drain_end(BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+
+    assert(s->quiesce_counter > 0);
+    if (--s->quiesce_counter == 0) {
+        boot_prefetch_schedule_kick(bs);
+    }
+}
+
+static void boot_prefetch_detach_aio_context(BlockDriverState *bs)
+{
+    boot_prefetch_timer_del(bs);
+}
+
+static void boot_prefetch_attach_aio_context(BlockDriverState *bs,
+                                             AioContext *new_context)
+{
+    boot_prefetch_timer_init(bs, new_context);
+}
+
+static BlockStatsSpecific *boot_prefetch_get_specific_stats(
+    BlockDriverState *bs)
+{
+    BDRVBootPrefetchState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_BOOT_PREFETCH;
+    stats->u.boot_prefetch = (BlockStatsSpecificBootPrefetch) {
+        .recording = s->active,
+        .recorded = s->recorded->len,
+        .prefetched = s->prefetched,
+        .hits = s->hits,
+        .misses = s->misses,
+    };
+    return stats;
+}
+
+static const char *const boot_prefetch_strong_runtime_opts[] = {
+    BOOT_PREFETCH_OPT_TRACE,
+
+    NULL
+};
+
+static BlockDriver bdrv_boot_prefetch = {
+    .format_name                = "boot-prefetch",
+    .instance_size              = sizeof(BDRVBootPrefetchState),
+
+    .bdrv_open                  = boot_prefetch_open,
+    .bdrv_close                 = boot_prefetch_close,
+    .bdrv_child_perm            = bdrv_default_perms,
+
+    .bdrv_co_getlength          = boot_prefetch_co_getlength,
+
+    .bdrv_co_preadv_part        = boot_prefetch_co_preadv_part,
+    .bdrv_co_pwritev_part       = boot_prefetch_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = boot_prefetch_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = boot_prefetch_co_pdiscard,
+    .bdrv_co_flush              = boot_prefetch_co_flush,
+
+    .bdrv_drain_begin           = boot_prefetch_drain_begin,
+    .bdrv_drain_end             = boot_prefetch_drain_end,
+    .bdrv_detach_aio_context    = boot_prefetch_detach_aio_context,
+    .bdrv_attach_aio_context    = boot_prefetch_attach_aio_context,
+
+    .bdrv_get_specific_stats    = boot_prefetch_get_specific_stats,
+
+    .is_filter                  = true,
+    .strong_runtime_opts        = boot_prefetch_strong_runtime_opts,
+};
+
+static void bdrv_boot_prefetch_init(void)
+{
+    bdrv_register(&bdrv_boot_prefetch);
+}
+
+block_init(bdrv_boot_prefetch_init);
@@ -0,0 +1,1550 @@
+/*
+ * QEMU Block driver for CHD images
+ *
+ * CHD ("compressed hunks of data") is MAME's compressed disk image format,
+ * used for both hard disks and CD-ROMs.  Only version 5 images without a
+ * parent are supported, read-only.
+ *
+ * Copyright (c) 2026 The qemu-libretro authors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qemu/bswap.h"
+#include "qemu/crc-ccitt.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZMA
+#include <lzma.h>
+#endif
+#ifdef CONFIG_FLAC
+#include <FLAC/stream_decoder.h>
+#endif
+
+#define CHD_MAGIC               "MComprHD"
+#define CHD_V5_HEADER_SIZE      124
+#define CHD_MAX_HUNK_SIZE       (16 * 1024 * 1024)
+#define CHD_MAX_MAP_SIZE        (512 * 1024 * 1024)
+#define CHD_MAX_METADATA        4096
+
+/* Header field offsets */
+#define CHD_HDR_LENGTH          8
+#define CHD_HDR_VERSION         12
+#define CHD_HDR_COMPRESSORS     16
+#define CHD_HDR_LOGICAL_BYTES   32
+#define CHD_HDR_MAP_OFFSET      40
+#define CHD_HDR_META_OFFSET     48
+#define CHD_HDR_HUNK_BYTES      56
+#define CHD_HDR_UNIT_BYTES      60
+#define CHD_HDR_PARENT_SHA1     104
+
+#define CHD_CODEC_ZLIB          0x7a6c6962 /* zlib */
+#define CHD_CODEC_ZSTD          0x7a737464 /* zstd */
+#define CHD_CODEC_LZMA          0x6c7a6d61 /* lzma */
+#define CHD_CODEC_FLAC          0x666c6163 /* flac */
+#define CHD_CODEC_CD_ZLIB       0x63647a6c /* cdzl */
+#define CHD_CODEC_CD_ZSTD       0x63647a73 /* cdzs */
+#define CHD_CODEC_CD_LZMA       0x63646c7a /* cdlz */
+#define CHD_CODEC_CD_FLAC       0x6364666c /* cdfl */
+#define CHD_CODEC_HUFF          0x68756666 /* huff */
+
+#define CHD_META_CD_TRACK       0x43485452 /* CHTR */
+#define CHD_META_CD_TRACK2      0x43485432 /* CHT2 */
+
+/* Hunk types in the compressed map */
+enum {
+    CHD_HUNK_CODEC0,            /* compressed with compressors[0..3] */
+    CHD_HUNK_CODEC3 = 3,
+    CHD_HUNK_NONE,
+    CHD_HUNK_SELF,
+    CHD_HUNK_PARENT,
+    CHD_HUNK_RLE_SMALL,
+    CHD_HUNK_RLE_LARGE,
+    CHD_HUNK_SELF_0,
+    CHD_HUNK_SELF_1,
+    CHD_HUNK_PARENT_SELF,
+    CHD_HUNK_PARENT_0,
+    CHD_HUNK_PARENT_1,
+    /* Never stored, for unallocated hunks of uncompressed images */
+    CHD_HUNK_ZERO,
+};
+
+/* The map's hunk types are Huffman coded with up to 8 bit codes */
+#define CHD_MAP_SYMBOLS         16
+#define CHD_MAP_MAX_BITS        8
+/* The huff codec codes bytes with up to 16 bit codes... */
+#define CHD_HUFF_SYMBOLS        256
+#define CHD_HUFF_MAX_BITS       16
+/* ...whose lengths are Huffman coded again, with up to 6 bit codes */
+#define CHD_HUFF_LEN_SYMBOLS    24
+#define CHD_HUFF_LEN_MAX_BITS   6
+
+/* A CD frame is a raw sector followed by its subchannel data */
+#define CD_SECTOR_SIZE          2352
+#define CD_SUBCODE_SIZE         96
+#define CD_FRAME_SIZE           (CD_SECTOR_SIZE + CD_SUBCODE_SIZE)
+#define CD_DATA_SIZE            2048
+/* Tracks are padded to a multiple of this many frames */
+#define CD_TRACK_PADDING        4
+#define CD_MAX_TRACKS           99
+
+/* Limit for concurrent decompression jobs in the thread pool */
+#define CHD_MAX_THREADS         4
+
+#define CHD_OPT_CACHE_SIZE      "cache-size"
+#define CHD_OPT_READAHEAD       "readahead"
+
+typedef struct CHDMapEntry {
+    uint64_t offset;
+    uint32_t length;
+    uint16_t crc;
+    uint8_t type;
+} CHDMapEntry;
+
+typedef struct CHDCacheEntry {
+    uint64_t hunk;
+    uint8_t *data;
+    /* Set while the hunk is being decompressed, readers wait on @waiters */
+    bool loading;
+    CoQueue waiters;
+    QTAILQ_ENTRY(CHDCacheEntry) next;
+} CHDCacheEntry;
+
+typedef struct BDRVCHDState {
+    uint32_t codecs[4];
+    uint32_t hunk_size;
+    uint64_t hunk_count;
+    CHDMapEntry *map;
+    /* Whether map entries carry a CRC of the decompressed hunk */
+    bool map_crc;
+
+    /*
+     * For CD-ROMs, the guest sees the 2048-byte sectors of the first data
+     * track, which start @cd_data_offset bytes into each frame.
+     */
+    bool cdrom;
+    uint64_t cd_first_frame;
+    uint32_t cd_data_offset;
+
+    CoMutex lock;
+    /* Decompressed hunks by index, least recently used at the tail */
+    GHashTable *cache;
+    QTAILQ_HEAD(, CHDCacheEntry) lru;
+    unsigned cache_entries;
+    unsigned cache_max;
+    unsigned readahead;
+    /* End of the previous read, to detect sequential access */
+    int64_t last_end;
+
+    int nb_threads;
+    CoQueue thread_task_queue;
+} BDRVCHDState;
+
+static QemuOptsList chd_runtime_opts = {
+    .name = "chd",
+    .head = QTAILQ_HEAD_INITIALIZER(chd_runtime_opts.head),
+    .desc = {
+        {
+            .name = CHD_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed hunk cache",
+            .def_value_str = "16M",
+        },
+        {
+            .name = CHD_OPT_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of hunks to decompress ahead of sequential "
+                    "reads",
+            .def_value_str = "4",
+        },
+        { /* end of list */ },
+    },
+};
+
+/* Galois field tables for regenerating the ECC of Mode 1 sectors */
+static uint8_t ecc_f_lut[256];
+static uint8_t ecc_b_lut[256];
+
+static const uint8_t cd_sync_header[12] = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+static int chd_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size >= CHD_V5_HEADER_SIZE &&
+        !memcmp(buf, CHD_MAGIC, strlen(CHD_MAGIC)) &&
+        ldl_be_p(buf + CHD_HDR_VERSION) == 5) {
+        return 100;
+    }
+    return 0;
+}
+
+/*
+ * Bit reader for the compressed map and huff hunks, most significant bit
+ * first.  Reading past the end yields zeroes and sets @overflow.
+ */
+typedef struct CHDBitReader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool overflow;
+} CHDBitReader;
+
+static uint32_t chd_bits_read(CHDBitReader *br, int n)
+{
+    uint32_t v = 0;
+
+    while (n--) {
+        size_t byte = br->pos >> 3;
+        int bit = 0;
+
+        if (byte < br->len) {
+            bit = (br->buf[byte] >> (7 - (br->pos & 7))) & 1;
+        } else {
+            br->overflow = true;
+        }
+        v = (v << 1) | bit;
+        br->pos++;
+    }
+    return v;
+}
+
+/*
+ * Assign canonical codes to the symbols from their code lengths and build
+ * a lookup table indexed by the next @max_bits bits, with the symbol in
+ * the upper bits and the code length in the lower 5 bits of each entry.
+ */
+static int chd_huffman_build(const uint8_t *code_bits, int nb_symbols,
+                             int max_bits, uint16_t *lookup)
+{
+    uint32_t start[CHD_HUFF_MAX_BITS + 1] = { 0 };
+    uint32_t next_start = 0;
+    int i;
+
+    /* Canonical codes, assigned from the longest to the shortest */
+    for (i = 0; i < nb_symbols; i++) {
+        if (code_bits[i] > max_bits) {
+            return -EINVAL;
+        }
+        start[code_bits[i]]++;
+    }
+    for (i = max_bits; i > 0; i--) {
+        uint32_t count = next_start + start[i];
+
+        if (i != 1 && (count & 1)) {
+            return -EINVAL;
+        }
+        start[i] = next_start;
+        next_start = count >> 1;
+    }
+
+    memset(lookup, 0, sizeof(uint16_t) << max_bits);
+    for (i = 0; i < nb_symbols; i++) {
+        int bits = code_bits[i];
+        int shift = max_bits - bits;
+        uint32_t code, j;
+
+        if (!bits) {
+            continue;
+        }
+        code = start[bits]++;
+        if (code >> bits) {
+            return -EINVAL;
+        }
+        for (j = 0; j < (1u << shift); j++) {
+            lookup[(code << shift) | j] = (i << 5) | bits;
+        }
+    }
+    return 0;
+}
+
+static int chd_huffman_decode(CHDBitReader *br, const uint16_t *lookup,
+                              int max_bits)
+{
+    size_t pos = br->pos;
+    uint16_t entry = lookup[chd_bits_read(br, max_bits)];
+
+    br->pos = pos + (entry & 0x1f);
+    br->overflow = br->pos > br->len * 8;
+    return entry >> 5;
+}
+
+/* Read the RLE-coded code lengths of the map's Huffman tree */
+static int chd_huffman_import(CHDBitReader *br, uint16_t *lookup)
+{
+    uint8_t code_bits[CHD_MAP_SYMBOLS];
+    int n = 0;
+
+    while (n < CHD_MAP_SYMBOLS) {
+        int bits = chd_bits_read(br, 4);
+        int rep;
+
+        if (bits != 1) {
+            code_bits[n++] = bits;
+            continue;
+        }
+        bits = chd_bits_read(br, 4);
+        if (bits == 1) {
+            code_bits[n++] = bits;
+            continue;
+        }
+        rep = chd_bits_read(br, 4) + 3;
+        if (n + rep > CHD_MAP_SYMBOLS) {
+            return -EINVAL;
+        }
+        while (rep--) {
+            code_bits[n++] = bits;
+        }
+    }
+    return chd_huffman_build(code_bits, CHD_MAP_SYMBOLS, CHD_MAP_MAX_BITS,
+                             lookup);
+}
+
+/*
+ * Read the code lengths of a huff hunk's tree.  They are coded with a
+ * small Huffman tree, where symbol 0 repeats the previous length and the
+ * others are the length plus one.
+ */
+static int chd_huffman_import_huff(CHDBitReader *br, uint16_t *lookup)
+{
+    uint8_t len_bits[CHD_HUFF_LEN_SYMBOLS];
+    uint16_t len_lookup[1 << CHD_HUFF_LEN_MAX_BITS];
+    uint8_t code_bits[CHD_HUFF_SYMBOLS];
+    int first, count = 0, last = 0, rep_bits = 0;
+    int i, n, ret;
+
+    /* A length of 7 ends the list, the remaining symbols are unused */
+    len_bits[0] = chd_bits_read(br, 3);
+    first = chd_bits_read(br, 3) + 1;
+    for (i = 1; i < CHD_HUFF_LEN_SYMBOLS; i++) {
+        if (i < first || count == 7) {
+            len_bits[i] = 0;
+        } else {
+            count = chd_bits_read(br, 3);
+            len_bits[i] = count == 7 ? 0 : count;
+        }
+    }
+    ret = chd_huffman_build(len_bits, CHD_HUFF_LEN_SYMBOLS,
+                            CHD_HUFF_LEN_MAX_BITS, len_lookup);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Long repeats have as many extra bits as it takes to cover the rest */
+    for (i = CHD_HUFF_SYMBOLS - 9; i; i >>= 1) {
+        rep_bits++;
+    }
+    n = 0;
+    while (n < CHD_HUFF_SYMBOLS) {
+        int value = chd_huffman_decode(br, len_lookup, CHD_HUFF_LEN_MAX_BITS);
+        int rep;
+
+        if (value) {
+            code_bits[n++] = last = value - 1;
+            continue;
+        }
+        rep = chd_bits_read(br, 3) + 2;
+        if (rep == 7 + 2) {
+            rep += chd_bits_read(br, rep_bits);
+        }
+        while (rep-- && n < CHD_HUFF_SYMBOLS) {
+            code_bits[n++] = last;
+        }
+    }
+    if (br->overflow) {
+        return -EINVAL;
+    }
+    return chd_huffman_build(code_bits, CHD_HUFF_SYMBOLS, CHD_HUFF_MAX_BITS,
+                             lookup);
+}
+
+static int chd_read_uncompressed_map(BlockDriverState *bs, uint64_t offset,
+                                     Error **errp)
+{
+    BDRVCHDState *s = bs->opaque;
+    uint32_t *raw;
+    uint64_t i;
+    int ret;
+
+    raw = g_try_new(uint32_t, s->hunk_count);
+    if (!raw) {
+        error_setg(errp, "Could not allocate the map");
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, offset, s->hunk_count * sizeof(uint32_t),
+                     raw, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the map");
+        goto out;
+    }
+
+    for (i = 0; i < s->hunk_count; i++) {
+        uint32_t block = be32_to_cpu(raw[i]);
+
+        s->map[i] = (CHDMapEntry) {
+            .type = block ? CHD_HUNK_NONE : CHD_HUNK_ZERO,
+            .offset = (uint64_t)block * s->hunk_size,
+            .length = s->hunk_size,
+        };
+    }
+    s->map_crc = false;
+
+out:
+    g_free(raw);
+    return ret;
+}
+
+static int chd_read_compressed_map(BlockDriverState *bs, uint64_t offset,
+                                   Error **errp)
+{
+    BDRVCHDState *s = bs->opaque;
+    uint8_t header[16], raw[12];
+    uint16_t lookup[1 << CHD_MAP_MAX_BITS];
+    uint32_t map_size, length_bits, hunk_bits, parent_bits;
+    uint64_t data_offset, last_self = 0;
+    CHDBitReader br = { 0 };
+    uint8_t *buf = NULL;
+    uint16_t crc = 0xffff;
+    uint8_t last_type = 0;
+    uint32_t repeat = 0;
+    uint64_t i;
+    int ret;
+
+    ret = bdrv_pread(bs->file, offset, sizeof(header), header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the map header");
+        return ret;
+    }
+    map_size = ldl_be_p(header);
+    data_offset = ((uint64_t)lduw_be_p(header + 4) << 32) |
+                  ldl_be_p(header + 6);
+    length_bits = header[12];
+    hunk_bits = header[13];
+    parent_bits = header[14];
+    if (map_size > CHD_MAX_MAP_SIZE || length_bits > 32 || hunk_bits > 32 ||
+        parent_bits > 32) {
+        error_setg(errp, "Invalid map header, image file is corrupt");
+        return -EINVAL;
+    }
+
+    buf = g_try_malloc(map_size);
+    if (map_size && !buf) {
+        error_setg(errp, "Could not allocate the map");
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, offset + sizeof(header), map_size, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the map");
+        goto out;
+    }
+    br.buf = buf;
+    br.len = map_size;
+
+    ret = chd_huffman_import(&br, lookup);
+    if (ret < 0) {
+        error_setg(errp, "Invalid map encoding, image file is corrupt");
+        goto out;
+    }
+
+    /* The hunk types come first, with runs of the same type coded as RLE */
+    for (i = 0; i < s->hunk_count; i++) {
+        if (repeat) {
+            repeat--;
+        } else {
+            int type = chd_huffman_decode(&br, lookup, CHD_MAP_MAX_BITS);
+
+            if (type == CHD_HUNK_RLE_SMALL) {
+                repeat = 2 + chd_huffman_decode(&br, lookup,
+                                                CHD_MAP_MAX_BITS);
+            } else if (type == CHD_HUNK_RLE_LARGE) {
+                repeat = 2 + 16 + (chd_huffman_decode(&br, lookup,
+                                                      CHD_MAP_MAX_BITS) << 4);
+                repeat += chd_huffman_decode(&br, lookup, CHD_MAP_MAX_BITS);
+            } else {
+                last_type = type;
+            }
+        }
+        s->map[i].type = last_type;
+    }
+
+    /* Then the lengths and CRCs, or where to find a copy of the hunk */
+    for (i = 0; i < s->hunk_count; i++) {
+        CHDMapEntry *e = &s->map[i];
+
+        switch (e->type) {
+        case CHD_HUNK_CODEC0 ... CHD_HUNK_CODEC3:
+            e->offset = data_offset;
+            e->length = chd_bits_read(&br, length_bits);
+            e->crc = chd_bits_read(&br, 16);
+            data_offset += e->length;
+            if (!s->codecs[e->type]) {
+                error_setg(errp, "Hunk %" PRIu64 " uses an undefined codec, "
+                           "image file is corrupt", i);
+                ret = -EINVAL;
+                goto out;
+            }
+            break;
+        case CHD_HUNK_NONE:
+            e->offset = data_offset;
+            e->length = s->hunk_size;
+            e->crc = chd_bits_read(&br, 16);
+            data_offset += e->length;
+            break;
+        case CHD_HUNK_SELF:
+            e->offset = last_self = chd_bits_read(&br, hunk_bits);
+            break;
+        case CHD_HUNK_SELF_1:
+            last_self++;
+            /* fall through */
+        case CHD_HUNK_SELF_0:
+            e->type = CHD_HUNK_SELF;
+            e->offset = last_self;
+            break;
+        case CHD_HUNK_PARENT:
+        case CHD_HUNK_PARENT_SELF:
+        case CHD_HUNK_PARENT_0:
+        case CHD_HUNK_PARENT_1:
+            error_setg(errp, "Hunk %" PRIu64 " refers to a parent image, "
+                       "which is not supported", i);
+            ret = -ENOTSUP;
+            goto out;
+        default:
+            error_setg(errp, "Invalid type for hunk %" PRIu64 ", image file "
+                       "is corrupt", i);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        raw[0] = e->type;
+        raw[1] = e->length >> 16;
+        raw[2] = e->length >> 8;
+        raw[3] = e->length;
+        raw[4] = e->offset >> 40;
+        raw[5] = e->offset >> 32;
+        stl_be_p(raw + 6, e->offset);
+        stw_be_p(raw + 10, e->crc);
+        crc = crc_ccitt_false(crc, raw, sizeof(raw));
+    }
+
+    if (br.overflow || crc != lduw_be_p(header + 10)) {
+        error_setg(errp, "Map checksum mismatch, image file is corrupt");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Copies always refer back to a hunk that has already been resolved */
+    for (i = 0; i < s->hunk_count; i++) {
+        CHDMapEntry *e = &s->map[i];
+
+        if (e->type == CHD_HUNK_SELF) {
+            if (e->offset >= i) {
+                error_setg(errp, "Hunk %" PRIu64 " is a copy of a later "
+                           "hunk, image file is corrupt", i);
+                ret = -EINVAL;
+                goto out;
+            }
+            *e = s->map[e->offset];
+        }
+    }
+    s->map_crc = true;
+    ret = 0;
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static bool chd_codec_supported(uint32_t codec)
+{
+    switch (codec) {
+    case CHD_CODEC_ZLIB:
+    case CHD_CODEC_CD_ZLIB:
+    case CHD_CODEC_HUFF:
+        return true;
+#ifdef CONFIG_ZSTD
+    case CHD_CODEC_ZSTD:
+    case CHD_CODEC_CD_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZMA
+    case CHD_CODEC_LZMA:
+    case CHD_CODEC_CD_LZMA:
+        return true;
+#endif
+#ifdef CONFIG_FLAC
+    case CHD_CODEC_FLAC:
+    case CHD_CODEC_CD_FLAC:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static bool chd_codec_is_cd(uint32_t codec)
+{
+    return codec == CHD_CODEC_CD_ZLIB || codec == CHD_CODEC_CD_ZSTD ||
+           codec == CHD_CODEC_CD_LZMA || codec == CHD_CODEC_CD_FLAC;
+}
+
+/*
+ * Find the first data track of a CD-ROM image.  Returns 0 if it is not a
+ * CD-ROM image, 1 if it is and the track was found.
+ */
+static int chd_find_cd_track(BlockDriverState *bs, uint64_t meta_offset,
+                             Error **errp)
+{
+    BDRVCHDState *s = bs->opaque;
+    struct {
+        bool valid;
+        char type[32];
+        uint32_t frames, pregap;
+        bool pregap_stored;
+    } tracks[CD_MAX_TRACKS] = { 0 };
+    bool cdrom = false;
+    uint64_t frame = 0;
+    int i, n, ret;
+
+    for (n = 0; meta_offset && n < CHD_MAX_METADATA; n++) {
+        uint8_t header[16];
+        char text[256], type[32], subtype[32], pgtype[32] = "";
+        uint32_t tag, length, track, frames, pregap = 0;
+
+        ret = bdrv_pread(bs->file, meta_offset, sizeof(header), header, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read metadata");
+            return ret;
+        }
+        tag = ldl_be_p(header);
+        length = ldl_be_p(header + 4) & 0xffffff;
+
+        if (tag == CHD_META_CD_TRACK || tag == CHD_META_CD_TRACK2) {
+            cdrom = true;
+            length = MIN(length, sizeof(text) - 1);
+            ret = bdrv_pread(bs->file, meta_offset + sizeof(header), length,
+                             text, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read metadata");
+                return ret;
+            }
+            text[length] = '\0';
+
+            if (sscanf(text, "TRACK:%" SCNu32 " TYPE:%31s SUBTYPE:%31s "
+                       "FRAMES:%" SCNu32, &track, type, subtype,
+                       &frames) != 4 ||
+                track < 1 || track > CD_MAX_TRACKS) {
+                error_setg(errp, "Invalid CD track metadata '%s'", text);
+                return -EINVAL;
+            }
+            if (tag == CHD_META_CD_TRACK2) {
+                char *p = strstr(text, "PREGAP:");
+
+                if (p && sscanf(p, "PREGAP:%" SCNu32 " PGTYPE:%31s",
+                                &pregap, pgtype) < 1) {
+                    pregap = 0;
+                }
+            }
+            strcpy(tracks[track - 1].type, type);
+            tracks[track - 1].valid = true;
+            tracks[track - 1].frames = frames;
+            tracks[track - 1].pregap = pregap;
+            /* Only a "V" pregap type means the pregap is in the image */
+            tracks[track - 1].pregap_stored = pgtype[0] == 'V';
+        }
+        meta_offset = ldq_be_p(header + 8);
+    }
+    if (!cdrom) {
+        return 0;
+    }
+
+    for (i = 0; i < CD_MAX_TRACKS && tracks[i].valid; i++) {
+        uint32_t offset = UINT32_MAX;
+
+        if (!strcmp(tracks[i].type, "MODE1") ||
+            !strcmp(tracks[i].type, "MODE2_FORM1")) {
+            offset = 0;
+        } else if (!strcmp(tracks[i].type, "MODE1_RAW")) {
+            offset = 16;
+        } else if (!strcmp(tracks[i].type, "MODE2_RAW")) {
+            offset = 24;
+        }
+        if (offset != UINT32_MAX) {
+            uint32_t pregap = tracks[i].pregap_stored ? tracks[i].pregap : 0;
+
+            if (pregap > tracks[i].frames) {
+                break;
+            }
+            s->cdrom = true;
+            s->cd_data_offset = offset;
+            s->cd_first_frame = frame + pregap;
+            bs->total_sectors = (uint64_t)(tracks[i].frames - pregap) *
+                                (CD_DATA_SIZE / BDRV_SECTOR_SIZE);
+            if ((s->cd_first_frame + tracks[i].frames - pregap) *
+                CD_FRAME_SIZE > s->hunk_count * s->hunk_size) {
+                error_setg(errp, "Track %d extends past the end of the "
+                           "image, image file is corrupt", i + 1);
+                return -EINVAL;
+            }
+            return 1;
+        }
+        frame += ROUND_UP(tracks[i].frames, CD_TRACK_PADDING);
+    }
+    error_setg(errp, "CD image has no supported data track");
+    return -ENOTSUP;
+}
+
+static int chd_open(BlockDriverState *bs, QDict *options, int flags,
+                    Error **errp)
+{
+    BDRVCHDState *s = bs->opaque;
+    uint8_t header[CHD_V5_HEADER_SIZE];
+    uint64_t logical_size, map_offset, meta_offset, cache_size, i;
+    uint32_t unit_size;
+    bool cd_codecs = false;
+    QemuOpts *opts;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    bdrv_graph_rdlock_main_loop();
+    ret = bdrv_apply_auto_read_only(bs, NULL, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&chd_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    cache_size = qemu_opt_get_size(opts, CHD_OPT_CACHE_SIZE, 0);
+    s->readahead = qemu_opt_get_number(opts, CHD_OPT_READAHEAD, 0);
+    qemu_opts_del(opts);
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = bdrv_pread(bs->file, 0, sizeof(header), header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the header");
+        return ret;
+    }
+    if (memcmp(header, CHD_MAGIC, strlen(CHD_MAGIC))) {
+        error_setg(errp, "Not a CHD image");
+        return -EINVAL;
+    }
+    if (ldl_be_p(header + CHD_HDR_VERSION) != 5 ||
+        ldl_be_p(header + CHD_HDR_LENGTH) != CHD_V5_HEADER_SIZE) {
+        error_setg(errp, "Unsupported CHD version %" PRIu32 ", convert it "
+                   "with 'chdman copy'", ldl_be_p(header + CHD_HDR_VERSION));
+        return -ENOTSUP;
+    }
+    if (!buffer_is_zero(header + CHD_HDR_PARENT_SHA1, 20)) {
+        error_setg(errp, "CHD images with a parent are not supported");
+        return -ENOTSUP;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s->codecs); i++) {
+        s->codecs[i] = ldl_be_p(header + CHD_HDR_COMPRESSORS + i * 4);
+        cd_codecs |= chd_codec_is_cd(s->codecs[i]);
+    }
+    logical_size = ldq_be_p(header + CHD_HDR_LOGICAL_BYTES);
+    map_offset = ldq_be_p(header + CHD_HDR_MAP_OFFSET);
+    meta_offset = ldq_be_p(header + CHD_HDR_META_OFFSET);
+    s->hunk_size = ldl_be_p(header + CHD_HDR_HUNK_BYTES);
+    unit_size = ldl_be_p(header + CHD_HDR_UNIT_BYTES);
+
+    if (s->hunk_size == 0 || s->hunk_size > CHD_MAX_HUNK_SIZE) {
+        error_setg(errp, "hunk size %" PRIu32 " must be between 1 and %u MB",
+                   s->hunk_size, CHD_MAX_HUNK_SIZE / (1024 * 1024));
+        return -EINVAL;
+    }
+    s->hunk_count = DIV_ROUND_UP(logical_size, s->hunk_size);
+    if (s->hunk_count > CHD_MAX_MAP_SIZE / sizeof(CHDMapEntry)) {
+        error_setg(errp, "image requires too many hunks");
+        return -EINVAL;
+    }
+
+    s->map = g_try_new0(CHDMapEntry, s->hunk_count);
+    if (s->hunk_count && !s->map) {
+        error_setg(errp, "Could not allocate the map");
+        return -ENOMEM;
+    }
+    if (s->codecs[0]) {
+        ret = chd_read_compressed_map(bs, map_offset, errp);
+    } else {
+        ret = chd_read_uncompressed_map(bs, map_offset, errp);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+    /* The hunks that use them fail to read, but the rest remains usable */
+    for (i = 0; i < ARRAY_SIZE(s->codecs); i++) {
+        uint32_t codec = s->codecs[i];
+
+        if (codec && !chd_codec_supported(codec)) {
+            warn_report("CHD codec '%c%c%c%c' is not supported by this "
+                        "build, hunks that use it can't be read",
+                        codec >> 24, (codec >> 16) & 0xff,
+                        (codec >> 8) & 0xff, codec & 0xff);
+        }
+    }
+
+    ret = chd_find_cd_track(bs, meta_offset, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (s->cdrom || cd_codecs) {
+        if (!s->cdrom || unit_size != CD_FRAME_SIZE ||
+            s->hunk_size % CD_FRAME_SIZE) {
+            error_setg(errp, "Invalid CD-ROM layout, image file is corrupt");
+            ret = -EINVAL;
+            goto fail;
+        }
+    } else {
+        bs->total_sectors = logical_size / BDRV_SECTOR_SIZE;
+    }
+
+    s->cache_max = MAX(cache_size / s->hunk_size, 4);
+    /* Leave room for the hunks of the request that triggered read-ahead */
+    s->readahead = MIN(s->readahead, s->cache_max / 2);
+    s->cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    s->last_end = -1;
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->thread_task_queue);
+    return 0;
+
+fail:
+    g_free(s->map);
+    s->map = NULL;
+    return ret;
+}
+
+static void chd_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl.request_alignment = BDRV_SECTOR_SIZE; /* No sub-sector I/O */
+}
+
+/*
+ * Decompression, in thread pool workers
+ */
+
+typedef struct CHDDecompressData {
+    uint32_t codec;
+    const uint8_t *src;
+    size_t src_size;
+    uint8_t *dest;
+    size_t dest_size;
+} CHDDecompressData;
+
+static int chd_inflate(const uint8_t *src, size_t src_size, uint8_t *dest,
+                       size_t dest_size)
+{
+    z_stream zstream = {
+        .next_in = (Bytef *)src,
+        .avail_in = src_size,
+        .next_out = dest,
+        .avail_out = dest_size,
+    };
+
+    if (inflateInit2(&zstream, -MAX_WBITS) != Z_OK) {
+        return -EIO;
+    }
+    /* The hunk's length is known, the stream is not always terminated */
+    inflate(&zstream, Z_SYNC_FLUSH);
+    inflateEnd(&zstream);
+    return zstream.total_out == dest_size ? 0 : -EIO;
+}
+
+#ifdef CONFIG_ZSTD
+static int chd_unzstd(const uint8_t *src, size_t src_size, uint8_t *dest,
+                      size_t dest_size)
+{
+    size_t ret = ZSTD_decompress(dest, dest_size, src, src_size);
+
+    return ret == dest_size ? 0 : -EIO;
+}
+#endif
+
+#ifdef CONFIG_LZMA
+/* Raw LZMA with the parameters of the encoder's level 9 and no end marker */
+static int chd_unlzma(const uint8_t *src, size_t src_size, uint8_t *dest,
+                      size_t dest_size)
+{
+    lzma_options_lzma options;
+    lzma_filter filters[] = {
+        { .id = LZMA_FILTER_LZMA1, .options = &options },
+        { .id = LZMA_VLI_UNKNOWN },
+    };
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret ret;
+
+    if (lzma_lzma_preset(&options, 9)) {
+        return -EIO;
+    }
+    /* Matches can't reach further back than the start of the hunk */
+    options.dict_size = MAX(dest_size, LZMA_DICT_SIZE_MIN);
+    if (lzma_raw_decoder(&strm, filters) != LZMA_OK) {
+        return -EIO;
+    }
+    strm.next_in = src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+    ret = lzma_code(&strm, LZMA_RUN);
+    lzma_end(&strm);
+    if ((ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+        strm.total_out != dest_size) {
+        return -EIO;
+    }
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_FLAC
+/*
+ * Hunks hold bare FLAC frames of 16-bit stereo at 44.1 kHz.  The decoder is
+ * fed a made up STREAMINFO header first.
+ */
+#define CHD_FLAC_HEADER_SIZE 42
+
+typedef struct CHDFlacStream {
+    uint8_t header[CHD_FLAC_HEADER_SIZE];
+    const uint8_t *src;
+    size_t src_size;
+    size_t pos;
+    uint8_t *dest;
+    size_t dest_size;
+    size_t dest_pos;
+    bool big_endian;
+} CHDFlacStream;
+
+static FLAC__StreamDecoderReadStatus
+chd_flac_read(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[],
+              size_t *bytes, void *opaque)
+{
+    CHDFlacStream *f = opaque;
+    size_t n = 0;
+
+    while (n < *bytes && f->pos < CHD_FLAC_HEADER_SIZE) {
+        buffer[n++] = f->header[f->pos++];
+    }
+    if (n < *bytes && f->pos < CHD_FLAC_HEADER_SIZE + f->src_size) {
+        size_t len = MIN(*bytes - n,
+                         CHD_FLAC_HEADER_SIZE + f->src_size - f->pos);
+
+        memcpy(buffer + n, f->src + f->pos - CHD_FLAC_HEADER_SIZE, len);
+        n += len;
+        f->pos += len;
+    }
+    *bytes = n;
+    return n ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE :
+               FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+}
+
+static FLAC__StreamDecoderTellStatus
+chd_flac_tell(const FLAC__StreamDecoder *decoder, FLAC__uint64 *offset,
+              void *opaque)
+{
+    CHDFlacStream *f = opaque;
+
+    *offset = f->pos;
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderWriteStatus
+chd_flac_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+               const FLAC__int32 *const buffer[], void *opaque)
+{
+    CHDFlacStream *f = opaque;
+    unsigned i, c;
+
+    if (frame->header.channels != 2 ||
+        f->dest_size - f->dest_pos < frame->header.blocksize * 4) {
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+    for (i = 0; i < frame->header.blocksize; i++) {
+        for (c = 0; c < 2; c++) {
+            if (f->big_endian) {
+                stw_be_p(f->dest + f->dest_pos, buffer[c][i]);
+            } else {
+                stw_le_p(f->dest + f->dest_pos, buffer[c][i]);
+            }
+            f->dest_pos += 2;
+        }
+    }
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void chd_flac_error(const FLAC__StreamDecoder *decoder,
+                           FLAC__StreamDecoderErrorStatus status, void *opaque)
+{
+}
+
+/*
+ * Returns how much of @src the FLAC frames took up, or a negative errno.
+ * @block_size only needs to match what the encoder was configured with.
+ */
+static ssize_t chd_unflac(const uint8_t *src, size_t src_size, uint8_t *dest,
+                          size_t dest_size, uint32_t block_size,
+                          bool big_endian)
+{
+    CHDFlacStream f = {
+        .header = {
+            'f', 'L', 'a', 'C',
+            0x80, 0x00, 0x00, 0x22,     /* last block, STREAMINFO, 34 bytes */
+            block_size >> 8, block_size, block_size >> 8, block_size,
+            0, 0, 0, 0, 0, 0,           /* frame sizes unknown */
+            0x0a, 0xc4, 0x42, 0xf0,     /* 44100 Hz, 2 channels, 16 bits */
+            0, 0, 0, 0,                 /* length unknown */
+            /* no MD5 */
+        },
+        .src = src,
+        .src_size = src_size,
+        .dest = dest,
+        .dest_size = dest_size,
+        .big_endian = big_endian,
+    };
+    FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+    FLAC__uint64 pos = 0;
+
+    if (!decoder) {
+        return -ENOMEM;
+    }
+    if (FLAC__stream_decoder_init_stream(decoder, chd_flac_read, NULL,
+                                         chd_flac_tell, NULL, NULL,
+                                         chd_flac_write, NULL,
+                                         chd_flac_error, &f) !=
+        FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+        FLAC__stream_decoder_delete(decoder);
+        return -EIO;
+    }
+    while (f.dest_pos < dest_size) {
+        if (!FLAC__stream_decoder_process_single(decoder) ||
+            FLAC__stream_decoder_get_state(decoder) ==
+            FLAC__STREAM_DECODER_END_OF_STREAM) {
+            break;
+        }
+    }
+    FLAC__stream_decoder_get_decode_position(decoder, &pos);
+    FLAC__stream_decoder_finish(decoder);
+    FLAC__stream_decoder_delete(decoder);
+
+    if (f.dest_pos != dest_size || pos < CHD_FLAC_HEADER_SIZE) {
+        return -EIO;
+    }
+    return pos - CHD_FLAC_HEADER_SIZE;
+}
+#endif
+
+/* Bytes Huffman coded with a tree of their own */
+static int chd_unhuff(const uint8_t *src, size_t src_size, uint8_t *dest,
+                      size_t dest_size)
+{
+    CHDBitReader br = { .buf = src, .len = src_size };
+    g_autofree uint16_t *lookup = NULL;
+    size_t i;
+
+    lookup = g_try_new(uint16_t, 1 << CHD_HUFF_MAX_BITS);
+    if (!lookup) {
+        return -ENOMEM;
+    }
+    if (chd_huffman_import_huff(&br, lookup) < 0) {
+        return -EIO;
+    }
+    for (i = 0; i < dest_size; i++) {
+        dest[i] = chd_huffman_decode(&br, lookup, CHD_HUFF_MAX_BITS);
+    }
+    return br.overflow ? -EIO : 0;
+}
+
+static int chd_decompress_plain(uint32_t codec, const uint8_t *src,
+                                size_t src_size, uint8_t *dest,
+                                size_t dest_size)
+{
+    switch (codec) {
+    case CHD_CODEC_ZLIB:
+        return chd_inflate(src, src_size, dest, dest_size);
+    case CHD_CODEC_HUFF:
+        return chd_unhuff(src, src_size, dest, dest_size);
+#ifdef CONFIG_ZSTD
+    case CHD_CODEC_ZSTD:
+        return chd_unzstd(src, src_size, dest, dest_size);
+#endif
+#ifdef CONFIG_LZMA
+    case CHD_CODEC_LZMA:
+        return chd_unlzma(src, src_size, dest, dest_size);
+#endif
+#ifdef CONFIG_FLAC
+    case CHD_CODEC_FLAC: {
+        uint32_t block_size = dest_size / 4;
+        ssize_t ret;
+
+        /* The first byte says in which byte order the samples are */
+        if (src_size < 1 || (src[0] != 'B' && src[0] != 'L')) {
+            return -EIO;
+        }
+        while (block_size > 2048) {
+            block_size /= 2;
+        }
+        ret = chd_unflac(src + 1, src_size - 1, dest, dest_size, block_size,
+                         src[0] == 'B');
+        return ret < 0 ? ret : 0;
+    }
+#endif
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/* Compute the P or Q parity of a Mode 1 sector, as in ECMA-130 */
+static void cd_ecc_block(const uint8_t *src, uint32_t major_count,
+                         uint32_t minor_count, uint32_t major_mult,
+                         uint32_t minor_inc, uint8_t *dest)
+{
+    uint32_t size = major_count * minor_count;
+    uint32_t major, minor;
+
+    for (major = 0; major < major_count; major++) {
+        uint32_t index = (major >> 1) * major_mult + (major & 1);
+        uint8_t ecc_a = 0, ecc_b = 0;
+
+        for (minor = 0; minor < minor_count; minor++) {
+            uint8_t temp = src[index];
+
+            index += minor_inc;
+            if (index >= size) {
+                index -= size;
+            }
+            ecc_a ^= temp;
+            ecc_b ^= temp;
+            ecc_a = ecc_f_lut[ecc_a];
+        }
+        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+        dest[major] = ecc_a;
+        dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+}
+
+static void cd_ecc_generate(uint8_t *sector)
+{
+    cd_ecc_block(sector + 0xc, 86, 24, 2, 86, sector + 0x81c);
+    cd_ecc_block(sector + 0xc, 52, 43, 86, 88, sector + 0x8c8);
+}
+
+/*
+ * CD codecs compress the sectors and the subchannel data of all frames in
+ * a hunk as two separate streams.  Sync headers and ECC that could be
+ * regenerated were cleared before compression, which a bitmap records.
+ */
+static int chd_decompress_cd(uint32_t codec, const uint8_t *src,
+                             size_t src_size, uint8_t *dest, size_t dest_size)
+{
+    size_t frames = dest_size / CD_FRAME_SIZE;
+    size_t ecc_bytes = DIV_ROUND_UP(frames, 8);
+    size_t header_size = ecc_bytes + (dest_size < 65536 ? 2 : 3);
+    uint32_t base_codec, subcode_codec = CHD_CODEC_ZLIB;
+    size_t base_size, subcode_offset, i;
+    g_autofree uint8_t *buf = NULL;
+    int ret;
+
+    buf = g_try_malloc(dest_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+#ifdef CONFIG_FLAC
+    if (codec == CHD_CODEC_CD_FLAC) {
+        uint32_t block_size = frames * CD_SECTOR_SIZE / 4;
+        ssize_t flac_size;
+
+        /* Audio tracks, so no ECC bitmap and no length of the sectors */
+        while (block_size > CD_SECTOR_SIZE) {
+            block_size /= 2;
+        }
+        flac_size = chd_unflac(src, src_size, buf, frames * CD_SECTOR_SIZE,
+                               block_size, true);
+        if (flac_size < 0) {
+            return flac_size;
+        }
+        ecc_bytes = 0;
+        subcode_offset = flac_size;
+    } else
+#endif
+    {
+        switch (codec) {
+        case CHD_CODEC_CD_ZLIB:
+            base_codec = CHD_CODEC_ZLIB;
+            break;
+        case CHD_CODEC_CD_LZMA:
+            base_codec = CHD_CODEC_LZMA;
+            break;
+        case CHD_CODEC_CD_ZSTD:
+            base_codec = subcode_codec = CHD_CODEC_ZSTD;
+            break;
+        default:
+            return -ENOTSUP;
+        }
+
+        if (src_size < header_size) {
+            return -EIO;
+        }
+        base_size = lduw_be_p(src + ecc_bytes);
+        if (header_size - ecc_bytes > 2) {
+            base_size = (base_size << 8) | src[ecc_bytes + 2];
+        }
+        if (base_size > src_size - header_size) {
+            return -EIO;
+        }
+        ret = chd_decompress_plain(base_codec, src + header_size, base_size,
+                                   buf, frames * CD_SECTOR_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        subcode_offset = header_size + base_size;
+    }
+
+    if (subcode_offset > src_size) {
+        return -EIO;
+    }
+    ret = chd_decompress_plain(subcode_codec, src + subcode_offset,
+                               src_size - subcode_offset,
+                               buf + frames * CD_SECTOR_SIZE,
+                               frames * CD_SUBCODE_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < frames; i++) {
+        uint8_t *sector = dest + i * CD_FRAME_SIZE;
+
+        memcpy(sector, buf + i * CD_SECTOR_SIZE, CD_SECTOR_SIZE);
+        memcpy(sector + CD_SECTOR_SIZE,
+               buf + frames * CD_SECTOR_SIZE + i * CD_SUBCODE_SIZE,
+               CD_SUBCODE_SIZE);
+        if (ecc_bytes && (src[i / 8] & (1 << (i % 8)))) {
+            memcpy(sector, cd_sync_header, sizeof(cd_sync_header));
+            cd_ecc_generate(sector);
+        }
+    }
+    return 0;
+}
+
+static int chd_decompress_pool_func(void *opaque)
+{
+    CHDDecompressData *data = opaque;
+
+    if (chd_codec_is_cd(data->codec)) {
+        return chd_decompress_cd(data->codec, data->src, data->src_size,
+                                 data->dest, data->dest_size);
+    }
+    return chd_decompress_plain(data->codec, data->src, data->src_size,
+                                data->dest, data->dest_size);
+}
+
+static int coroutine_fn
+chd_co_decompress(BlockDriverState *bs, CHDDecompressData *data)
+{
+    BDRVCHDState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (s->nb_threads >= CHD_MAX_THREADS) {
+        qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
+    }
+    s->nb_threads++;
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = thread_pool_submit_co(chd_decompress_pool_func, data);
+
+    qemu_co_mutex_lock(&s->lock);
+    s->nb_threads--;
+    qemu_co_queue_next(&s->thread_task_queue);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+chd_co_load_hunk(BlockDriverState *bs, uint64_t hunk, uint8_t *dest)
+{
+    BDRVCHDState *s = bs->opaque;
+    CHDMapEntry *e = &s->map[hunk];
+    uint8_t *src;
+    int ret;
+
+    switch (e->type) {
+    case CHD_HUNK_ZERO:
+        memset(dest, 0, s->hunk_size);
+        return 0;
+    case CHD_HUNK_NONE:
+        ret = bdrv_co_pread(bs->file, e->offset, s->hunk_size, dest, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        break;
+    default:
+        if (!chd_codec_supported(s->codecs[e->type])) {
+            return -ENOTSUP;
+        }
+        src = g_try_malloc(e->length);
+        if (e->length && !src) {
+            return -ENOMEM;
+        }
+        ret = bdrv_co_pread(bs->file, e->offset, e->length, src, 0);
+        if (ret == 0) {
+            CHDDecompressData data = {
+                .codec = s->codecs[e->type],
+                .src = src,
+                .src_size = e->length,
+                .dest = dest,
+                .dest_size = s->hunk_size,
+            };
+
+            ret = chd_co_decompress(bs, &data);
+        }
+        g_free(src);
+        if (ret < 0) {
+            return -EIO;
+        }
+        break;
+    }
+
+    if (s->map_crc && crc_ccitt_false(0xffff, dest, s->hunk_size) != e->crc) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void chd_cache_remove(BDRVCHDState *s, CHDCacheEntry *entry)
+{
+    g_hash_table_remove(s->cache, &entry->hunk);
+    QTAILQ_REMOVE(&s->lru, entry, next);
+    s->cache_entries--;
+}
+
+/*
+ * Return the cache entry for @hunk, decompressing it first if needed.
+ * Called with s->lock held.
+ */
+static CHDCacheEntry * coroutine_fn GRAPH_RDLOCK
+chd_co_get_hunk(BlockDriverState *bs, uint64_t hunk, int *ret)
+{
+    BDRVCHDState *s = bs->opaque;
+    CHDCacheEntry *entry, *victim;
+    uint8_t *data = NULL;
+
+    while ((entry = g_hash_table_lookup(s->cache, &hunk))) {
+        if (!entry->loading) {
+            QTAILQ_REMOVE(&s->lru, entry, next);
+            QTAILQ_INSERT_HEAD(&s->lru, entry, next);
+            *ret = 0;
+            return entry;
+        }
+        qemu_co_queue_wait(&entry->waiters, &s->lock);
+    }
+
+    /* Evict the least recently used hunks that aren't being loaded */
+    QTAILQ_FOREACH_REVERSE_SAFE(victim, &s->lru, next, entry) {
+        if (s->cache_entries < s->cache_max) {
+            break;
+        }
+        if (!victim->loading) {
+            chd_cache_remove(s, victim);
+            if (data) {
+                qemu_vfree(victim->data);
+            } else {
+                data = victim->data;
+            }
+            g_free(victim);
+        }
+    }
+
+    entry = g_new0(CHDCacheEntry, 1);
+    entry->hunk = hunk;
+    entry->data = data ?: qemu_blockalign(bs, s->hunk_size);
+    entry->loading = true;
+    qemu_co_queue_init(&entry->waiters);
+    g_hash_table_insert(s->cache, &entry->hunk, entry);
+    QTAILQ_INSERT_HEAD(&s->lru, entry, next);
+    s->cache_entries++;
+
+    qemu_co_mutex_unlock(&s->lock);
+    *ret = chd_co_load_hunk(bs, hunk, entry->data);
+    qemu_co_mutex_lock(&s->lock);
+
+    entry->loading = false;
+    qemu_co_queue_restart_all(&entry->waiters);
+    if (*ret < 0) {
+        chd_cache_remove(s, entry);
+        qemu_vfree(entry->data);
+        g_free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+typedef struct CHDPrefetch {
+    BlockDriverState *bs;
+    uint64_t hunk;
+} CHDPrefetch;
+
+static void coroutine_fn chd_co_prefetch_entry(void *opaque)
+{
+    CHDPrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVCHDState *s = bs->opaque;
+    int ret;
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        qemu_co_mutex_lock(&s->lock);
+        chd_co_get_hunk(bs, p->hunk, &ret);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    bdrv_dec_in_flight(bs);
+    g_free(p);
+}
+
+/*
+ * Start decompressing @hunk in the background, so that several hunks can
+ * be decompressed in parallel.  Called with s->lock held.
+ */
+static void chd_prefetch(BlockDriverState *bs, uint64_t hunk)
+{
+    BDRVCHDState *s = bs->opaque;
+    CHDPrefetch *p;
+
+    if (hunk >= s->hunk_count || g_hash_table_contains(s->cache, &hunk)) {
+        return;
+    }
+    p = g_new(CHDPrefetch, 1);
+    p->bs = bs;
+    p->hunk = hunk;
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(chd_co_prefetch_entry, p));
+}
+
+/*
+ * Map a guest offset to a hunk and an offset in it, and return how many
+ * bytes from there on are contiguous in the guest's view.
+ */
+static uint64_t chd_map_offset(BDRVCHDState *s, uint64_t offset,
+                               uint64_t *hunk, uint32_t *hunk_offset)
+{
+    uint64_t pos, len;
+
+    if (s->cdrom) {
+        uint64_t frame = s->cd_first_frame + offset / CD_DATA_SIZE;
+
+        pos = frame * CD_FRAME_SIZE + s->cd_data_offset +
+              offset % CD_DATA_SIZE;
+        len = CD_DATA_SIZE - offset % CD_DATA_SIZE;
+    } else {
+        pos = offset;
+        len = s->hunk_size - offset % s->hunk_size;
+    }
+    *hunk = pos / s->hunk_size;
+    *hunk_offset = pos % s->hunk_size;
+    return len;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+chd_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+              QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVCHDState *s = bs->opaque;
+    uint64_t first, last, hunk, i;
+    uint32_t hunk_offset;
+    size_t done = 0;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    chd_map_offset(s, offset, &first, &hunk_offset);
+    chd_map_offset(s, offset + bytes - 1, &last, &hunk_offset);
+    /* Decompress the rest of the request, and what follows it, alongside */
+    for (i = first + 1; i <= last && i - first < s->cache_max / 2; i++) {
+        chd_prefetch(bs, i);
+    }
+    if (offset == s->last_end) {
+        for (i = 1; i <= s->readahead; i++) {
+            chd_prefetch(bs, last + i);
+        }
+    }
+    s->last_end = offset + bytes;
+
+    while (done < bytes) {
+        uint64_t len = chd_map_offset(s, offset + done, &hunk, &hunk_offset);
+        CHDCacheEntry *entry = chd_co_get_hunk(bs, hunk, &ret);
+
+        if (!entry) {
+            break;
+        }
+        len = MIN(len, bytes - done);
+        qemu_iovec_from_buf(qiov, done, entry->data + hunk_offset, len);
+        done += len;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static void chd_close(BlockDriverState *bs)
+{
+    BDRVCHDState *s = bs->opaque;
+    CHDCacheEntry *entry, *next;
+
+    QTAILQ_FOREACH_SAFE(entry, &s->lru, next, next) {
+        qemu_vfree(entry->data);
+        g_free(entry);
+    }
+    g_hash_table_destroy(s->cache);
+    g_free(s->map);
+}
+
+static BlockDriver bdrv_chd = {
+    .format_name    = "chd",
+    .instance_size  = sizeof(BDRVCHDState),
+    .bdrv_probe     = chd_probe,
+    .bdrv_open      = chd_open,
+    .bdrv_child_perm     = bdrv_default_perms,
+    .bdrv_refresh_limits = chd_refresh_limits,
+    .bdrv_co_preadv = chd_co_preadv,
+    .bdrv_close     = chd_close,
+    .is_format      = true,
+};
+
+static void bdrv_chd_init(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t j = (i << 1) ^ (i & 0x80 ? 0x11d : 0);
+
+        ecc_f_lut[i] = j;
+        ecc_b_lut[i ^ j] = i;
+    }
+    bdrv_register(&bdrv_chd);
+}
+
+block_init(bdrv_chd_init);
@@ -0,0 +1,455 @@
+/*
+ * Read-only block driver that serves requests from a mapping of the image
+ *
+ * Only data that is already in the page cache is copied out of the mapping.
+ * Everything else is read with pread() in the thread pool, so that major
+ * faults don't stall the main loop and I/O errors or a file that shrank
+ * come back as -EIO instead of SIGBUS.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/cutils.h"
+#include "qemu/lockable.h"
+#include "qemu/madvise.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/thread.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/raw-aio.h"
+#include "block/thread-pool.h"
+#include "trace.h"
+
+/*
+ * The kernel's own read-ahead is turned off for the mapping, which would
+ * otherwise pull in pages around every random access.  Instead, a window
+ * ahead of sequential readers is requested with MADV_WILLNEED.  It starts
+ * at the minimum and doubles on every sequential request, up to the
+ * maximum.
+ */
+#define FILE_MMAP_RA_MIN (128 * KiB)
+#define FILE_MMAP_RA_MAX (4 * MiB)
+
+/* Pages checked per mincore() call */
+#define FILE_MMAP_MINCORE_PAGES 64
+
+/*
+ * The same lock bytes as file-posix: we read the image and don't let anyone
+ * write to it or resize it under the mapping
+ */
+#define FILE_MMAP_PERM BLK_PERM_CONSISTENT_READ
+#define FILE_MMAP_UNSHARED (BLK_PERM_WRITE | BLK_PERM_RESIZE)
+
+#ifdef CONFIG_LINUX
+typedef unsigned char FileMmapVec;
+#else
+typedef char FileMmapVec;
+#endif
+
+typedef struct BDRVFileMmapState {
+    int fd;
+    uint8_t *map;
+    int64_t length;
+
+    QemuMutex ra_lock;
+    int64_t ra_next;    /* where a sequential reader continues */
+    int64_t ra_end;     /* end of the data that was already requested */
+    int64_t ra_window;
+} BDRVFileMmapState;
+
+typedef struct FileMmapReadTask {
+    int fd;
+    int64_t offset;
+    int64_t bytes;
+    uint8_t *buf;
+} FileMmapReadTask;
+
+static QemuOptsList file_mmap_runtime_opts = {
+    .name = "file-mmap",
+    .head = QTAILQ_HEAD_INITIALIZER(file_mmap_runtime_opts.head),
+    .desc = {
+        {
+            .name = "filename",
+            .type = QEMU_OPT_STRING,
+            .help = "File name of the image",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void file_mmap_parse_filename(const char *filename, QDict *options,
+                                     Error **errp)
+{
+    bdrv_parse_filename_strip_prefix(filename, "file-mmap:", options);
+}
+
+/*
+ * Take the lock bytes of file-posix with OFD locks, which go away when the
+ * file is closed.  Without OFD locks, file-posix doesn't lock by default
+ * either.
+ */
+static int file_mmap_lock(int fd, const char *filename, Error **errp)
+{
+    g_autofree char *perm_name = NULL;
+    bool shared = false;
+    uint64_t p = 0;
+    int ret = 0;
+    int i;
+
+    if (!qemu_has_ofd_lock()) {
+        return 0;
+    }
+
+    for (i = 0; (1ULL << i) <= BLK_PERM_ALL && !ret; i++) {
+        p = 1ULL << i;
+        if (FILE_MMAP_PERM & p) {
+            /* Fails if someone else doesn't share the permission */
+            ret = qemu_lock_fd(fd, RAW_LOCK_PERM_BASE + i, 1, false);
+            if (!ret) {
+                ret = qemu_lock_fd_test(fd, RAW_LOCK_SHARED_BASE + i, 1,
+                                        true);
+            }
+            shared = false;
+        } else if (FILE_MMAP_UNSHARED & p) {
+            /* Fails if someone else holds the permission */
+            ret = qemu_lock_fd(fd, RAW_LOCK_SHARED_BASE + i, 1, false);
+            if (!ret) {
+                ret = qemu_lock_fd_test(fd, RAW_LOCK_PERM_BASE + i, 1, true);
+            }
+            shared = true;
+        }
+    }
+    if (!ret) {
+        return 0;
+    }
+
+    perm_name = bdrv_perm_names(p);
+    if (ret == -EAGAIN || ret == -EACCES) {
+        error_setg(errp, "Failed to get %s\"%s\" lock",
+                   shared ? "shared " : "", perm_name);
+    } else {
+        error_setg_errno(errp, -ret, "Failed to get %s\"%s\" lock",
+                         shared ? "shared " : "", perm_name);
+    }
+    error_append_hint(errp, "Is another process using the image [%s]?\n",
+                      filename);
+    return ret;
+}
+
+static int file_mmap_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVFileMmapState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *filename;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    bdrv_graph_rdlock_main_loop();
+    ret = bdrv_apply_auto_read_only(bs, "file-mmap driver is read-only",
+                                    errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        return ret;
+    }
+    if (flags & BDRV_O_NOCACHE) {
+        error_setg(errp, "file-mmap driver does not support cache.direct=on");
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&file_mmap_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    filename = qemu_opt_get(opts, "filename");
+
+    s->fd = qemu_open(filename, O_RDONLY, errp);
+    if (s->fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    ret = file_mmap_lock(s->fd, filename, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Works for block devices as well as for regular files */
+    s->length = lseek(s->fd, 0, SEEK_END);
+    if (s->length < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not get the size of '%s'",
+                         filename);
+        goto fail;
+    }
+    if (s->length > SIZE_MAX) {
+        error_setg(errp, "'%s' is too large to be mapped", filename);
+        ret = -EFBIG;
+        goto fail;
+    }
+
+    if (s->length) {
+        s->map = mmap(NULL, s->length, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (s->map == MAP_FAILED) {
+            s->map = NULL;
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not map '%s'", filename);
+            goto fail;
+        }
+        qemu_madvise(s->map, s->length, QEMU_MADV_RANDOM);
+    }
+
+    qemu_mutex_init(&s->ra_lock);
+    s->ra_next = -1;
+    s->ra_window = FILE_MMAP_RA_MIN;
+    ret = 0;
+    goto out;
+
+fail:
+    qemu_close(s->fd);
+    s->fd = -1;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void file_mmap_close(BlockDriverState *bs)
+{
+    BDRVFileMmapState *s = bs->opaque;
+
+    if (s->map) {
+        munmap(s->map, s->length);
+    }
+    qemu_mutex_destroy(&s->ra_lock);
+    qemu_close(s->fd);
+}
+
+static void file_mmap_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    /* memcpy() doesn't care about alignment */
+    bs->bl.request_alignment = 1;
+}
+
+static int file_mmap_reopen_prepare(BDRVReopenState *state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    if (state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "file-mmap driver is read-only");
+        return -EACCES;
+    }
+    return 0;
+}
+
+/*
+ * Tell the kernel which pages the next requests will probably touch, so
+ * that it can read them in while the guest is busy with the current ones.
+ */
+static void file_mmap_advise(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes)
+{
+    BDRVFileMmapState *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int64_t ra_start, ra_end;
+
+    WITH_QEMU_LOCK_GUARD(&s->ra_lock) {
+        if (offset != s->ra_next) {
+            /*
+             * Random access: only fetch what is needed right now, and leave
+             * single pages to the page fault
+             */
+            s->ra_window = FILE_MMAP_RA_MIN;
+            s->ra_end = end;
+            s->ra_next = end;
+            if (bytes <= qemu_real_host_page_size()) {
+                return;
+            }
+            ra_start = offset;
+            ra_end = end;
+        } else if (end + s->ra_window / 2 > s->ra_end) {
+            /* Sequential reader getting close to the end of the window */
+            s->ra_window = MIN(s->ra_window * 2, FILE_MMAP_RA_MAX);
+            ra_start = MAX(s->ra_end, offset);
+            ra_end = MIN(end + s->ra_window, s->length);
+            s->ra_end = ra_end;
+            s->ra_next = end;
+        } else {
+            s->ra_next = end;
+            return;
+        }
+    }
+
+    /* madvise() wants a page aligned start address */
+    ra_start = QEMU_ALIGN_DOWN(ra_start, qemu_real_host_page_size());
+    if (ra_end > ra_start) {
+        trace_file_mmap_advise(bs, ra_start, ra_end - ra_start);
+        qemu_madvise(s->map + ra_start, ra_end - ra_start,
+                     QEMU_MADV_WILLNEED);
+    }
+}
+
+/* Whether all pages of [@offset, @offset + @bytes) are in the page cache */
+static bool file_mmap_is_cached(BDRVFileMmapState *s, int64_t offset,
+                                int64_t bytes)
+{
+    size_t page_size = qemu_real_host_page_size();
+    int64_t start = QEMU_ALIGN_DOWN(offset, page_size);
+    int64_t end = offset + bytes;
+    FileMmapVec vec[FILE_MMAP_MINCORE_PAGES];
+
+    while (start < end) {
+        int64_t len = MIN(end - start,
+                          (int64_t)FILE_MMAP_MINCORE_PAGES * page_size);
+        size_t pages = DIV_ROUND_UP(len, page_size);
+        size_t i;
+
+        if (mincore(s->map + start, len, vec) < 0) {
+            return false;
+        }
+        for (i = 0; i < pages; i++) {
+            if (!(vec[i] & 1)) {
+                return false;
+            }
+        }
+        start += len;
+    }
+    return true;
+}
+
+static int file_mmap_read_func(void *opaque)
+{
+    FileMmapReadTask *t = opaque;
+    int64_t done = 0;
+    ssize_t len;
+
+    while (done < t->bytes) {
+        len = pread(t->fd, t->buf + done, t->bytes - done, t->offset + done);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            /* The file was truncated */
+            return -EIO;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+/* Read data that isn't cached without touching the mapping */
+static int coroutine_fn
+file_mmap_co_read(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                  QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVFileMmapState *s = bs->opaque;
+    FileMmapReadTask t = {
+        .fd = s->fd,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    int ret;
+
+    t.buf = g_try_malloc(bytes);
+    if (!t.buf) {
+        return -ENOMEM;
+    }
+
+    trace_file_mmap_read(bs, offset, bytes);
+    ret = thread_pool_submit_co(file_mmap_read_func, &t);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, t.buf, bytes);
+    }
+    g_free(t.buf);
+    return ret;
+}
+
+static int coroutine_fn
+file_mmap_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    BDRVFileMmapState *s = bs->opaque;
+    int64_t n;
+    int ret;
+
+    /*
+     * The image length is rounded up to whole sectors, the tail of the last
+     * one reads as zeroes
+     */
+    n = MIN(bytes, MAX(s->length - offset, 0));
+    if (n) {
+        file_mmap_advise(bs, offset, n);
+        if (file_mmap_is_cached(s, offset, n)) {
+            qemu_iovec_from_buf(qiov, qiov_offset, s->map + offset, n);
+        } else {
+            ret = file_mmap_co_read(bs, offset, n, qiov, qiov_offset);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    if (n < bytes) {
+        qemu_iovec_memset(qiov, qiov_offset + n, 0, bytes - n);
+    }
+    return 0;
+}
+
+static int64_t coroutine_fn file_mmap_co_getlength(BlockDriverState *bs)
+{
+    BDRVFileMmapState *s = bs->opaque;
+
+    return s->length;
+}
+
+static int64_t coroutine_fn
+file_mmap_co_get_allocated_file_size(BlockDriverState *bs)
+{
+    BDRVFileMmapState *s = bs->opaque;
+    struct stat st;
+
+    if (fstat(s->fd, &st) < 0) {
+        return -errno;
+    }
+    return (int64_t)st.st_blocks * 512;
+}
+
+static const char *const file_mmap_strong_runtime_opts[] = {
+    "filename",
+
+    NULL
+};
+
+static BlockDriver bdrv_file_mmap = {
+    .format_name            = "file-mmap",
+    .protocol_name          = "file-mmap",
+    .instance_size          = sizeof(BDRVFileMmapState),
+    .bdrv_needs_filename    = true,
+
+    .bdrv_parse_filename    = file_mmap_parse_filename,
+    .bdrv_open              = file_mmap_open,
+    .bdrv_close             = file_mmap_close,
+    .bdrv_reopen_prepare    = file_mmap_reopen_prepare,
+    .bdrv_refresh_limits    = file_mmap_refresh_limits,
+
+    .bdrv_co_preadv_part    = file_mmap_co_preadv_part,
+    .bdrv_co_getlength      = file_mmap_co_getlength,
+    .bdrv_co_get_allocated_file_size = file_mmap_co_get_allocated_file_size,
+
+    .strong_runtime_opts    = file_mmap_strong_runtime_opts,
+};
+
+static void bdrv_file_mmap_init(void)
+{
+    bdrv_register(&bdrv_file_mmap);
+}
+
+block_init(bdrv_file_mmap_init);
@@ -129,11 +129,6 @@
 
 #define MAX_BLOCKSIZE	4096
 
-/* Posix file locking bytes. Libvirt takes byte 0, we start from higher bytes,
- * leaving a few more bytes for its future use. */
-#define RAW_LOCK_PERM_BASE             100
-#define RAW_LOCK_SHARED_BASE           200
-
 typedef struct BDRVRawState {
     int fd;
     bool use_lock;
@@ -161,6 +156,7 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    int io_uring_flags; /* LURING_FIXED_* */
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -561,6 +557,18 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed-files",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest memory with io_uring (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -638,6 +646,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    if (qemu_opt_get_bool(opts, "io-uring-fixed-files", false)) {
+        s->io_uring_flags |= LURING_FIXED_FILE;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-fixed-buffers", false)) {
+        s->io_uring_flags |= LURING_FIXED_BUF;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -2455,6 +2469,19 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
 }
 #endif
 
+/*
+ * Forget about @fd before it is closed, so that a file opened later with
+ * the same number isn't accessed through a stale io_uring file table entry
+ */
+static void raw_forget_fd(BDRVRawState *s, int fd)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_flags & LURING_FIXED_FILE) {
+        luring_unregister_fd(fd);
+    }
+#endif
+}
+
 #ifdef CONFIG_LINUX_AIO
 static inline bool raw_check_linux_aio(BDRVRawState *s)
 {
@@ -2508,7 +2535,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
 #ifdef CONFIG_LINUX_IO_URING
     } else if (raw_check_linux_io_uring(s)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        ret = luring_co_submit(bs, s->fd, offset, qiov, type,
+                               s->io_uring_flags);
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2600,7 +2628,8 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH,
+                                s->io_uring_flags);
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2619,11 +2648,36 @@ static void raw_close(BlockDriverState *bs)
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
 #endif
+        raw_forget_fd(s, s->fd);
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring_flags & LURING_FIXED_BUF) {
+        luring_register_buf(host, size);
+    }
+#endif
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring_flags & LURING_FIXED_BUF) {
+        luring_unregister_buf(host, size);
+    }
+#endif
+}
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -3809,6 +3863,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_forget_fd(s, s->fd);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3916,6 +3971,8 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4287,6 +4344,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_abort_perm_update = raw_abort_perm_update,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     /* generic scsi device */
 #ifdef __linux__
@@ -16,6 +16,8 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "trace.h"
@@ -26,6 +28,12 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the table of fixed files of each ring */
+#define MAX_FIXED_FILES 64
+
+/* The kernel doesn't register buffers larger than that */
+#define MAX_FIXED_BUF_SIZE (1ULL << 30)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -58,8 +66,53 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * Fixed files: the fd in each slot of the ring's file table, or -1.
+     * luring_unregister_fd() can be called from any thread, so this is
+     * protected by files_lock.
+     */
+    QemuMutex files_lock;
+    int fixed_files[MAX_FIXED_FILES];
+    bool fixed_files_registered;
+    bool fixed_files_failed;
+
+    /*
+     * Fixed buffers: luring_bufs as registered with this ring, split into
+     * chunks the kernel accepts and sorted by address.  Only accessed from
+     * the AioContext home thread.
+     */
+    struct iovec *fixed_bufs;
+    unsigned int nb_fixed_bufs;
+    unsigned int fixed_bufs_generation;
+    bool fixed_bufs_failed;
+
+    QLIST_ENTRY(LuringState) next;
 };
 
+typedef struct LuringBuf {
+    void *host;
+    size_t size;
+    unsigned int refcnt;
+} LuringBuf;
+
+/*
+ * All rings, for luring_unregister_fd(), and the buffers that fixed buffer
+ * I/O can use.  Rings pick up changes to luring_bufs lazily, when the
+ * generation counter has changed.
+ */
+static QemuMutex luring_lock;
+static QLIST_HEAD(, LuringState) luring_states =
+    QLIST_HEAD_INITIALIZER(luring_states);
+static GArray *luring_bufs;
+static unsigned int luring_bufs_generation;
+
+static void __attribute__((__constructor__)) luring_lock_init(void)
+{
+    qemu_mutex_init(&luring_lock);
+    luring_bufs = g_array_new(false, false, sizeof(LuringBuf));
+}
+
 /**
  * luring_resubmit:
  *
@@ -102,8 +155,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 
     /* Update sqe */
     luringcb->sqeq.off += nread;
-    luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
-    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* Same buffer index, the rest of the buffer */
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len -= nread;
+    } else {
+        luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+        luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    }
 
     luring_resubmit(s, luringcb);
 }
@@ -323,6 +382,177 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
+/**
+ * luring_fixed_file:
+ *
+ * Returns the slot of @fd in the file table of the ring, registering it if
+ * necessary, or -1 if it can't be used as a fixed file.
+ */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int slot, free_slot = -1;
+    int ret;
+
+    QEMU_LOCK_GUARD(&s->files_lock);
+
+    if (s->fixed_files_failed) {
+        return -1;
+    }
+    if (!s->fixed_files_registered) {
+        /* Start with an empty table, slots are filled in on first use */
+        ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                      MAX_FIXED_FILES);
+        if (ret < 0) {
+            goto fail;
+        }
+        s->fixed_files_registered = true;
+    }
+
+    for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+        if (s->fixed_files[slot] == fd) {
+            return slot;
+        }
+        if (s->fixed_files[slot] == -1 && free_slot == -1) {
+            free_slot = slot;
+        }
+    }
+    if (free_slot == -1) {
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, free_slot, &fd, 1);
+    if (ret < 0) {
+        goto fail;
+    }
+    s->fixed_files[free_slot] = fd;
+    trace_luring_fixed_file(s, fd, free_slot);
+    return free_slot;
+
+fail:
+    warn_report("io_uring: could not register fixed files (%s), falling "
+                "back to regular file descriptors", strerror(-ret));
+    s->fixed_files_failed = true;
+    return -1;
+}
+
+static int luring_iovec_compare(const void *a, const void *b)
+{
+    const struct iovec *x = a, *y = b;
+
+    return x->iov_base < y->iov_base ? -1 : x->iov_base > y->iov_base;
+}
+
+/**
+ * luring_sync_fixed_bufs:
+ *
+ * Registers the current set of luring_bufs with the ring if it changed.
+ * Returns whether the registered buffers are up to date and can be used.
+ */
+static bool luring_sync_fixed_bufs(LuringState *s)
+{
+    unsigned int generation = qatomic_read(&luring_bufs_generation);
+    g_autofree struct iovec *iov = NULL;
+    unsigned int n = 0;
+    guint i;
+    int ret;
+
+    if (s->fixed_bufs_failed) {
+        return false;
+    }
+    if (generation == s->fixed_bufs_generation) {
+        return true;
+    }
+    /*
+     * Older kernels wait for all requests to complete in
+     * io_uring_unregister_buffers(), so only do this when idle.  Queued
+     * requests would also be left with the buffer index of the old
+     * registration.  Until then, a buffer may have been unregistered, so
+     * don't use any.
+     */
+    if (s->io_q.in_flight || s->io_q.in_queue) {
+        return false;
+    }
+
+    if (s->nb_fixed_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+        g_free(s->fixed_bufs);
+        s->fixed_bufs = NULL;
+        s->nb_fixed_bufs = 0;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        generation = luring_bufs_generation;
+        for (i = 0; i < luring_bufs->len; i++) {
+            LuringBuf *buf = &g_array_index(luring_bufs, LuringBuf, i);
+            size_t done;
+
+            for (done = 0; done < buf->size; done += MAX_FIXED_BUF_SIZE) {
+                iov = g_renew(struct iovec, iov, n + 1);
+                iov[n].iov_base = buf->host + done;
+                iov[n].iov_len = MIN(buf->size - done, MAX_FIXED_BUF_SIZE);
+                n++;
+            }
+        }
+    }
+    s->fixed_bufs_generation = generation;
+
+    if (!n) {
+        return true;
+    }
+    qsort(iov, n, sizeof(*iov), luring_iovec_compare);
+
+    ret = io_uring_register_buffers(&s->ring, iov, n);
+    trace_luring_register_buffers(s, n, ret);
+    if (ret < 0) {
+        warn_report("io_uring: could not register guest memory as fixed "
+                    "buffers (%s), falling back to regular buffers",
+                    strerror(-ret));
+        s->fixed_bufs_failed = true;
+        return false;
+    }
+    s->fixed_bufs = g_steal_pointer(&iov);
+    s->nb_fixed_bufs = n;
+    return true;
+}
+
+/**
+ * luring_fixed_buf:
+ *
+ * Returns the index of the fixed buffer that contains all of @qiov, or -1 if
+ * there is none.  Only single-element vectors can use fixed buffers.
+ */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    void *base;
+    size_t len;
+    int lo = 0, hi = s->nb_fixed_bufs;
+
+    if (qiov->niov != 1) {
+        return -1;
+    }
+    base = qiov->iov[0].iov_base;
+    len = qiov->iov[0].iov_len;
+
+    /* Find the last buffer that starts at or before base */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (s->fixed_bufs[mid].iov_base <= base) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    lo--;
+    if (base + len > s->fixed_bufs[lo].iov_base + s->fixed_bufs[lo].iov_len) {
+        return -1;
+    }
+    return lo;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -330,37 +560,71 @@ static void luring_deferred_fn(void *opaque)
  * @s: AIO state
  * @offset: offset for request
  * @type: type of request
+ * @flags: LURING_FIXED_* features to use if possible
  *
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+                            uint64_t offset, int type, int flags)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int file = fd;
+    int buf_index = -1;
+
+    if (flags & LURING_FIXED_FILE) {
+        int slot = luring_fixed_file(s, fd);
+
+        if (slot >= 0) {
+            file = slot;
+        } else {
+            flags &= ~LURING_FIXED_FILE;
+        }
+    }
+    if ((flags & LURING_FIXED_BUF) && luringcb->qiov &&
+        luring_sync_fixed_bufs(s)) {
+        buf_index = luring_fixed_buf(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, file,
+                                      luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len,
+                                      offset, buf_index);
+            break;
+        }
+        io_uring_prep_writev(sqes, file, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+        io_uring_prep_writev(sqes, file, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, file,
+                                     luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len,
+                                     offset, buf_index);
+            break;
+        }
+        io_uring_prep_readv(sqes, file, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_FLUSH:
-        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        io_uring_prep_fsync(sqes, file, IORING_FSYNC_DATASYNC);
         break;
     default:
         fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
                         __func__, type);
         abort();
     }
+    if (flags & LURING_FIXED_FILE) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -380,7 +644,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+                                  QEMUIOVector *qiov, int type, int flags)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
@@ -393,7 +657,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, &luringcb, s, offset, type, flags);
 
     if (ret < 0) {
         return ret;
@@ -422,15 +686,30 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp)
 {
-    int rc;
+    int rc = -EINVAL;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    int i;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (sqpoll_idle) {
+        struct io_uring_params p = {
+            .flags = IORING_SETUP_SQPOLL,
+            .sq_thread_idle = MIN(sqpoll_idle, UINT32_MAX),
+        };
+
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &p);
+        if (rc < 0) {
+            warn_report("io_uring: could not set up SQPOLL (%s), falling "
+                        "back to submission by system call", strerror(-rc));
+        }
+    }
+    if (rc < 0) {
+        rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    }
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -438,13 +717,85 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
+    qemu_mutex_init(&s->files_lock);
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        QLIST_INSERT_HEAD(&luring_states, s, next);
+    }
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        QLIST_REMOVE(s, next);
+    }
     io_uring_queue_exit(&s->ring);
+    qemu_mutex_destroy(&s->files_lock);
+    g_free(s->fixed_bufs);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
+
+void luring_unregister_fd(int fd)
+{
+    LuringState *s;
+    int slot;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+    QLIST_FOREACH(s, &luring_states, next) {
+        QEMU_LOCK_GUARD(&s->files_lock);
+
+        for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+            if (s->fixed_files[slot] == fd) {
+                int unused = -1;
+
+                io_uring_register_files_update(&s->ring, slot, &unused, 1);
+                s->fixed_files[slot] = -1;
+            }
+        }
+    }
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+    guint i;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+    for (i = 0; i < luring_bufs->len; i++) {
+        LuringBuf *buf = &g_array_index(luring_bufs, LuringBuf, i);
+
+        if (buf->host == host && buf->size == size) {
+            buf->refcnt++;
+            return;
+        }
+    }
+    g_array_append_val(luring_bufs, ((LuringBuf) {
+        .host = host,
+        .size = size,
+        .refcnt = 1,
+    }));
+    qatomic_inc(&luring_bufs_generation);
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    guint i;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+    for (i = 0; i < luring_bufs->len; i++) {
+        LuringBuf *buf = &g_array_index(luring_bufs, LuringBuf, i);
+
+        if (buf->host == host && buf->size == size) {
+            if (--buf->refcnt == 0) {
+                g_array_remove_index_fast(luring_bufs, i);
+                qatomic_inc(&luring_bufs_generation);
+            }
+            return;
+        }
+    }
+}
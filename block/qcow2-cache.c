@@ -25,18 +25,49 @@
 #include "qemu/osdep.h"
 #include "block/block-io.h"
 #include "qemu/memalign.h"
+#include "qemu/queue.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Replacement follows ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low
+ * Overhead Replacement Cache"): tables that were used once live on the
+ * RECENT list, tables that were used again after some other table was
+ * released move to FREQUENT.  A scan only ever fills RECENT, so it cannot
+ * push the working set out of FREQUENT.  The offsets of evicted tables are
+ * remembered on the two ghost lists; a miss that hits a ghost shifts the
+ * balance between RECENT and FREQUENT towards the list it came from.
+ *
+ * Each list is ordered from least to most recently used.
+ */
+typedef enum Qcow2CacheList {
+    QCOW2_CACHE_FREE,
+    QCOW2_CACHE_RECENT,
+    QCOW2_CACHE_FREQUENT,
+    QCOW2_CACHE_GHOST_FREE,
+    QCOW2_CACHE_GHOST_RECENT,
+    QCOW2_CACHE_GHOST_FREQUENT,
+    QCOW2_CACHE_LIST_MAX,
+} Qcow2CacheList;
+
+/* Number of lookups after which an autosized cache is reconsidered */
+#define QCOW2_CACHE_AUTOSIZE_WINDOW 256
+
+/* Number of quiet windows after which an autosized cache shrinks */
+#define QCOW2_CACHE_AUTOSIZE_SHRINK_DELAY 4
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    Qcow2CacheList list;
+    QTAILQ_ENTRY(Qcow2CachedTable) next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
+    Qcow2CachedTable       *ghosts;
     struct Qcow2Cache      *depends;
     int                     size;
     int                     table_size;
@@ -44,6 +75,27 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Resident and ghost entries by offset */
+    GHashTable             *index;
+    QTAILQ_HEAD(, Qcow2CachedTable) lists[QCOW2_CACHE_LIST_MAX];
+    int                     len[QCOW2_CACHE_LIST_MAX];
+
+    /* Number of tables that may be resident, at most @size */
+    int                     limit;
+    /* Number of tables ARC wants to keep on the RECENT list */
+    int                     target;
+
+    bool                    autosize;
+    int                     min_limit;
+    int                     quiet_windows;
+    uint64_t                window_lookups;
+    uint64_t                window_misses;
+    uint64_t                window_ghost_hits;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                ghost_hits;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -71,6 +123,92 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+static inline int qcow2_cache_resident(Qcow2Cache *c)
+{
+    return c->len[QCOW2_CACHE_RECENT] + c->len[QCOW2_CACHE_FREQUENT];
+}
+
+static void qcow2_cache_move(Qcow2Cache *c, Qcow2CachedTable *t,
+                             Qcow2CacheList list)
+{
+    QTAILQ_REMOVE(&c->lists[t->list], t, next);
+    c->len[t->list]--;
+    t->list = list;
+    QTAILQ_INSERT_TAIL(&c->lists[list], t, next);
+    c->len[list]++;
+}
+
+static void qcow2_cache_set_offset(Qcow2Cache *c, Qcow2CachedTable *t,
+                                   int64_t offset)
+{
+    if (t->offset) {
+        g_hash_table_remove(c->index, &t->offset);
+    }
+    t->offset = offset;
+    if (offset) {
+        assert(!g_hash_table_contains(c->index, &t->offset));
+        g_hash_table_insert(c->index, &t->offset, t);
+    }
+}
+
+/* Drops the least recently used entry of a ghost list */
+static void qcow2_cache_drop_ghost(Qcow2Cache *c, Qcow2CacheList list)
+{
+    Qcow2CachedTable *g = QTAILQ_FIRST(&c->lists[list]);
+
+    qcow2_cache_set_offset(c, g, 0);
+    qcow2_cache_move(c, g, QCOW2_CACHE_GHOST_FREE);
+}
+
+/* Remembers the offset of a table that was just evicted from @list */
+static void qcow2_cache_add_ghost(Qcow2Cache *c, int64_t offset,
+                                  Qcow2CacheList list)
+{
+    Qcow2CachedTable *g;
+    Qcow2CacheList ghost_list = list == QCOW2_CACHE_RECENT ?
+        QCOW2_CACHE_GHOST_RECENT : QCOW2_CACHE_GHOST_FREQUENT;
+
+    /*
+     * Unlike in ARC proper, RECENT and its ghosts are not limited to the
+     * cache size together: a loop over a working set a bit larger than the
+     * cache only ever uses RECENT, and would never hit a ghost otherwise.
+     */
+    while (c->len[QCOW2_CACHE_GHOST_RECENT] +
+           c->len[QCOW2_CACHE_GHOST_FREQUENT] >= c->limit) {
+        qcow2_cache_drop_ghost(c, c->len[QCOW2_CACHE_GHOST_FREQUENT] ?
+                               QCOW2_CACHE_GHOST_FREQUENT :
+                               QCOW2_CACHE_GHOST_RECENT);
+    }
+
+    g = QTAILQ_FIRST(&c->lists[QCOW2_CACHE_GHOST_FREE]);
+    qcow2_cache_set_offset(c, g, offset);
+    qcow2_cache_move(c, g, ghost_list);
+}
+
+static void qcow2_cache_clear_ghosts(Qcow2Cache *c)
+{
+    while (c->len[QCOW2_CACHE_GHOST_RECENT]) {
+        qcow2_cache_drop_ghost(c, QCOW2_CACHE_GHOST_RECENT);
+    }
+    while (c->len[QCOW2_CACHE_GHOST_FREQUENT]) {
+        qcow2_cache_drop_ghost(c, QCOW2_CACHE_GHOST_FREQUENT);
+    }
+}
+
+/* Forgets the table in entry @i, which must not be in use */
+static void qcow2_cache_entry_clear(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    qcow2_cache_set_offset(c, t, 0);
+    t->lru_counter = 0;
+    t->dirty = false;
+    if (t->list != QCOW2_CACHE_FREE) {
+        qcow2_cache_move(c, t, QCOW2_CACHE_FREE);
+    }
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -106,8 +244,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_clear(c, i);
             i++;
             to_clean++;
         }
@@ -125,6 +262,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -134,20 +272,95 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->limit = num_tables;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->ghosts = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->ghosts || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->ghosts);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < QCOW2_CACHE_LIST_MAX; i++) {
+        QTAILQ_INIT(&c->lists[i]);
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].list = QCOW2_CACHE_FREE;
+        QTAILQ_INSERT_TAIL(&c->lists[QCOW2_CACHE_FREE], &c->entries[i], next);
+        c->ghosts[i].list = QCOW2_CACHE_GHOST_FREE;
+        QTAILQ_INSERT_TAIL(&c->lists[QCOW2_CACHE_GHOST_FREE], &c->ghosts[i],
+                           next);
     }
+    c->len[QCOW2_CACHE_FREE] = num_tables;
+    c->len[QCOW2_CACHE_GHOST_FREE] = num_tables;
 
     return c;
 }
 
+void qcow2_cache_set_autosize(Qcow2Cache *c, int min_tables)
+{
+    assert(min_tables > 0 && min_tables <= c->size);
+    assert(qcow2_cache_resident(c) == 0);
+
+    c->autosize = true;
+    c->min_limit = min_tables;
+    c->limit = MAX(min_tables, c->size / 16);
+    c->target = 0;
+}
+
+/*
+ * Hits on ghost entries are misses that a bigger cache would have avoided,
+ * so an autosized cache grows when they make up a good part of its misses.
+ * It shrinks again after it has seen hardly any misses for a while; if that
+ * was too much, the tables it lost show up as ghost hits and it grows back.
+ */
+static void qcow2_cache_autosize(BDRVQcow2State *s, Qcow2Cache *c)
+{
+    int limit = c->limit;
+
+    if (c->window_ghost_hits * 4 >= c->window_misses &&
+        c->window_ghost_hits >= QCOW2_CACHE_AUTOSIZE_WINDOW / 64) {
+        limit = MIN(c->size, limit * 2);
+        c->quiet_windows = 0;
+    } else if (c->window_ghost_hits == 0 &&
+               c->window_misses <= QCOW2_CACHE_AUTOSIZE_WINDOW / 64) {
+        if (++c->quiet_windows >= QCOW2_CACHE_AUTOSIZE_SHRINK_DELAY) {
+            limit = MAX(c->min_limit, limit - limit / 8);
+            c->quiet_windows = 0;
+        }
+    } else {
+        c->quiet_windows = 0;
+    }
+
+    if (limit != c->limit) {
+        trace_qcow2_cache_autosize(c == s->l2_table_cache, c->limit, limit,
+                                   c->window_misses, c->window_ghost_hits);
+        c->limit = limit;
+        c->target = MIN(c->target, limit);
+    }
+
+    c->window_lookups = 0;
+    c->window_misses = 0;
+    c->window_ghost_hits = 0;
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    *stats = (Qcow2CacheStats) {
+        .size       = (uint64_t) c->limit * c->table_size,
+        .max_size   = (uint64_t) c->size * c->table_size,
+        .hits       = c->hits,
+        .misses     = c->misses,
+        .ghost_hits = c->ghost_hits,
+    };
+}
+
 int qcow2_cache_destroy(Qcow2Cache *c)
 {
     int i;
@@ -156,7 +369,9 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    g_hash_table_destroy(c->index);
     qemu_vfree(c->table_array);
+    g_free(c->ghosts);
     g_free(c->entries);
     g_free(c);
 
@@ -308,14 +523,77 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_clear(c, i);
     }
+    qcow2_cache_clear_ghosts(c);
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->target = 0;
+
+    return 0;
+}
+
+/*
+ * Frees up one table slot.  @ghost_list tells which ghost list the table
+ * that is about to be loaded came from, if any.
+ */
+static int GRAPH_RDLOCK
+qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c,
+                  Qcow2CacheList ghost_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CacheList from, list;
+    Qcow2CachedTable *t = NULL;
+    int64_t offset;
+    int i, ret;
+
+    if (c->len[QCOW2_CACHE_RECENT] &&
+        (c->len[QCOW2_CACHE_RECENT] > c->target ||
+         (ghost_list == QCOW2_CACHE_GHOST_FREQUENT &&
+          c->len[QCOW2_CACHE_RECENT] == c->target))) {
+        from = QCOW2_CACHE_RECENT;
+    } else {
+        from = QCOW2_CACHE_FREQUENT;
+    }
+
+    /* Tables that are in use cannot go, try the other list if need be */
+    list = from;
+    do {
+        QTAILQ_FOREACH(t, &c->lists[list], next) {
+            if (t->ref == 0) {
+                break;
+            }
+        }
+        list = list == QCOW2_CACHE_RECENT ?
+            QCOW2_CACHE_FREQUENT : QCOW2_CACHE_RECENT;
+    } while (!t && list != from);
+
+    if (!t) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
+    }
+
+    i = t - c->entries;
+    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                        c == s->l2_table_cache, i);
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    offset = t->offset;
+    list = t->list;
+    qcow2_cache_entry_clear(c, i);
+    qcow2_cache_add_ghost(c, offset, list);
+
+    /* Give back the memory of tables that no longer fit after shrinking */
+    if (qcow2_cache_resident(c) >= c->limit) {
+        qcow2_cache_table_release(c, i, 1);
+    }
 
     return 0;
 }
@@ -325,11 +603,10 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
+    Qcow2CacheList ghost_list = QCOW2_CACHE_FREE;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -343,41 +620,59 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         return -EIO;
     }
 
+    if (c->autosize && ++c->window_lookups >= QCOW2_CACHE_AUTOSIZE_WINDOW) {
+        qcow2_cache_autosize(s, c);
+    }
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    t = g_hash_table_lookup(c->index, &offset);
+    if (t && (t->list == QCOW2_CACHE_RECENT ||
+              t->list == QCOW2_CACHE_FREQUENT)) {
+        c->hits++;
+        /*
+         * Repeated lookups while nothing else was released belong to the
+         * same access (e.g. consecutive clusters of one request or of a
+         * sequential scan) and don't make a table frequently used.
+         */
+        if (t->ref == 0 && t->lru_counter != c->lru_counter) {
+            qcow2_cache_move(c, t, QCOW2_CACHE_FREQUENT);
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        i = t - c->entries;
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    c->misses++;
+    c->window_misses++;
+    if (t) {
+        /* A ghost: adapt the target size of the RECENT list */
+        int recent = c->len[QCOW2_CACHE_GHOST_RECENT];
+        int frequent = c->len[QCOW2_CACHE_GHOST_FREQUENT];
+
+        ghost_list = t->list;
+        c->ghost_hits++;
+        c->window_ghost_hits++;
+        if (ghost_list == QCOW2_CACHE_GHOST_RECENT) {
+            c->target = MIN(c->limit, c->target + MAX(frequent / recent, 1));
+        } else {
+            c->target = MAX(0, c->target - MAX(recent / frequent, 1));
+        }
+        qcow2_cache_set_offset(c, t, 0);
+        qcow2_cache_move(c, t, QCOW2_CACHE_GHOST_FREE);
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
-
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+    while (qcow2_cache_resident(c) >= c->limit) {
+        ret = qcow2_cache_evict(bs, c, ghost_list);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
+    t = QTAILQ_FIRST(&c->lists[QCOW2_CACHE_FREE]);
+    i = t - c->entries;
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -390,7 +685,10 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, t, offset);
+    t->lru_counter = c->lru_counter;
+    qcow2_cache_move(c, t, ghost_list == QCOW2_CACHE_FREE ?
+                     QCOW2_CACHE_RECENT : QCOW2_CACHE_FREQUENT);
 
     /* And return the right table */
 found:
@@ -438,12 +736,11 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = g_hash_table_lookup(c->index, &offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (t && (t->list == QCOW2_CACHE_RECENT ||
+              t->list == QCOW2_CACHE_FREQUENT)) {
+        return qcow2_cache_get_table_addr(c, t - c->entries);
     }
     return NULL;
 }
@@ -452,11 +749,7 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
-    c->entries[i].dirty = false;
+    qcow2_cache_entry_clear(c, i);
 
     qcow2_cache_table_release(c, i, 1);
 }
@@ -0,0 +1,183 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Entries are keyed by the host offset of the compressed data.  That offset
+ * can only be reused for a different cluster after the host cluster it lies
+ * in has been freed, which is when qcow2_compressed_cache_invalidate() is
+ * called for it.
+ */
+typedef struct Qcow2CompressedEntry {
+    uint64_t coffset;
+    int csize;
+    void *data;
+    QTAILQ_ENTRY(Qcow2CompressedEntry) next;
+} Qcow2CompressedEntry;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+    GHashTable *entries;
+    /* From least to most recently used */
+    QTAILQ_HEAD(, Qcow2CompressedEntry) lru;
+    int nb_entries;
+    int max_entries;
+    int cluster_size;
+    /* Incremented by every invalidation */
+    uint64_t generation;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_new(int max_clusters,
+                                                 int cluster_size)
+{
+    Qcow2CompressedCache *c = g_new0(Qcow2CompressedCache, 1);
+
+    assert(max_clusters > 0);
+
+    qemu_mutex_init(&c->lock);
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+    c->max_entries = max_clusters;
+    c->cluster_size = cluster_size;
+
+    return c;
+}
+
+static void qcow2_compressed_cache_drop(Qcow2CompressedCache *c,
+                                        Qcow2CompressedEntry *e)
+{
+    g_hash_table_remove(c->entries, &e->coffset);
+    QTAILQ_REMOVE(&c->lru, e, next);
+    c->nb_entries--;
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        qcow2_compressed_cache_drop(c, e);
+    }
+    g_hash_table_destroy(c->entries);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    return c->generation;
+}
+
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 int csize, int offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset)
+{
+    Qcow2CompressedEntry *e;
+
+    assert(offset_in_cluster + bytes <= c->cluster_size);
+
+    QEMU_LOCK_GUARD(&c->lock);
+    e = g_hash_table_lookup(c->entries, &coffset);
+    if (!e || e->csize != csize) {
+        c->misses++;
+        return false;
+    }
+
+    c->hits++;
+    QTAILQ_REMOVE(&c->lru, e, next);
+    QTAILQ_INSERT_TAIL(&c->lru, e, next);
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        (uint8_t *)e->data + offset_in_cluster, bytes);
+
+    return true;
+}
+
+void qcow2_compressed_cache_insert(Qcow2CompressedCache *c, uint64_t coffset,
+                                   int csize, void *data, uint64_t generation)
+{
+    Qcow2CompressedEntry *e;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    /*
+     * Don't cache data that was read before the cluster was freed, and
+     * don't add a second copy if a concurrent request was faster
+     */
+    if (generation != c->generation ||
+        g_hash_table_contains(c->entries, &coffset)) {
+        qemu_vfree(data);
+        return;
+    }
+
+    if (c->nb_entries == c->max_entries) {
+        qcow2_compressed_cache_drop(c, QTAILQ_FIRST(&c->lru));
+    }
+
+    e = g_new(Qcow2CompressedEntry, 1);
+    *e = (Qcow2CompressedEntry) {
+        .coffset = coffset,
+        .csize = csize,
+        .data = data,
+    };
+    g_hash_table_insert(c->entries, &e->coffset, e);
+    QTAILQ_INSERT_TAIL(&c->lru, e, next);
+    c->nb_entries++;
+}
+
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    Qcow2CompressedEntry *e, *next;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    c->generation++;
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        if (e->coffset < offset + bytes && e->coffset + e->csize > offset) {
+            trace_qcow2_compressed_cache_invalidate(e->coffset, e->csize);
+            qcow2_compressed_cache_drop(c, e);
+        }
+    }
+}
+
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedEntry *e, *next;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    c->generation++;
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        qcow2_compressed_cache_drop(c, e);
+    }
+}
+
+void qcow2_compressed_cache_get_stats(Qcow2CompressedCache *c,
+                                      uint64_t *hits, uint64_t *misses)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    *hits = c->hits;
+    *misses = c->misses;
+}
@@ -74,11 +74,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
 
-static int coroutine_fn
+static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
                            uint64_t offset,
                            uint64_t bytes,
+                           unsigned int *cur_bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset);
 
@@ -608,6 +609,7 @@ static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
                       BdrvCheckMode fix)
 {
+    BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
     int ret;
@@ -622,6 +624,10 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     ret = qcow2_check_refcounts(bs, &refcount_res, fix);
     qcow2_add_check_result(result, &refcount_res, true);
+    if (fix && s->compressed_cache) {
+        /* Repairing may have freed clusters behind update_refcount()'s back */
+        qcow2_compressed_cache_clear(s->compressed_cache);
+    }
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
         return ret;
@@ -701,6 +707,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CACHE_AUTOSIZE,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
     NULL
 };
 
@@ -817,6 +825,17 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CACHE_AUTOSIZE,
+            .type = QEMU_OPT_BOOL,
+            .help = "Adapt the metadata cache sizes to the miss rate, up to "
+                    "their maximum sizes",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache of decompressed clusters (0 = off)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -973,6 +992,7 @@ static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
@@ -991,6 +1011,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1061,6 +1082,25 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    if (qemu_opt_get_bool(opts, QCOW2_OPT_CACHE_AUTOSIZE, false)) {
+        qcow2_cache_set_autosize(r->l2_table_cache, MIN_L2_CACHE_SIZE);
+        qcow2_cache_set_autosize(r->refcount_block_cache,
+                                 MIN_REFCOUNT_CACHE_SIZE);
+    }
+
+    compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                          DEFAULT_COMPRESSED_CACHE_SIZE) / s->cluster_size;
+    if (compressed_cache_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (compressed_cache_size > 0) {
+        r->compressed_cache =
+            qcow2_compressed_cache_new(compressed_cache_size, s->cluster_size);
+    }
+
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
         qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
@@ -1226,8 +1266,10 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_compressed_cache_free(s->compressed_cache);
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->compressed_cache = r->compressed_cache;
     s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
@@ -1258,6 +1300,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_compressed_cache_free(r->compressed_cache);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1913,6 +1956,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_compressed_cache_free(s->compressed_cache);
+    s->compressed_cache = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2336,7 +2381,9 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
     switch (subc_type) {
     case QCOW2_SUBCLUSTER_ZERO_PLAIN:
     case QCOW2_SUBCLUSTER_ZERO_ALLOC:
-        /* Both zero types are handled in qcow2_co_preadv_part */
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        /* Both zero types and compressed clusters are handled in
+         * qcow2_co_preadv_part */
         g_assert_not_reached();
 
     case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
@@ -2347,10 +2394,6 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
         return bdrv_co_preadv_part(bs->backing, offset, bytes,
                                    qiov, qiov_offset, 0);
 
-    case QCOW2_SUBCLUSTER_COMPRESSED:
-        return qcow2_co_preadv_compressed(bs, host_offset,
-                                          offset, bytes, qiov, qiov_offset);
-
     case QCOW2_SUBCLUSTER_NORMAL:
         if (bs->encrypted) {
             return qcow2_co_preadv_encrypted(bs, host_offset,
@@ -2417,6 +2460,13 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             (type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC && !bs->backing))
         {
             qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+        } else if (type == QCOW2_SUBCLUSTER_COMPRESSED) {
+            /* Reads the whole run of compressed clusters at once */
+            ret = qcow2_co_preadv_compressed(bs, host_offset, offset, bytes,
+                                             &cur_bytes, qiov, qiov_offset);
+            if (ret < 0) {
+                goto out;
+            }
         } else {
             if (!aio && cur_bytes != bytes) {
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
@@ -2806,6 +2856,8 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_free(s->compressed_cache);
+    s->compressed_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4818,44 +4870,184 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t coffset;
+    int csize;
+    const uint8_t *buf; /* compressed data */
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    uint64_t cache_generation;
+} Qcow2DecompressTask;
+
+static int coroutine_fn qcow2_co_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint8_t *out_buf;
+
+    out_buf = qemu_try_blockalign(t->bs, s->cluster_size);
+    if (!out_buf) {
+        return -ENOMEM;
+    }
+
+    if (qcow2_co_decompress(t->bs, out_buf, s->cluster_size,
+                            t->buf, t->csize) < 0) {
+        qemu_vfree(out_buf);
+        return -EIO;
+    }
+
+    qemu_iovec_from_buf(t->qiov, t->qiov_offset,
+                        out_buf + offset_into_cluster(s, t->offset), t->bytes);
+
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_insert(s->compressed_cache, t->coffset,
+                                      t->csize, out_buf, t->cache_generation);
+    } else {
+        qemu_vfree(out_buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the compressed cluster described by @l2_entry, and any compressed
+ * clusters that follow it both in the request and in the image file, up to
+ * QCOW2_MAX_COMPRESSED_BATCH of them.  Clusters that are not in the cache
+ * of decompressed clusters are read with a single request and then all
+ * decompressed in parallel.
+ *
+ * On entry, *@cur_bytes is the part of the request in the first cluster.
+ * On success, it is set to the number of bytes that were read.
+ */
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
                            uint64_t offset,
                            uint64_t bytes,
+                           unsigned int *cur_bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    Qcow2DecompressTask *tasks[QCOW2_MAX_COMPRESSED_BATCH];
+    uint64_t cache_generation = 0;
+    uint64_t start = 0, end = 0, done = 0;
+    unsigned int n = 0, i, clusters;
+    uint8_t *buf = NULL;
+    AioTaskPool *pool;
+    int ret = 0;
 
-    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    if (s->compressed_cache) {
+        cache_generation =
+            qcow2_compressed_cache_generation(s->compressed_cache);
+    }
 
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    for (clusters = 0; clusters < QCOW2_MAX_COMPRESSED_BATCH; clusters++) {
+        QCow2SubclusterType type;
+        uint64_t coffset;
+        int csize;
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+        /*
+         * Stop when the data isn't close behind what we read so far.  The
+         * last sector of one compressed cluster may also hold the start
+         * of the next one.
+         */
+        if (n && (coffset < start || coffset > end + s->cluster_size)) {
+            break;
+        }
+
+        if (!s->compressed_cache ||
+            !qcow2_compressed_cache_read(s->compressed_cache, coffset, csize,
+                                         offset_into_cluster(s, offset + done),
+                                         *cur_bytes, qiov,
+                                         qiov_offset + done)) {
+            tasks[n] = g_new(Qcow2DecompressTask, 1);
+            *tasks[n] = (Qcow2DecompressTask) {
+                .task.func = qcow2_co_decompress_task_entry,
+                .bs = bs,
+                .coffset = coffset,
+                .csize = csize,
+                .offset = offset + done,
+                .bytes = *cur_bytes,
+                .qiov = qiov,
+                .qiov_offset = qiov_offset + done,
+                .cache_generation = cache_generation,
+            };
+            if (!n++) {
+                start = coffset;
+            }
+            end = MAX(end, coffset + csize);
+        }
+
+        done += *cur_bytes;
+        if (done == bytes) {
+            break;
+        }
+
+        /*
+         * Look at the next cluster.  If that fails, the caller will look it
+         * up again and report the error.
+         */
+        *cur_bytes = MIN(bytes - done, INT_MAX);
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset + done, cur_bytes,
+                                    &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            ret = 0;
+            break;
+        }
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
+    *cur_bytes = done;
+    if (!n) {
+        return 0;
+    }
+
+    buf = g_try_malloc(end - start);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
 
     BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
     if (ret < 0) {
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
+    for (i = 0; i < n; i++) {
+        tasks[i]->buf = buf + (tasks[i]->coffset - start);
+    }
+
+    if (n == 1) {
+        ret = qcow2_co_decompress_task_entry(&tasks[0]->task);
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+    /* The pool frees the tasks */
+    pool = aio_task_pool_new(n);
+    for (i = 0; i < n; i++) {
+        aio_task_pool_start_task(pool, &tasks[i]->task);
+    }
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+    g_free(buf);
+
+    return ret;
 
 fail:
-    qemu_vfree(out_buf);
+    for (i = 0; i < n; i++) {
+        g_free(tasks[i]);
+    }
     g_free(buf);
 
     return ret;
@@ -4885,6 +5077,10 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_clear(s->compressed_cache);
+    }
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -5247,6 +5443,28 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new0(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->u.qcow2.refcount_cache);
+    if (s->compressed_cache) {
+        BlockStatsSpecificQcow2 *q = &stats->u.qcow2;
+
+        qcow2_compressed_cache_get_stats(s->compressed_cache,
+                                         &q->compressed_cache_hits,
+                                         &q->compressed_cache_misses);
+    }
+
+    return stats;
+}
+
 static ImageInfoSpecific * GRAPH_RDLOCK
 qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
 {
@@ -6176,6 +6394,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure                       = qcow2_measure,
     .bdrv_co_get_info                   = qcow2_co_get_info,
     .bdrv_get_specific_info             = qcow2_get_specific_info,
+    .bdrv_get_specific_stats            = qcow2_get_specific_stats,
 
     .bdrv_co_save_vmstate               = qcow2_co_save_vmstate,
     .bdrv_co_load_vmstate               = qcow2_co_load_vmstate,
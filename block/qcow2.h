@@ -128,6 +128,11 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define DEFAULT_COMPRESSED_CACHE_SIZE (1 * MiB)
+
+/* Maximum number of compressed clusters read with one request */
+#define QCOW2_MAX_COMPRESSED_BATCH 16
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +155,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CACHE_AUTOSIZE "cache-autosize"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +237,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -345,6 +353,7 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache; /* NULL if disabled */
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
@@ -1008,6 +1017,8 @@ int GRAPH_RDLOCK qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
 
 void qcow2_cache_clean_unused(Qcow2Cache *c);
+void qcow2_cache_set_autosize(Qcow2Cache *c, int min_tables);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 int GRAPH_RDLOCK qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
 int GRAPH_RDLOCK
@@ -1022,6 +1033,23 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_new(int max_clusters,
+                                                 int cluster_size);
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c);
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c);
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 int csize, int offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset);
+void qcow2_compressed_cache_insert(Qcow2CompressedCache *c, uint64_t coffset,
+                                   int csize, void *data, uint64_t generation);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes);
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_get_stats(Qcow2CompressedCache *c,
+                                      uint64_t *hits, uint64_t *misses);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
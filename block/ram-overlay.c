@@ -0,0 +1,887 @@
+/*
+ * Memory-backed copy-on-write overlay
+ *
+ * Guest writes are kept in host memory with cluster granularity, and reads
+ * of clusters that were never written go to the backing node.  Nothing is
+ * ever written back, which makes the driver a fast alternative to the
+ * temporary qcow2 image of snapshot=on when all writes are thrown away at
+ * exit anyway.
+ *
+ * Memory use can be capped.  When the cap is reached, the least recently
+ * used clusters are first compressed (if enabled) and then moved to an
+ * unlinked temporary file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "trace.h"
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define RAM_OVERLAY_OPT_CLUSTER_SIZE    "cluster-size"
+#define RAM_OVERLAY_OPT_MAX_MEMORY      "max-memory"
+#define RAM_OVERLAY_OPT_COMPRESSION     "compression"
+
+#define RAM_OVERLAY_DEFAULT_CLUSTER_SIZE    (64 * KiB)
+#define RAM_OVERLAY_DEFAULT_MAX_MEMORY      (256 * MiB)
+
+typedef enum RamOverlayClusterState {
+    RAM_OVERLAY_ZERO,           /* reads as zeroes, no data */
+    RAM_OVERLAY_DATA,           /* uncompressed in memory */
+    RAM_OVERLAY_COMPRESSED,     /* compressed in memory */
+    RAM_OVERLAY_SPILLED,        /* in the spill file */
+    RAM_OVERLAY__MAX,
+} RamOverlayClusterState;
+
+typedef struct RamOverlayCluster {
+    uint64_t index;
+    RamOverlayClusterState state;
+    uint8_t *data;
+    /*
+     * Bytes at @data, or in the spill slot.  Anything smaller than the
+     * cluster size is compressed.
+     */
+    uint32_t size;
+    int64_t slot;
+    QTAILQ_ENTRY(RamOverlayCluster) next;
+} RamOverlayCluster;
+
+typedef struct BDRVRamOverlayState {
+    /* Protects the clusters and the spill file */
+    CoMutex lock;
+
+    int64_t size;               /* -1 to follow the backing node */
+    uint32_t cluster_size;
+    uint64_t max_memory;        /* 0 for no limit */
+    RamOverlayCompression compression;
+
+    GHashTable *clusters;
+    /* From least to most recently used */
+    QTAILQ_HEAD(, RamOverlayCluster) data_lru;
+    QTAILQ_HEAD(, RamOverlayCluster) compressed_lru;
+    uint64_t memory_used;
+    uint64_t nb_clusters[RAM_OVERLAY__MAX];
+
+    int spill_fd;
+    char *spill_filename;       /* only set where it can't be unlinked */
+    int64_t spill_end;
+    GArray *spill_free;         /* slots that can be reused */
+} BDRVRamOverlayState;
+
+static QemuOptsList runtime_opts = {
+    .name = "ram-overlay",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size (default: size of the backing node)",
+        },
+        {
+            .name = RAM_OVERLAY_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of copy-on-write",
+        },
+        {
+            .name = RAM_OVERLAY_OPT_MAX_MEMORY,
+            .type = QEMU_OPT_SIZE,
+            .help = "Memory for written clusters before they are moved to "
+                    "a temporary file (0 for no limit)",
+        },
+        {
+            .name = RAM_OVERLAY_OPT_COMPRESSION,
+            .type = QEMU_OPT_STRING,
+            .help = "Compress clusters before moving them to the temporary "
+                    "file (none, zstd)",
+        },
+        { /* end of list */ }
+    },
+};
+
+typedef struct RamOverlayWork {
+    int fd;
+    int64_t offset;
+    bool write;
+    void *src;
+    size_t src_size;
+    void *dest;
+    size_t dest_size;
+} RamOverlayWork;
+
+static int ram_overlay_file_io_func(void *opaque)
+{
+    RamOverlayWork *w = opaque;
+    uint8_t *buf = w->write ? w->src : w->dest;
+    size_t bytes = w->write ? w->src_size : w->dest_size;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < bytes) {
+#ifdef _WIN32
+        /* No pread() here, but the caller holds s->lock */
+        if (lseek(w->fd, w->offset + done, SEEK_SET) < 0) {
+            return -errno;
+        }
+        if (w->write) {
+            ret = write(w->fd, buf + done, bytes - done);
+        } else {
+            ret = read(w->fd, buf + done, bytes - done);
+        }
+#else
+        if (w->write) {
+            ret = pwrite(w->fd, buf + done, bytes - done, w->offset + done);
+        } else {
+            ret = pread(w->fd, buf + done, bytes - done, w->offset + done);
+        }
+#endif
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+#ifdef CONFIG_ZSTD
+/* Returns the compressed size, or -ENOSPC if it doesn't fit in dest */
+static int ram_overlay_compress_func(void *opaque)
+{
+    RamOverlayWork *w = opaque;
+    size_t ret;
+
+    ret = ZSTD_compress(w->dest, w->dest_size, w->src, w->src_size, 1);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ?
+               -ENOSPC : -EIO;
+    }
+    return ret;
+}
+
+static int ram_overlay_decompress_func(void *opaque)
+{
+    RamOverlayWork *w = opaque;
+    size_t ret;
+
+    ret = ZSTD_decompress(w->dest, w->dest_size, w->src, w->src_size);
+    if (ZSTD_isError(ret) || ret != w->dest_size) {
+        return -EIO;
+    }
+    return 0;
+}
+#endif
+
+static int coroutine_fn
+ram_overlay_co_compress(BDRVRamOverlayState *s, void *dest, size_t dest_size,
+                        void *src)
+{
+#ifdef CONFIG_ZSTD
+    RamOverlayWork w = {
+        .src = src,
+        .src_size = s->cluster_size,
+        .dest = dest,
+        .dest_size = dest_size,
+    };
+
+    assert(s->compression == RAM_OVERLAY_COMPRESSION_ZSTD);
+    return thread_pool_submit_co(ram_overlay_compress_func, &w);
+#else
+    g_assert_not_reached();
+#endif
+}
+
+static int coroutine_fn
+ram_overlay_co_decompress(BDRVRamOverlayState *s, void *dest, void *src,
+                          size_t src_size)
+{
+#ifdef CONFIG_ZSTD
+    RamOverlayWork w = {
+        .src = src,
+        .src_size = src_size,
+        .dest = dest,
+        .dest_size = s->cluster_size,
+    };
+
+    return thread_pool_submit_co(ram_overlay_decompress_func, &w);
+#else
+    g_assert_not_reached();
+#endif
+}
+
+static int coroutine_fn
+ram_overlay_co_file_io(BDRVRamOverlayState *s, int64_t offset, void *buf,
+                       size_t bytes, bool write)
+{
+    RamOverlayWork w = {
+        .fd = s->spill_fd,
+        .offset = offset,
+        .write = write,
+        .src = write ? buf : NULL,
+        .src_size = write ? bytes : 0,
+        .dest = write ? NULL : buf,
+        .dest_size = write ? 0 : bytes,
+    };
+
+    return thread_pool_submit_co(ram_overlay_file_io_func, &w);
+}
+
+static int ram_overlay_open_spill_file(BDRVRamOverlayState *s)
+{
+    Error *local_err = NULL;
+    g_autofree char *filename = create_tmp_file(&local_err);
+
+    if (!filename) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+
+    s->spill_fd = qemu_open(filename, O_RDWR | O_BINARY, &local_err);
+    if (s->spill_fd < 0) {
+        error_report_err(local_err);
+        unlink(filename);
+        return -EIO;
+    }
+
+#ifdef _WIN32
+    /* Open files can't be deleted here, do it on close */
+    s->spill_filename = g_steal_pointer(&filename);
+#else
+    unlink(filename);
+#endif
+    return 0;
+}
+
+/* Drops the current contents of @c, but leaves it in the table */
+static void ram_overlay_release(BDRVRamOverlayState *s, RamOverlayCluster *c)
+{
+    switch (c->state) {
+    case RAM_OVERLAY_ZERO:
+        break;
+    case RAM_OVERLAY_DATA:
+        QTAILQ_REMOVE(&s->data_lru, c, next);
+        s->memory_used -= c->size;
+        g_free(c->data);
+        break;
+    case RAM_OVERLAY_COMPRESSED:
+        QTAILQ_REMOVE(&s->compressed_lru, c, next);
+        s->memory_used -= c->size;
+        g_free(c->data);
+        break;
+    case RAM_OVERLAY_SPILLED:
+        g_array_append_val(s->spill_free, c->slot);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    s->nb_clusters[c->state]--;
+    c->data = NULL;
+    c->size = 0;
+}
+
+static void ram_overlay_set_state(BDRVRamOverlayState *s,
+                                  RamOverlayCluster *c,
+                                  RamOverlayClusterState state)
+{
+    c->state = state;
+    s->nb_clusters[state]++;
+    switch (state) {
+    case RAM_OVERLAY_DATA:
+        QTAILQ_INSERT_TAIL(&s->data_lru, c, next);
+        s->memory_used += c->size;
+        break;
+    case RAM_OVERLAY_COMPRESSED:
+        QTAILQ_INSERT_TAIL(&s->compressed_lru, c, next);
+        s->memory_used += c->size;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Compresses a DATA cluster in place.  Returns -ENOSPC if that wouldn't save
+ * at least an eighth of the cluster.
+ */
+static int coroutine_fn
+ram_overlay_co_compress_cluster(BDRVRamOverlayState *s, RamOverlayCluster *c)
+{
+    size_t dest_size = s->cluster_size - s->cluster_size / 8;
+    uint8_t *buf = g_try_malloc(dest_size);
+    int ret;
+
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = ram_overlay_co_compress(s, buf, dest_size, c->data);
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
+    }
+
+    trace_ram_overlay_compress(s, c->index, ret);
+    ram_overlay_release(s, c);
+    c->data = g_realloc(buf, ret);
+    c->size = ret;
+    ram_overlay_set_state(s, c, RAM_OVERLAY_COMPRESSED);
+    return 0;
+}
+
+/* Moves a DATA or COMPRESSED cluster to the spill file */
+static int coroutine_fn
+ram_overlay_co_spill_cluster(BDRVRamOverlayState *s, RamOverlayCluster *c)
+{
+    uint32_t size = c->size;
+    int64_t slot;
+    int ret;
+
+    if (s->spill_fd < 0) {
+        ret = ram_overlay_open_spill_file(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (s->spill_free->len) {
+        slot = g_array_index(s->spill_free, int64_t, s->spill_free->len - 1);
+        g_array_set_size(s->spill_free, s->spill_free->len - 1);
+    } else {
+        slot = s->spill_end;
+        s->spill_end += s->cluster_size;
+    }
+
+    ret = ram_overlay_co_file_io(s, slot, c->data, size, true);
+    if (ret < 0) {
+        g_array_append_val(s->spill_free, slot);
+        return ret;
+    }
+
+    trace_ram_overlay_spill(s, c->index, slot, size);
+    ram_overlay_release(s, c);
+    c->slot = slot;
+    c->size = size;
+    ram_overlay_set_state(s, c, RAM_OVERLAY_SPILLED);
+    return 0;
+}
+
+/* Gets memory_used below the limit again if @bytes more were added */
+static int coroutine_fn
+ram_overlay_co_make_room(BDRVRamOverlayState *s, uint64_t bytes)
+{
+    RamOverlayCluster *c;
+    int ret;
+
+    while (s->max_memory && s->memory_used + bytes > s->max_memory) {
+        c = QTAILQ_FIRST(&s->data_lru);
+        if (c && s->compression != RAM_OVERLAY_COMPRESSION_NONE) {
+            ret = ram_overlay_co_compress_cluster(s, c);
+            if (ret == 0) {
+                continue;
+            } else if (ret != -ENOSPC) {
+                return ret;
+            }
+        }
+        if (!c) {
+            c = QTAILQ_FIRST(&s->compressed_lru);
+        }
+        /* max_memory is at least one cluster, so something is resident */
+        assert(c);
+
+        ret = ram_overlay_co_spill_cluster(s, c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Reads the whole cluster @c into @buf, which is cluster_size bytes long */
+static int coroutine_fn
+ram_overlay_co_load_cluster(BDRVRamOverlayState *s, RamOverlayCluster *c,
+                            uint8_t *buf)
+{
+    g_autofree uint8_t *tmp = NULL;
+    int ret;
+
+    switch (c->state) {
+    case RAM_OVERLAY_ZERO:
+        memset(buf, 0, s->cluster_size);
+        return 0;
+    case RAM_OVERLAY_DATA:
+        memcpy(buf, c->data, s->cluster_size);
+        return 0;
+    case RAM_OVERLAY_COMPRESSED:
+        return ram_overlay_co_decompress(s, buf, c->data, c->size);
+    case RAM_OVERLAY_SPILLED:
+        if (c->size == s->cluster_size) {
+            return ram_overlay_co_file_io(s, c->slot, buf, c->size, false);
+        }
+        tmp = g_try_malloc(c->size);
+        if (!tmp) {
+            return -ENOMEM;
+        }
+        ret = ram_overlay_co_file_io(s, c->slot, tmp, c->size, false);
+        if (ret < 0) {
+            return ret;
+        }
+        return ram_overlay_co_decompress(s, buf, tmp, c->size);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Called with s->lock held */
+static int coroutine_fn
+ram_overlay_co_read_cluster(BDRVRamOverlayState *s, RamOverlayCluster *c,
+                            uint32_t offset_in_cluster, uint64_t bytes,
+                            QEMUIOVector *qiov, size_t qiov_offset)
+{
+    g_autofree uint8_t *buf = NULL;
+    int ret;
+
+    switch (c->state) {
+    case RAM_OVERLAY_ZERO:
+        qemu_iovec_memset(qiov, qiov_offset, 0, bytes);
+        return 0;
+    case RAM_OVERLAY_DATA:
+        qemu_iovec_from_buf(qiov, qiov_offset, c->data + offset_in_cluster,
+                            bytes);
+        QTAILQ_REMOVE(&s->data_lru, c, next);
+        QTAILQ_INSERT_TAIL(&s->data_lru, c, next);
+        return 0;
+    default:
+        break;
+    }
+
+    /* Evicted clusters stay where they are until they are written again */
+    buf = g_try_malloc(s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    ret = ram_overlay_co_load_cluster(s, c, buf);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + offset_in_cluster, bytes);
+    return 0;
+}
+
+/* Called with s->lock held */
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_write_cluster(BlockDriverState *bs, uint64_t index,
+                             uint32_t offset_in_cluster, uint64_t bytes,
+                             QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    RamOverlayCluster *c = g_hash_table_lookup(s->clusters, &index);
+    g_autofree uint8_t *buf = NULL;
+    int ret;
+
+    if (c && c->state == RAM_OVERLAY_DATA) {
+        qemu_iovec_to_buf(qiov, qiov_offset, c->data + offset_in_cluster,
+                          bytes);
+        QTAILQ_REMOVE(&s->data_lru, c, next);
+        QTAILQ_INSERT_TAIL(&s->data_lru, c, next);
+        return 0;
+    }
+
+    buf = g_try_malloc(s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    /* Copy on write: fill in the rest of the cluster */
+    if (bytes < s->cluster_size) {
+        if (c) {
+            ret = ram_overlay_co_load_cluster(s, c, buf);
+        } else if (bs->backing) {
+            ret = bdrv_co_pread(bs->backing, index * s->cluster_size,
+                                s->cluster_size, buf, 0);
+        } else {
+            memset(buf, 0, s->cluster_size);
+            ret = 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf + offset_in_cluster, bytes);
+
+    ret = ram_overlay_co_make_room(s, s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (c) {
+        ram_overlay_release(s, c);
+    } else {
+        c = g_new0(RamOverlayCluster, 1);
+        c->index = index;
+        g_hash_table_insert(s->clusters, &c->index, c);
+    }
+    c->data = g_steal_pointer(&buf);
+    c->size = s->cluster_size;
+    ram_overlay_set_state(s, c, RAM_OVERLAY_DATA);
+    return 0;
+}
+
+static int ram_overlay_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->size = -1;
+    if (qemu_opt_get(opts, BLOCK_OPT_SIZE)) {
+        uint64_t size = qemu_opt_get_size(opts, BLOCK_OPT_SIZE, 0);
+
+        if (size > INT64_MAX - BDRV_SECTOR_SIZE) {
+            error_setg(errp, "size is too large");
+            ret = -EINVAL;
+            goto out;
+        }
+        s->size = ROUND_UP(size, BDRV_SECTOR_SIZE);
+    }
+    s->cluster_size = qemu_opt_get_size(opts, RAM_OVERLAY_OPT_CLUSTER_SIZE,
+                                        RAM_OVERLAY_DEFAULT_CLUSTER_SIZE);
+    s->max_memory = qemu_opt_get_size(opts, RAM_OVERLAY_OPT_MAX_MEMORY,
+                                      RAM_OVERLAY_DEFAULT_MAX_MEMORY);
+    s->compression = qapi_enum_parse(&RamOverlayCompression_lookup,
+                                     qemu_opt_get(opts,
+                                                  RAM_OVERLAY_OPT_COMPRESSION),
+                                     RAM_OVERLAY_COMPRESSION_NONE,
+                                     &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < BDRV_SECTOR_SIZE || s->cluster_size > 2 * MiB) {
+        error_setg(errp, "cluster-size must be a power of two between 512 "
+                   "and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->max_memory && s->max_memory < s->cluster_size) {
+        error_setg(errp, "max-memory must be 0 or at least one cluster");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    s->clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->data_lru);
+    QTAILQ_INIT(&s->compressed_lru);
+    s->spill_fd = -1;
+    s->spill_free = g_array_new(false, false, sizeof(int64_t));
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void ram_overlay_close(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    GHashTableIter iter;
+    RamOverlayCluster *c;
+
+    g_hash_table_iter_init(&iter, s->clusters);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&c)) {
+        if (c->state == RAM_OVERLAY_DATA ||
+            c->state == RAM_OVERLAY_COMPRESSED) {
+            g_free(c->data);
+        }
+        g_free(c);
+    }
+    g_hash_table_destroy(s->clusters);
+    g_array_free(s->spill_free, true);
+
+    if (s->spill_fd >= 0) {
+        qemu_close(s->spill_fd);
+    }
+    if (s->spill_filename) {
+        unlink(s->spill_filename);
+        g_free(s->spill_filename);
+    }
+}
+
+static int ram_overlay_reopen_prepare(BDRVReopenState *reopen_state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    /* None of the options can be changed */
+    return 0;
+}
+
+static void GRAPH_RDLOCK
+ram_overlay_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pdiscard_alignment = s->cluster_size;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_getlength(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    if (s->size >= 0) {
+        return s->size;
+    }
+    return bs->backing ? bdrv_co_getlength(bs->backing->bs) : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    bdi->cluster_size = s->cluster_size;
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, QEMUIOVector *qiov,
+                           size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    RamOverlayCluster *c;
+    int ret = 0;
+
+    while (bytes) {
+        uint64_t index = offset / s->cluster_size;
+        uint32_t offset_in_cluster = offset % s->cluster_size;
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        qemu_co_mutex_lock(&s->lock);
+        c = g_hash_table_lookup(s->clusters, &index);
+        if (c) {
+            ret = ram_overlay_co_read_cluster(s, c, offset_in_cluster,
+                                              cur_bytes, qiov, qiov_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        } else {
+            /* Read all following clusters that weren't written at once */
+            while (cur_bytes < bytes) {
+                index = (offset + cur_bytes) / s->cluster_size;
+                if (g_hash_table_contains(s->clusters, &index)) {
+                    break;
+                }
+                cur_bytes = MIN(bytes, cur_bytes + s->cluster_size);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+
+            if (bs->backing) {
+                ret = bdrv_co_preadv_part(bs->backing, offset, cur_bytes,
+                                          qiov, qiov_offset, 0);
+            } else {
+                qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    int ret = 0;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    while (bytes) {
+        uint64_t index = offset / s->cluster_size;
+        uint32_t offset_in_cluster = offset % s->cluster_size;
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        ret = ram_overlay_co_write_cluster(bs, index, offset_in_cluster,
+                                           cur_bytes, qiov, qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+    return 0;
+}
+
+/* Turns whole clusters into zero clusters, which need no memory */
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_zero_clusters(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t index;
+    RamOverlayCluster *c;
+
+    if (!QEMU_IS_ALIGNED(offset | bytes, s->cluster_size)) {
+        return -ENOTSUP;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+    for (index = offset / s->cluster_size;
+         index < (offset + bytes) / s->cluster_size; index++)
+    {
+        c = g_hash_table_lookup(s->clusters, &index);
+        if (c) {
+            ram_overlay_release(s, c);
+        } else {
+            c = g_new0(RamOverlayCluster, 1);
+            c->index = index;
+            g_hash_table_insert(s->clusters, &c->index, c);
+        }
+        ram_overlay_set_state(s, c, RAM_OVERLAY_ZERO);
+    }
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, BdrvRequestFlags flags)
+{
+    return ram_overlay_co_zero_clusters(bs, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret = ram_overlay_co_zero_clusters(bs, offset, bytes);
+
+    /* Discarding part of a cluster is a no-op */
+    return ret == -ENOTSUP ? 0 : ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+ram_overlay_co_block_status(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t index = offset / s->cluster_size;
+    int64_t end = MIN(offset + bytes,
+                      (int64_t)(index + 1) * s->cluster_size);
+    RamOverlayCluster *c = g_hash_table_lookup(s->clusters, &index);
+    int status = 0;
+
+    if (c) {
+        status = c->state == RAM_OVERLAY_ZERO ? BDRV_BLOCK_ZERO
+                                              : BDRV_BLOCK_DATA;
+    }
+
+    /* Merge following clusters with the same status */
+    while (end < offset + bytes) {
+        int next_status = 0;
+
+        index = end / s->cluster_size;
+        c = g_hash_table_lookup(s->clusters, &index);
+        if (c) {
+            next_status = c->state == RAM_OVERLAY_ZERO ? BDRV_BLOCK_ZERO
+                                                       : BDRV_BLOCK_DATA;
+        }
+        if (next_status != status) {
+            break;
+        }
+        end = MIN(offset + bytes, end + s->cluster_size);
+    }
+
+    *pnum = end - offset;
+    return status;
+}
+
+static BlockStatsSpecific *ram_overlay_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_RAM_OVERLAY;
+    stats->u.ram_overlay = (BlockStatsSpecificRamOverlay) {
+        .memory_used = s->memory_used,
+        .data_clusters = s->nb_clusters[RAM_OVERLAY_DATA],
+        .compressed_clusters = s->nb_clusters[RAM_OVERLAY_COMPRESSED],
+        .spilled_clusters = s->nb_clusters[RAM_OVERLAY_SPILLED],
+        .zero_clusters = s->nb_clusters[RAM_OVERLAY_ZERO],
+    };
+    return stats;
+}
+
+static const char *const ram_overlay_strong_runtime_opts[] = {
+    BLOCK_OPT_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_ram_overlay = {
+    .format_name                = "ram-overlay",
+    .instance_size              = sizeof(BDRVRamOverlayState),
+
+    .bdrv_open                  = ram_overlay_open,
+    .bdrv_close                 = ram_overlay_close,
+    .bdrv_reopen_prepare        = ram_overlay_reopen_prepare,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_refresh_limits        = ram_overlay_refresh_limits,
+
+    .bdrv_co_getlength          = ram_overlay_co_getlength,
+    .bdrv_co_get_info           = ram_overlay_co_get_info,
+
+    .bdrv_co_preadv_part        = ram_overlay_co_preadv_part,
+    .bdrv_co_pwritev_part       = ram_overlay_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = ram_overlay_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = ram_overlay_co_pdiscard,
+    .bdrv_co_block_status       = ram_overlay_co_block_status,
+
+    .bdrv_get_specific_stats    = ram_overlay_get_specific_stats,
+
+    .is_format                  = true,
+    .supports_backing           = true,
+    .strong_runtime_opts        = ram_overlay_strong_runtime_opts,
+};
+
+static void bdrv_ram_overlay_init(void)
+{
+    bdrv_register(&bdrv_ram_overlay);
+}
+
+block_init(bdrv_ram_overlay_init);
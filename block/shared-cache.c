@@ -0,0 +1,694 @@
+/*
+ * Cache of image data shared between QEMU processes
+ *
+ * The filter keeps clusters read from a read-only image in a shared memory
+ * region, so that several VMs booting the same base image only read and
+ * decompress each cluster once, and only keep it in memory once.  Entries
+ * are keyed by an identifier of the image contents and the cluster index.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "crypto/hash.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/seqlock.h"
+#include "qemu/stats64.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/*
+ * Region layout, in host byte order since it is only shared on one host:
+ *
+ *   header, padded to SHARED_CACHE_ENTRIES_OFFSET
+ *   nb_sets * SHARED_CACHE_WAYS entries
+ *   the data of each entry, cluster_size bytes each, from data_offset
+ *
+ * Lookups are lock-free: readers check the seqlock of an entry before and
+ * after copying its data.  Writers take an entry by making its sequence
+ * odd with a compare-and-swap.  A process that dies in the middle of an
+ * insertion leaves the entry odd, which only loses that entry.
+ */
+#define SHARED_CACHE_MAGIC              0x5143534843414348ULL /* QCSHCACH */
+#define SHARED_CACHE_VERSION            1
+#define SHARED_CACHE_WAYS               4
+#define SHARED_CACHE_ENTRIES_OFFSET     4096
+#define SHARED_CACHE_ID_LEN             16
+
+/* Consecutive misses are read from the image with one request up to that */
+#define SHARED_CACHE_MAX_MISS_RUN       (1 * MiB)
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;         /* written last when the region is set up */
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t nb_sets;
+    uint32_t clock;         /* incremented by every insertion */
+    uint64_t data_offset;
+} SharedCacheHeader;
+
+typedef struct SharedCacheEntry {
+    QemuSeqLock lock;
+    uint32_t stamp;         /* clock at the last insertion or hit */
+    uint32_t len;           /* bytes of data, 0 if the entry is empty */
+    uint8_t id[SHARED_CACHE_ID_LEN];
+    uint64_t cluster;
+} SharedCacheEntry;
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    uint8_t *region;
+    size_t region_size;
+    SharedCacheHeader *header;
+    SharedCacheEntry *entries;
+    uint8_t *data;
+
+    uint32_t cluster_size;
+    uint32_t nb_sets;
+    bool populate;
+    int64_t size;
+    uint8_t id[SHARED_CACHE_ID_LEN];
+
+    Stat64 hits;
+    Stat64 misses;
+    Stat64 insertions;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH           "path"
+#define SHARED_CACHE_OPT_SIZE           "size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE   "cluster-size"
+#define SHARED_CACHE_OPT_IMAGE_ID       "image-id"
+#define SHARED_CACHE_OPT_POPULATE       "populate"
+
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "shared memory file that holds the cache",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the region if it is created, default 256M",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the region if it is created, "
+                    "default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identifier of the image contents, default derived "
+                    "from the image files",
+        },
+        {
+            .name = SHARED_CACHE_OPT_POPULATE,
+            .type = QEMU_OPT_BOOL,
+            .help = "add clusters read from the image, default on",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * Describes the files below @bs well enough that a change of their contents
+ * changes the description.
+ */
+static bool GRAPH_RDLOCK
+shared_cache_describe(BlockDriverState *bs, GString *desc, Error **errp)
+{
+    BdrvChild *c;
+    struct stat st;
+    long mtime_nsec, ctime_nsec;
+
+    g_string_append_printf(desc, "%s(", bs->drv->format_name);
+    if (QLIST_EMPTY(&bs->children)) {
+        if (stat(bs->filename, &st) < 0) {
+            error_setg(errp, "Cannot identify the contents of '%s', "
+                       "image-id must be set", bs->filename);
+            return false;
+        }
+        /* Images rewritten within the same second must not match */
+#ifdef CONFIG_DARWIN
+        mtime_nsec = st.st_mtimespec.tv_nsec;
+        ctime_nsec = st.st_ctimespec.tv_nsec;
+#else
+        mtime_nsec = st.st_mtim.tv_nsec;
+        ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+        g_string_append_printf(desc, "%ju:%ju:%jd:%jd.%09ld:%jd.%09ld",
+                               (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+                               (intmax_t)st.st_size,
+                               (intmax_t)st.st_mtime, mtime_nsec,
+                               (intmax_t)st.st_ctime, ctime_nsec);
+    }
+    QLIST_FOREACH(c, &bs->children, next) {
+        if (!shared_cache_describe(c->bs, desc, errp)) {
+            return false;
+        }
+    }
+    g_string_append_c(desc, ')');
+    return true;
+}
+
+static int GRAPH_RDLOCK
+shared_cache_init_id(BlockDriverState *bs, const char *image_id, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    g_autoptr(GString) desc = g_string_new("");
+    g_autofree uint8_t *hash = NULL;
+    size_t hash_len;
+
+    if (image_id) {
+        g_string_append_printf(desc, "image-id:%s", image_id);
+    } else if (!shared_cache_describe(bs->file->bs, desc, errp)) {
+        return -EINVAL;
+    }
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, desc->str, desc->len,
+                           &hash, &hash_len, errp) < 0) {
+        return -EINVAL;
+    }
+    assert(hash_len >= SHARED_CACHE_ID_LEN);
+    memcpy(s->id, hash, SHARED_CACHE_ID_LEN);
+    return 0;
+}
+
+/* Waits for another process that is setting up the region */
+static int shared_cache_lock_region(int fd, bool exclusive)
+{
+    int i, ret;
+
+    for (i = 0; i < 1000; i++) {
+        ret = qemu_lock_fd(fd, 0, 1, exclusive);
+        if (ret != -EAGAIN && ret != -EACCES) {
+            return ret;
+        }
+        g_usleep(10 * 1000);
+    }
+    return -ETIMEDOUT;
+}
+
+/* Writes the header and sizes the file if it is still empty */
+static int shared_cache_format(BDRVSharedCacheState *s, uint64_t size,
+                               uint32_t cluster_size, Error **errp)
+{
+    SharedCacheHeader h = {
+        .version = SHARED_CACHE_VERSION,
+        .cluster_size = cluster_size,
+    };
+    uint64_t per_set = SHARED_CACHE_WAYS *
+                       (cluster_size + sizeof(SharedCacheEntry));
+    uint64_t nb_sets;
+    uint64_t total;
+
+    nb_sets = size > SHARED_CACHE_ENTRIES_OFFSET ?
+              (size - SHARED_CACHE_ENTRIES_OFFSET) / per_set : 0;
+    if (nb_sets < 1 || nb_sets > UINT32_MAX) {
+        error_setg(errp, "shared-cache size is too small or too large for "
+                   "cluster-size %" PRIu32, cluster_size);
+        return -EINVAL;
+    }
+    h.nb_sets = nb_sets;
+    h.data_offset = ROUND_UP(SHARED_CACHE_ENTRIES_OFFSET +
+                             nb_sets * SHARED_CACHE_WAYS *
+                             sizeof(SharedCacheEntry),
+                             qemu_real_host_page_size());
+    total = h.data_offset + nb_sets * SHARED_CACHE_WAYS * cluster_size;
+
+    /* The magic is written last and marks the region as ready */
+    if (ftruncate(s->fd, total) < 0 ||
+        pwrite(s->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        pwrite(s->fd, &(uint64_t){ SHARED_CACHE_MAGIC }, sizeof(h.magic),
+               0) != sizeof(h.magic)) {
+        int ret = errno ? -errno : -EIO;
+
+        error_setg_errno(errp, -ret, "Could not set up the shared cache");
+        return ret;
+    }
+    return 0;
+}
+
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, uint32_t cluster_size, Error **errp)
+{
+    SharedCacheHeader h;
+    struct stat st;
+    bool created = false;
+    int ret;
+
+    if (s->populate) {
+        s->fd = qemu_create(path, O_RDWR, 0600, errp);
+    } else {
+        s->fd = qemu_open(path, O_RDONLY, errp);
+    }
+    if (s->fd < 0) {
+        return -errno;
+    }
+
+    ret = shared_cache_lock_region(s->fd, s->populate);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not lock the shared cache");
+        return ret;
+    }
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat the shared cache");
+        goto out;
+    }
+    if (st.st_size == 0 && s->populate) {
+        ret = shared_cache_format(s, size, cluster_size, errp);
+        if (ret < 0) {
+            goto out;
+        }
+        created = true;
+    }
+
+    if (pread(s->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        h.magic != SHARED_CACHE_MAGIC || h.version != SHARED_CACHE_VERSION ||
+        !h.nb_sets || !is_power_of_2(h.cluster_size)) {
+        error_setg(errp, "'%s' is not a shared cache region", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    s->cluster_size = h.cluster_size;
+    s->nb_sets = h.nb_sets;
+    s->region_size = h.data_offset +
+                     (uint64_t)h.nb_sets * SHARED_CACHE_WAYS * h.cluster_size;
+    if (fstat(s->fd, &st) < 0 || (uint64_t)st.st_size < s->region_size) {
+        error_setg(errp, "Shared cache region '%s' is truncated", path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->region = mmap(NULL, s->region_size,
+                     s->populate ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, s->fd, 0);
+    if (s->region == MAP_FAILED) {
+        s->region = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map the shared cache");
+        goto out;
+    }
+    s->header = (SharedCacheHeader *)s->region;
+    s->entries = (SharedCacheEntry *)(s->region +
+                                      SHARED_CACHE_ENTRIES_OFFSET);
+    s->data = s->region + h.data_offset;
+    trace_shared_cache_map(s, path, s->cluster_size,
+                           (uint64_t)s->nb_sets * SHARED_CACHE_WAYS, created);
+    ret = 0;
+
+out:
+    qemu_unlock_fd(s->fd, 0, 1);
+    return ret;
+}
+
+static uint32_t shared_cache_set(BDRVSharedCacheState *s, uint64_t cluster)
+{
+    uint64_t id[2];
+
+    memcpy(id, s->id, sizeof(id));
+    return qemu_xxhash6(id[0], id[1], cluster, cluster >> 32) % s->nb_sets;
+}
+
+static uint8_t *shared_cache_entry_data(BDRVSharedCacheState *s,
+                                        SharedCacheEntry *e)
+{
+    return s->data + (uint64_t)(e - s->entries) * s->cluster_size;
+}
+
+static bool shared_cache_entry_matches(BDRVSharedCacheState *s,
+                                       SharedCacheEntry *e, uint64_t cluster)
+{
+    return qatomic_read(&e->len) && e->cluster == cluster &&
+           !memcmp(e->id, s->id, SHARED_CACHE_ID_LEN);
+}
+
+/*
+ * Copies @bytes at @offset into the cluster to @qiov if the cluster is in
+ * the cache.  Returns false on a miss.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t cluster,
+                                uint32_t offset, uint32_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheEntry *e = &s->entries[shared_cache_set(s, cluster) *
+                                      SHARED_CACHE_WAYS];
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, e++) {
+        unsigned seq = seqlock_read_begin(&e->lock);
+
+        if (!shared_cache_entry_matches(s, e, cluster) ||
+            qatomic_read(&e->len) < offset + bytes) {
+            continue;
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shared_cache_entry_data(s, e) + offset, bytes);
+        if (seqlock_read_retry(&e->lock, seq)) {
+            /* Replaced while copying, the caller overwrites the data */
+            return false;
+        }
+        if (s->populate) {
+            qatomic_set(&e->stamp, qatomic_read(&s->header->clock));
+        }
+        return true;
+    }
+    return false;
+}
+
+static void shared_cache_insert(BDRVSharedCacheState *s, uint64_t cluster,
+                                const uint8_t *buf, uint32_t len)
+{
+    SharedCacheEntry *e = &s->entries[shared_cache_set(s, cluster) *
+                                      SHARED_CACHE_WAYS];
+    SharedCacheEntry *victim = NULL;
+    uint32_t clock = qatomic_read(&s->header->clock);
+    uint32_t age, victim_age = 0;
+    unsigned seq, victim_seq = 0;
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, e++) {
+        seq = qatomic_read(&e->lock.sequence);
+        if (seq & 1) {
+            continue;
+        }
+        if (shared_cache_entry_matches(s, e, cluster)) {
+            /* Another process was faster */
+            return;
+        }
+        age = qatomic_read(&e->len) ? clock - qatomic_read(&e->stamp)
+                                    : UINT32_MAX;
+        if (!victim || age > victim_age) {
+            victim = e;
+            victim_seq = seq;
+            victim_age = age;
+        }
+    }
+    if (!victim ||
+        qatomic_cmpxchg(&victim->lock.sequence, victim_seq,
+                        victim_seq + 1) != victim_seq) {
+        return;
+    }
+
+    memcpy(shared_cache_entry_data(s, victim), buf, len);
+    memcpy(victim->id, s->id, SHARED_CACHE_ID_LEN);
+    victim->cluster = cluster;
+    victim->len = len;
+    victim->stamp = qatomic_fetch_inc(&s->header->clock);
+    seqlock_write_end(&victim->lock);
+    stat64_add(&s->insertions, 1);
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path, *image_id;
+    uint64_t size, cluster_size;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    s->fd = -1;
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = bdrv_apply_auto_read_only(bs, "shared-cache requires a read-only "
+                                    "node", errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    image_id = qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID);
+    size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE, 256 * MiB);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     64 * KiB);
+    s->populate = qemu_opt_get_bool(opts, SHARED_CACHE_OPT_POPULATE, true);
+
+    if (!path) {
+        error_setg(errp, "shared-cache requires the 'path' option");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (!is_power_of_2(cluster_size) || cluster_size < 4 * KiB ||
+        cluster_size > 2 * MiB) {
+        error_setg(errp, "cluster-size must be a power of two between 4k "
+                   "and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->size = bdrv_getlength(bs->file->bs);
+    if (s->size < 0) {
+        error_setg_errno(errp, -s->size, "Could not get the image size");
+        ret = s->size;
+        goto out;
+    }
+
+    ret = shared_cache_init_id(bs, image_id, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = shared_cache_map(s, path, size, cluster_size, errp);
+
+out:
+    qemu_opts_del(opts);
+    if (ret < 0 && s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    munmap(s->region, s->region_size);
+    qemu_close(s->fd);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "shared-cache requires a read-only node");
+        return -EACCES;
+    }
+    return 0;
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm,
+                       nshared);
+
+    /* Cached data would become stale if the image changed under us */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+/* Reads the clusters from @cluster to @end from the image and caches them */
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_fill(BlockDriverState *bs, uint64_t cluster, uint64_t end,
+                  int64_t offset, int64_t bytes, QEMUIOVector *qiov,
+                  size_t qiov_offset)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t start = cluster * s->cluster_size;
+    int64_t len = MIN(end * s->cluster_size, s->size) - start;
+    uint8_t *buf;
+    int64_t pos;
+    int ret;
+
+    trace_shared_cache_miss(bs, cluster, end - cluster);
+    stat64_add(&s->misses, end - cluster);
+
+    buf = qemu_try_blockalign(bs->file->bs, len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    ret = bdrv_co_pread(bs->file, start, len, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), bytes);
+    if (s->populate) {
+        for (pos = 0; pos < len; pos += s->cluster_size) {
+            shared_cache_insert(s, cluster++, buf + pos,
+                                MIN(s->cluster_size, len - pos));
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t max_run = MAX(SHARED_CACHE_MAX_MISS_RUN / s->cluster_size, 1);
+    /* Run of clusters that missed and that still have to be read */
+    uint64_t miss_start = 0, miss_end = 0;
+    int64_t miss_offset = 0;
+    size_t miss_qiov_offset = 0;
+    int ret;
+
+    while (bytes) {
+        uint64_t cluster = offset / s->cluster_size;
+        uint32_t in_cluster = offset % s->cluster_size;
+        int64_t n = MIN(bytes, s->cluster_size - in_cluster);
+        bool hit;
+
+        hit = shared_cache_lookup(s, cluster, in_cluster, n, qiov,
+                                  qiov_offset);
+        if (hit) {
+            stat64_add(&s->hits, 1);
+        }
+        if (miss_end != miss_start &&
+            (hit || miss_end - miss_start == max_run)) {
+            ret = shared_cache_fill(bs, miss_start, miss_end, miss_offset,
+                                    offset - miss_offset, qiov,
+                                    miss_qiov_offset);
+            if (ret < 0) {
+                return ret;
+            }
+            miss_start = miss_end;
+        }
+        if (!hit) {
+            if (miss_end == miss_start) {
+                miss_start = cluster;
+                miss_offset = offset;
+                miss_qiov_offset = qiov_offset;
+            }
+            miss_end = cluster + 1;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    if (miss_end != miss_start) {
+        ret = shared_cache_fill(bs, miss_start, miss_end, miss_offset,
+                                offset - miss_offset, qiov,
+                                miss_qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Passes the allocation status of the image through, for qemu-img map */
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_block_status(BlockDriverState *bs, bool want_zero,
+                             int64_t offset, int64_t bytes, int64_t *pnum,
+                             int64_t *map, BlockDriverState **file)
+{
+    *pnum = bytes;
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static BlockStatsSpecific *shared_cache_get_specific_stats(
+    BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_SHARED_CACHE;
+    stats->u.shared_cache = (BlockStatsSpecificSharedCache) {
+        .capacity = (uint64_t)s->nb_sets * SHARED_CACHE_WAYS,
+        .cluster_size = s->cluster_size,
+        .hits = stat64_get(&s->hits),
+        .misses = stat64_get(&s->misses),
+        .insertions = stat64_get(&s->insertions),
+    };
+    return stats;
+}
+
+static const char *const shared_cache_strong_runtime_opts[] = {
+    SHARED_CACHE_OPT_PATH,
+    SHARED_CACHE_OPT_IMAGE_ID,
+
+    NULL
+};
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                = "shared-cache",
+    .instance_size              = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                  = shared_cache_open,
+    .bdrv_close                 = shared_cache_close,
+    .bdrv_reopen_prepare        = shared_cache_reopen_prepare,
+    .bdrv_child_perm            = shared_cache_child_perm,
+
+    .bdrv_co_getlength          = shared_cache_co_getlength,
+    .bdrv_co_preadv_part        = shared_cache_co_preadv_part,
+    .bdrv_co_block_status       = shared_cache_co_block_status,
+
+    .bdrv_get_specific_stats    = shared_cache_get_specific_stats,
+
+    .is_filter                  = true,
+    .strong_runtime_opts        = shared_cache_strong_runtime_opts,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -0,0 +1,266 @@
+/*
+ * Periodic log of the I/O statistics of block devices
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qemu/lockable.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "block/accounting.h"
+#include "sysemu/block-backend.h"
+
+/*
+ * Latency histogram boundaries in ns, from 50 us to 1 s.  They are set on
+ * every drive that doesn't have a histogram yet, and percentiles are only
+ * reported for histograms that use exactly these.
+ */
+static const uint64_t blk_stats_log_boundaries[] = {
+    50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000,
+};
+#define BLK_STATS_LOG_NBINS (ARRAY_SIZE(blk_stats_log_boundaries) + 1)
+
+static const char *const blk_stats_log_types[BLOCK_MAX_IOTYPE] = {
+    [BLOCK_ACCT_READ]           = "read",
+    [BLOCK_ACCT_WRITE]          = "write",
+    [BLOCK_ACCT_FLUSH]          = "flush",
+    [BLOCK_ACCT_ZONE_APPEND]    = "zone-append",
+    [BLOCK_ACCT_UNMAP]          = "unmap",
+};
+
+typedef struct BlkStatsLogSample {
+    int64_t time_ns;
+    bool account_failed;
+    uint64_t nr_ops[BLOCK_MAX_IOTYPE];
+    uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
+    uint64_t failed_ops[BLOCK_MAX_IOTYPE];
+    uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    bool has_bins[BLOCK_MAX_IOTYPE];
+    uint64_t bins[BLOCK_MAX_IOTYPE][BLK_STATS_LOG_NBINS];
+} BlkStatsLogSample;
+
+static FILE *blk_stats_log_file;
+static QEMUTimer *blk_stats_log_timer;
+static int64_t blk_stats_log_interval_ms;
+static uint64List *blk_stats_log_boundary_list;
+/* The previous sample of every drive, by name */
+static GHashTable *blk_stats_log_samples;
+
+static void blk_stats_log_sample(BlockAcctStats *stats, BlkStatsLogSample *s)
+{
+    int i;
+
+    s->time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    QEMU_LOCK_GUARD(&stats->lock);
+    s->account_failed = stats->account_failed;
+    for (i = BLOCK_ACCT_READ; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        if (!hist->bins) {
+            block_latency_histogram_set(stats, i, blk_stats_log_boundary_list);
+        }
+
+        s->nr_ops[i] = stats->nr_ops[i];
+        s->nr_bytes[i] = stats->nr_bytes[i];
+        s->failed_ops[i] = stats->failed_ops[i];
+        s->total_time_ns[i] = stats->total_time_ns[i];
+
+        /* Someone may have set different boundaries with QMP */
+        s->has_bins[i] = hist->nbins == BLK_STATS_LOG_NBINS &&
+            !memcmp(hist->boundaries, blk_stats_log_boundaries,
+                    sizeof(blk_stats_log_boundaries));
+        if (s->has_bins[i]) {
+            memcpy(s->bins[i], hist->bins, sizeof(s->bins[i]));
+        }
+    }
+}
+
+/* The latency that @pct percent of the requests in @bins stayed below */
+static void blk_stats_log_percentile(GString *line, const uint64_t *bins,
+                                     uint64_t total, int pct)
+{
+    uint64_t rank = DIV_ROUND_UP(total * pct, 100);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BLK_STATS_LOG_NBINS - 1; i++) {
+        seen += bins[i];
+        if (seen >= rank) {
+            g_string_append_printf(line, ", p%d <%g ms", pct,
+                                   blk_stats_log_boundaries[i] / 1e6);
+            return;
+        }
+    }
+    g_string_append_printf(line, ", p%d >=%g ms", pct,
+                           blk_stats_log_boundaries[i - 1] / 1e6);
+}
+
+static void blk_stats_log_type(GString *line, const BlkStatsLogSample *prev,
+                               const BlkStatsLogSample *cur, int type)
+{
+    double secs = (cur->time_ns - prev->time_ns) / 1e9;
+    uint64_t ops = cur->nr_ops[type] - prev->nr_ops[type];
+    uint64_t bytes = cur->nr_bytes[type] - prev->nr_bytes[type];
+    uint64_t failed = cur->failed_ops[type] - prev->failed_ops[type];
+    uint64_t timed = ops + (cur->account_failed ? failed : 0);
+    uint64_t bins[BLK_STATS_LOG_NBINS];
+    uint64_t total = 0;
+    int i;
+
+    g_string_append_printf(line, " %s: %.1f IOPS, %.2f MiB/s",
+                           blk_stats_log_types[type], ops / secs,
+                           bytes / secs / MiB);
+    if (timed) {
+        g_string_append_printf(line, ", avg %.3f ms",
+                               (cur->total_time_ns[type] -
+                                prev->total_time_ns[type]) / 1e6 / timed);
+    }
+
+    if (prev->has_bins[type] && cur->has_bins[type]) {
+        for (i = 0; i < BLK_STATS_LOG_NBINS; i++) {
+            /* The histogram was reset in between */
+            if (cur->bins[type][i] < prev->bins[type][i]) {
+                total = 0;
+                break;
+            }
+            bins[i] = cur->bins[type][i] - prev->bins[type][i];
+            total += bins[i];
+        }
+        if (total) {
+            blk_stats_log_percentile(line, bins, total, 50);
+            blk_stats_log_percentile(line, bins, total, 90);
+            blk_stats_log_percentile(line, bins, total, 99);
+        }
+    }
+
+    if (failed) {
+        g_string_append_printf(line, ", %" PRIu64 " failed", failed);
+    }
+}
+
+static void blk_stats_log_tick(void *opaque)
+{
+    GHashTable *samples = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    g_autoptr(GDateTime) now = g_date_time_new_now_local();
+    g_autofree char *timestamp = g_date_time_format(now, "%Y-%m-%d %H:%M:%S");
+    BlockBackend *blk;
+
+    for (blk = blk_all_next(NULL); blk; blk = blk_all_next(blk)) {
+        BlockAcctStats *stats = blk_get_stats(blk);
+        BlkStatsLogSample *prev, *cur;
+        char *name;
+        int i;
+
+        /* Skip the BlockBackends of block jobs and the like */
+        if (*blk_name(blk)) {
+            name = g_strdup(blk_name(blk));
+        } else if (blk_get_attached_dev(blk)) {
+            name = blk_get_attached_dev_id(blk);
+        } else {
+            continue;
+        }
+
+        cur = g_new(BlkStatsLogSample, 1);
+        blk_stats_log_sample(stats, cur);
+        prev = g_hash_table_lookup(blk_stats_log_samples, name);
+        if (!prev) {
+            /* Lets the block_acct_io trace event be matched to the drive */
+            fprintf(blk_stats_log_file, "%s %s: stats %p\n",
+                    timestamp, name, stats);
+        } else {
+            for (i = BLOCK_ACCT_READ; i < BLOCK_MAX_IOTYPE; i++) {
+                g_autoptr(GString) line = NULL;
+
+                if (cur->nr_ops[i] == prev->nr_ops[i] &&
+                    cur->failed_ops[i] == prev->failed_ops[i]) {
+                    continue;
+                }
+                line = g_string_new(NULL);
+                g_string_append_printf(line, "%s %s", timestamp, name);
+                blk_stats_log_type(line, prev, cur, i);
+                fprintf(blk_stats_log_file, "%s\n", line->str);
+            }
+        }
+        g_hash_table_replace(samples, name, cur);
+    }
+    fflush(blk_stats_log_file);
+
+    /* Forget the drives that went away */
+    g_hash_table_destroy(blk_stats_log_samples);
+    blk_stats_log_samples = samples;
+
+    timer_mod(blk_stats_log_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              blk_stats_log_interval_ms);
+}
+
+/*
+ * Append the IOPS, throughput and latency percentiles of every block device
+ * to @path, once every @interval seconds.  Idle devices and request types
+ * are left out.
+ */
+bool blk_stats_log_start(const char *path, unsigned interval, Error **errp)
+{
+    g_autoptr(GDateTime) now = NULL;
+    g_autofree char *timestamp = NULL;
+    int i;
+
+    GLOBAL_STATE_CODE();
+    assert(interval > 0);
+
+    if (blk_stats_log_file) {
+        error_setg(errp, "Block statistics are already being logged");
+        return false;
+    }
+
+    blk_stats_log_file = fopen(path, "a");
+    if (!blk_stats_log_file) {
+        error_setg_errno(errp, errno, "Could not open '%s'", path);
+        return false;
+    }
+
+    for (i = ARRAY_SIZE(blk_stats_log_boundaries) - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(blk_stats_log_boundary_list,
+                          blk_stats_log_boundaries[i]);
+    }
+    blk_stats_log_samples = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    blk_stats_log_interval_ms = interval * 1000LL;
+    blk_stats_log_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                       blk_stats_log_tick, NULL);
+
+    now = g_date_time_new_now_local();
+    timestamp = g_date_time_format(now, "%Y-%m-%d %H:%M:%S");
+    fprintf(blk_stats_log_file, "%s started, interval %u s\n",
+            timestamp, interval);
+
+    /* Take the first samples right away, so that the next tick has data */
+    blk_stats_log_tick(NULL);
+    return true;
+}
+
+void blk_stats_log_stop(void)
+{
+    GLOBAL_STATE_CODE();
+
+    if (!blk_stats_log_file) {
+        return;
+    }
+
+    timer_free(blk_stats_log_timer);
+    blk_stats_log_timer = NULL;
+    g_hash_table_destroy(blk_stats_log_samples);
+    blk_stats_log_samples = NULL;
+    qapi_free_uint64List(blk_stats_log_boundary_list);
+    blk_stats_log_boundary_list = NULL;
+    fclose(blk_stats_log_file);
+    blk_stats_log_file = NULL;
+}
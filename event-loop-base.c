@@ -32,6 +32,9 @@ static void event_loop_base_instance_init(Object *obj)
 static EventLoopBaseParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(EventLoopBase, aio_max_batch),
 };
+static EventLoopBaseParamInfo io_uring_sqpoll_idle_info = {
+    "io-uring-sqpoll-idle", offsetof(EventLoopBase, io_uring_sqpoll_idle),
+};
 static EventLoopBaseParamInfo thread_pool_min_info = {
     "thread-pool-min", offsetof(EventLoopBase, thread_pool_min),
 };
@@ -109,6 +112,10 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &aio_max_batch_info);
+    object_class_property_add(klass, "io-uring-sqpoll-idle", "int",
+                              event_loop_base_get_param,
+                              event_loop_base_set_param,
+                              NULL, &io_uring_sqpoll_idle_info);
     object_class_property_add(klass, "thread-pool-min", "int",
                               event_loop_base_get_param,
                               event_loop_base_set_param,
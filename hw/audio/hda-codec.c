@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
 #include "hw/qdev-properties.h"
+#include "qapi/error.h"
 #include "intel-hda.h"
 #include "migration/vmstate.h"
 #include "qemu/host-utils.h"
@@ -132,6 +133,7 @@ static void hda_codec_parse_fmt(uint32_t format, struct audsettings *as)
 #include  "hda-codec-common.h"
 
 #define HDA_TIMER_TICKS (SCALE_MS)
+#define HDA_MAX_XFER_PERIOD 10 /* ms, keeps a batch well below B_SIZE / 2 */
 #define B_SIZE sizeof(st->buf)
 #define B_MASK (sizeof(st->buf) - 1)
 
@@ -172,6 +174,8 @@ struct HDAAudioStream {
     int64_t wpos;
     QEMUTimer *buft;
     int64_t buft_start;
+    uint64_t xfers;
+    int64_t xfers_start;
 };
 
 struct HDAAudioState {
@@ -188,6 +192,7 @@ struct HDAAudioState {
     uint32_t debug;
     bool     mixer;
     bool     use_timer;
+    uint32_t xfer_period;
 };
 
 static inline uint32_t hda_bytes_per_second(HDAAudioStream *st)
@@ -195,9 +200,35 @@ static inline uint32_t hda_bytes_per_second(HDAAudioStream *st)
     return 2 * (uint32_t)st->as.nchannels * (uint32_t)st->as.freq;
 }
 
+static inline int64_t hda_timer_period(HDAAudioStream *st)
+{
+    return st->state->xfer_period * HDA_TIMER_TICKS;
+}
+
+/*
+ * Count DMA transfers and report their rate once per second of guest time,
+ * which shows how much host work the xfer-period setting saves.
+ */
+static void hda_audio_count_xfer(HDAAudioStream *st)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t elapsed = now - st->xfers_start;
+
+    st->xfers++;
+    if (elapsed >= NANOSECONDS_PER_SECOND) {
+        trace_hda_audio_xfer_rate(st->node->name,
+                                  muldiv64(st->xfers, NANOSECONDS_PER_SECOND,
+                                           elapsed));
+        st->xfers = 0;
+        st->xfers_start = now;
+    }
+}
+
 static inline void hda_timer_sync_adjust(HDAAudioStream *st, int64_t target_pos)
 {
-    int64_t limit = B_SIZE / 8;
+    /* a whole batch moves at once, don't mistake that for drift */
+    int64_t limit = MAX(B_SIZE / 8, hda_bytes_per_second(st) / 1000 *
+                                    st->state->xfer_period);
     int64_t corr = 0;
 
     if (target_pos > limit) {
@@ -251,6 +282,7 @@ static void hda_audio_input_timer(void *opaque)
         if (!rc) {
             break;
         }
+        hda_audio_count_xfer(st);
         rpos += chunk;
         to_transfer -= chunk;
         st->rpos += chunk;
@@ -259,7 +291,7 @@ static void hda_audio_input_timer(void *opaque)
 out_timer:
 
     if (st->running) {
-        timer_mod_anticipate_ns(st->buft, now + HDA_TIMER_TICKS);
+        timer_mod_anticipate_ns(st->buft, now + hda_timer_period(st));
     }
 }
 
@@ -321,6 +353,7 @@ static void hda_audio_output_timer(void *opaque)
         if (!rc) {
             break;
         }
+        hda_audio_count_xfer(st);
         wpos += chunk;
         to_transfer -= chunk;
         st->wpos += chunk;
@@ -329,7 +362,7 @@ static void hda_audio_output_timer(void *opaque)
 out_timer:
 
     if (st->running) {
-        timer_mod_anticipate_ns(st->buft, now + HDA_TIMER_TICKS);
+        timer_mod_anticipate_ns(st->buft, now + hda_timer_period(st));
     }
 }
 
@@ -388,6 +421,7 @@ static void hda_audio_compat_input_cb(void *opaque, int avail)
         if (!rc) {
             break;
         }
+        hda_audio_count_xfer(st);
         st->compat_bpos = 0;
     }
 }
@@ -406,6 +440,7 @@ static void hda_audio_compat_output_cb(void *opaque, int avail)
             if (!rc) {
                 break;
             }
+            hda_audio_count_xfer(st);
             st->compat_bpos = 0;
         }
         len = AUD_write(st->voice.out, st->compat_buf + st->compat_bpos,
@@ -428,13 +463,15 @@ static void hda_audio_set_running(HDAAudioStream *st, bool running)
     }
     st->running = running;
     trace_hda_audio_running(st->node->name, st->stream, st->running);
+    st->xfers = 0;
+    st->xfers_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     if (st->state->use_timer) {
         if (running) {
             int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
             st->rpos = 0;
             st->wpos = 0;
             st->buft_start = now;
-            timer_mod_anticipate_ns(st->buft, now + HDA_TIMER_TICKS);
+            timer_mod_anticipate_ns(st->buft, now + hda_timer_period(st));
         } else {
             timer_del(st->buft);
         }
@@ -698,6 +735,12 @@ static void hda_audio_init(HDACodecDevice *hda,
     const desc_param *param;
     uint32_t i, type;
 
+    if (a->xfer_period < 1 || a->xfer_period > HDA_MAX_XFER_PERIOD) {
+        error_setg(errp, "xfer-period must be between 1 and %d ms",
+                   HDA_MAX_XFER_PERIOD);
+        return;
+    }
+
     if (!AUD_register_card("hda", &a->card, errp)) {
         return;
     }
@@ -862,6 +905,7 @@ static Property hda_audio_properties[] = {
     DEFINE_PROP_UINT32("debug", HDAAudioState, debug,   0),
     DEFINE_PROP_BOOL("mixer", HDAAudioState, mixer,  true),
     DEFINE_PROP_BOOL("use-timer", HDAAudioState, use_timer,  true),
+    DEFINE_PROP_UINT32("xfer-period", HDAAudioState, xfer_period, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
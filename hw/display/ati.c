@@ -1037,6 +1037,7 @@ static void ati_vga_exit(PCIDevice *dev)
 
     timer_del(&s->vblank_timer);
     graphic_console_close(s->vga.con);
+    vga_common_exit(&s->vga);
 }
 
 static Property ati_vga_properties[] = {
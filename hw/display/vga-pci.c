@@ -315,6 +315,7 @@ static void pci_secondary_vga_exit(PCIDevice *dev)
     if (d->flags & (1 << PCI_VGA_FLAG_ENABLE_EDID)) {
         memory_region_del_subregion(&d->mmio, &d->mrs[3]);
     }
+    vga_common_exit(s);
 }
 
 static void pci_secondary_vga_init(Object *obj)
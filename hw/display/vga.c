@@ -35,6 +35,8 @@
 #include "ui/pixel_ops.h"
 #include "ui/console.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/bitmap.h"
 #include "hw/xen/xen.h"
 #include "migration/vmstate.h"
 #include "trace.h"
@@ -1191,6 +1193,97 @@ static void vga_get_text_resolution(VGACommonState *s, int *pwidth, int *pheight
  * - underline
  * - flashing
  */
+/*
+ * Pre-rendered text mode cells, keyed by character and attribute.  Boot
+ * screens and DOS programs redraw the same few cells over and over, and
+ * copying a ready-made cell row by row is much cheaper than expanding the
+ * font bits pixel by pixel.  The cache is flushed on every full text
+ * update, which is what font, palette and cell size changes trigger.
+ */
+#define VGA_GLYPH_CACHE_BITS            9   /* direct mapped */
+#define VGA_GLYPH_CACHE_SIZE            (1 << VGA_GLYPH_CACHE_BITS)
+#define VGA_GLYPH_MAX_WIDTH             16
+#define VGA_GLYPH_MAX_HEIGHT            32
+#define VGA_GLYPH_VALID                 (1 << 17)
+
+typedef struct VGAGlyph {
+    uint32_t key;
+    uint32_t pixels[VGA_GLYPH_MAX_WIDTH * VGA_GLYPH_MAX_HEIGHT];
+} VGAGlyph;
+
+struct VGAGlyphCache {
+    int cw;
+    int cheight;
+    VGAGlyph glyphs[VGA_GLYPH_CACHE_SIZE];
+};
+
+static void vga_glyph_cache_flush(VGACommonState *s, int cw, int cheight)
+{
+    int i;
+
+    if (!s->glyph_cache) {
+        s->glyph_cache = g_new(VGAGlyphCache, 1);
+    }
+    s->glyph_cache->cw = cw;
+    s->glyph_cache->cheight = cheight;
+    for (i = 0; i < VGA_GLYPH_CACHE_SIZE; i++) {
+        s->glyph_cache->glyphs[i].key = 0;
+    }
+}
+
+static const uint32_t *vga_glyph_get(VGACommonState *s, int ch_attr,
+                                     const uint8_t *font_ptr,
+                                     uint32_t fgcol, uint32_t bgcol, int dup9)
+{
+    VGAGlyphCache *cache = s->glyph_cache;
+    uint32_t key = VGA_GLYPH_VALID | (dup9 << 16) | (ch_attr & 0xffff);
+    VGAGlyph *g = &cache->glyphs[(key * 2654435761u) >>
+                                 (32 - VGA_GLYPH_CACHE_BITS)];
+    uint8_t *d = (uint8_t *)g->pixels;
+    int linesize = cache->cw * sizeof(uint32_t);
+
+    if (g->key == key) {
+        return g->pixels;
+    }
+
+    g->key = key;
+    if (cache->cw == 16) {
+        vga_draw_glyph16(d, linesize, font_ptr, cache->cheight, fgcol, bgcol);
+    } else if (cache->cw != 9) {
+        vga_draw_glyph8(d, linesize, font_ptr, cache->cheight, fgcol, bgcol);
+    } else {
+        vga_draw_glyph9(d, linesize, font_ptr, cache->cheight, fgcol, bgcol,
+                        dup9);
+    }
+    return g->pixels;
+}
+
+static void vga_glyph_blit(uint8_t *d, int linesize, const uint32_t *glyph,
+                           int cw, int cheight)
+{
+    size_t row = cw * sizeof(uint32_t);
+
+    /* constant-size copies, so the compiler emits plain vector moves */
+    do {
+        switch (cw) {
+        case 16:
+            memcpy(d, glyph, 16 * sizeof(uint32_t));
+            break;
+        case 9:
+            memcpy(d, glyph, 9 * sizeof(uint32_t));
+            break;
+        case 8:
+            memcpy(d, glyph, 8 * sizeof(uint32_t));
+            break;
+        default:
+            memcpy(d, glyph, row);
+            break;
+        }
+        glyph += cw;
+        d += linesize;
+    } while (--cheight);
+}
+
 static void vga_draw_text(VGACommonState *s, int full_update)
 {
     DisplaySurface *surface = qemu_console_surface(s->con);
@@ -1264,6 +1357,10 @@ static void vga_draw_text(VGACommonState *s, int full_update)
         s->full_update_gfx = 0;
         full_update |= 1;
     }
+    if (full_update || !s->glyph_cache || s->glyph_cache->cw != cw ||
+        s->glyph_cache->cheight != cheight) {
+        vga_glyph_cache_flush(s, cw, cheight);
+    }
 
     cursor_offset = ((s->cr[VGA_CRTC_CURSOR_HI] << 8) |
                      s->cr[VGA_CRTC_CURSOR_LO]) - s->params.start_addr;
@@ -1318,21 +1415,15 @@ static void vga_draw_text(VGACommonState *s, int full_update)
                 font_ptr += 32 * 4 * ch;
                 bgcol = palette[cattr >> 4];
                 fgcol = palette[cattr & 0x0f];
-                if (cw == 16) {
-                    vga_draw_glyph16(d1, linesize,
-                                     font_ptr, cheight, fgcol, bgcol);
-                } else if (cw != 9) {
-                    vga_draw_glyph8(d1, linesize,
-                                    font_ptr, cheight, fgcol, bgcol);
-                } else {
-                    dup9 = 0;
-                    if (ch >= 0xb0 && ch <= 0xdf &&
-                        (s->ar[VGA_ATC_MODE] & 0x04)) {
-                        dup9 = 1;
-                    }
-                    vga_draw_glyph9(d1, linesize,
-                                    font_ptr, cheight, fgcol, bgcol, dup9);
+                dup9 = 0;
+                if (cw == 9 && ch >= 0xb0 && ch <= 0xdf &&
+                    (s->ar[VGA_ATC_MODE] & 0x04)) {
+                    dup9 = 1;
                 }
+                vga_glyph_blit(d1, linesize,
+                               vga_glyph_get(s, ch_attr, font_ptr,
+                                             fgcol, bgcol, dup9),
+                               cw, cheight);
                 if (src == cursor_ptr &&
                     !(s->cr[VGA_CRTC_CURSOR_START] & 0x20) &&
                     s->cursor_visible_phase) {
@@ -1454,6 +1545,107 @@ void vga_invalidate_scanlines(VGACommonState *s, int y1, int y2)
     }
 }
 
+/*
+ * Converting scanlines of high resolution modes into the display surface
+ * dominates refresh time, so large updates are split into stripes that
+ * are drawn by a small pool of helper threads (plus the refreshing
+ * thread itself).  The dirty bitmap snapshot, the scanline address
+ * computation and everything that touches shared device state (panning
+ * buffer, hardware cursor) stays on the refreshing thread.
+ */
+#define VGA_DRAW_MAX_THREADS            8
+#define VGA_DRAW_STRIPE_LINES           16
+/* below this many pixels the thread handoff costs more than it saves */
+#define VGA_DRAW_PARALLEL_MIN_PIXELS    (512 * 1024)
+
+typedef struct VGADrawLine {
+    uint8_t *d;
+    uint32_t addr;
+} VGADrawLine;
+
+typedef struct VGADrawJob {
+    VGACommonState *s;
+    vga_draw_line_func *draw_line;
+    VGADrawLine *lines;
+    int nlines;
+    int width;
+    int next;
+} VGADrawJob;
+
+typedef struct VGADrawPool {
+    int nthreads;
+    QemuThread threads[VGA_DRAW_MAX_THREADS];
+    QemuSemaphore start[VGA_DRAW_MAX_THREADS];
+    QemuSemaphore done;
+    VGADrawJob *job;
+} VGADrawPool;
+
+static VGADrawPool vga_draw_pool;
+
+static void vga_draw_job_run(VGADrawJob *job)
+{
+    int first, i;
+
+    while ((first = qatomic_fetch_add(&job->next, VGA_DRAW_STRIPE_LINES))
+           < job->nlines) {
+        for (i = first;
+             i < MIN(first + VGA_DRAW_STRIPE_LINES, job->nlines); i++) {
+            /* lines with pixel panning are drawn serially, p is NULL */
+            job->draw_line(job->s, job->lines[i].d, job->lines[i].addr,
+                           job->width, 0);
+        }
+    }
+}
+
+static void *vga_draw_thread(void *opaque)
+{
+    int idx = (uintptr_t)opaque;
+
+    for (;;) {
+        qemu_sem_wait(&vga_draw_pool.start[idx]);
+        vga_draw_job_run(vga_draw_pool.job);
+        qemu_sem_post(&vga_draw_pool.done);
+    }
+    return NULL;
+}
+
+static int vga_draw_pool_size(void)
+{
+    static bool initialized;
+    int i;
+
+    if (!initialized) {
+        initialized = true;
+        vga_draw_pool.nthreads = MIN(g_get_num_processors() - 1,
+                                     VGA_DRAW_MAX_THREADS);
+        qemu_sem_init(&vga_draw_pool.done, 0);
+        for (i = 0; i < vga_draw_pool.nthreads; i++) {
+            qemu_sem_init(&vga_draw_pool.start[i], 0);
+            qemu_thread_create(&vga_draw_pool.threads[i], "vga-draw",
+                               vga_draw_thread, (void *)(uintptr_t)i,
+                               QEMU_THREAD_DETACHED);
+        }
+    }
+    return MAX(vga_draw_pool.nthreads, 0);
+}
+
+static void vga_draw_lines_parallel(VGADrawJob *job)
+{
+    int nthreads = MIN(vga_draw_pool.nthreads,
+                       DIV_ROUND_UP(job->nlines, VGA_DRAW_STRIPE_LINES) - 1);
+    int i;
+
+    vga_draw_pool.job = job;
+    for (i = 0; i < nthreads; i++) {
+        qemu_sem_post(&vga_draw_pool.start[i]);
+    }
+    vga_draw_job_run(job);
+    for (i = 0; i < nthreads; i++) {
+        qemu_sem_wait(&vga_draw_pool.done);
+    }
+    vga_draw_pool.job = NULL;
+}
+
 static bool vga_scanline_invalidated(VGACommonState *s, int y)
 {
     if (y >= VGA_MAX_HEIGHT) {
@@ -1482,6 +1674,10 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     int width, height, shift_control, bwidth, bits;
     ram_addr_t page0, page1, region_start, region_end;
     DirtyBitmapSnapshot *snap = NULL;
+    g_autofree unsigned long *updated = NULL;
+    g_autofree VGADrawLine *deferred = NULL;
+    int ndeferred = 0;
+    bool parallel;
     int disp_width, multi_scan, multi_run;
     int hpel;
     uint8_t *d;
@@ -1665,7 +1861,6 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
            s->params.line_compare, sr(s, VGA_SEQ_CLOCK_MODE));
 #endif
     addr1 = (s->params.start_addr * 4);
-    y_start = -1;
     d = surface_data(surface);
     linesize = surface_stride(surface);
     y1 = 0;
@@ -1676,6 +1871,14 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
                                                       DIRTY_MEMORY_VGA);
     }
 
+    updated = bitmap_new(height);
+    parallel = surface_is_allocated(surface) &&
+        disp_width * height >= VGA_DRAW_PARALLEL_MIN_PIXELS &&
+        vga_draw_pool_size() > 0;
+    if (parallel) {
+        deferred = g_new(VGADrawLine, height);
+    }
+
     for(y = 0; y < height; y++) {
         addr = addr1;
         if (!(s->cr[VGA_CRTC_MODE] & 1)) {
@@ -1705,23 +1908,15 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         /* explicit invalidation for the hardware cursor (cirrus only) */
         update |= vga_scanline_invalidated(s, y);
         if (update) {
-            if (y_start < 0)
-                y_start = y;
-            if (surface_is_allocated(surface)) {
+            set_bit(y, updated);
+            if (parallel && !(hpel & 7)) {
+                deferred[ndeferred++] = (VGADrawLine) { d, addr };
+            } else if (surface_is_allocated(surface)) {
                 uint8_t *p;
                 p = vga_draw_line(s, d, addr, width, hpel);
                 if (p) {
                     memcpy(d, p, disp_width * sizeof(uint32_t));
                 }
-                if (s->cursor_draw_line)
-                    s->cursor_draw_line(s, d, y);
-            }
-        } else {
-            if (y_start >= 0) {
-                /* flush to display */
-                dpy_gfx_update(s->con, 0, y_start,
-                               disp_width, y - y_start);
-                y_start = -1;
             }
         }
         if (!multi_run) {
@@ -1742,10 +1937,29 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         }
         d += linesize;
     }
-    if (y_start >= 0) {
+
+    if (ndeferred) {
+        VGADrawJob job = {
+            .s = s,
+            .draw_line = vga_draw_line,
+            .lines = deferred,
+            .nlines = ndeferred,
+            .width = width,
+        };
+        vga_draw_lines_parallel(&job);
+    }
+
+    d = surface_data(surface);
+    for (y = find_first_bit(updated, height); y < height;
+         y = find_next_bit(updated, height, y_start)) {
+        y_start = find_next_zero_bit(updated, height, y);
+        if (s->cursor_draw_line && surface_is_allocated(surface)) {
+            for (y1 = y; y1 < y_start; y1++) {
+                s->cursor_draw_line(s, d + y1 * linesize, y1);
+            }
+        }
         /* flush to display */
-        dpy_gfx_update(s->con, 0, y_start,
-                       disp_width, y - y_start);
+        dpy_gfx_update(s->con, 0, y, disp_width, y_start - y);
     }
     g_free(snap);
     memset(s->invalidated_y_table, 0, sizeof(s->invalidated_y_table));
@@ -2272,6 +2486,13 @@ bool vga_common_init(VGACommonState *s, Object *obj, Error **errp)
     return true;
 }
 
+/* Frees the glyph cache of text mode, for devices that can be unplugged */
+void vga_common_exit(VGACommonState *s)
+{
+    g_free(s->glyph_cache);
+    s->glyph_cache = NULL;
+}
+
 static const MemoryRegionPortio vga_portio_list[] = {
     { 0x04,  2, 1, .read = vga_ioport_read, .write = vga_ioport_write }, /* 3b4 */
     { 0x0a,  1, 1, .read = vga_ioport_read, .write = vga_ioport_write }, /* 3ba */
@@ -54,6 +54,7 @@ union vga_retrace {
 };
 
 struct VGACommonState;
+typedef struct VGAGlyphCache VGAGlyphCache;
 typedef uint8_t (* vga_retrace_fn)(struct VGACommonState *s);
 typedef void (* vga_update_retrace_info_fn)(struct VGACommonState *s);
 
@@ -146,6 +147,7 @@ typedef struct VGACommonState {
     /* tell for each page if it has been updated since the last time */
     uint32_t last_palette[256];
     uint32_t last_ch_attr[CH_ATTR_SIZE]; /* XXX: make it dynamic */
+    VGAGlyphCache *glyph_cache;
     /* retrace */
     vga_retrace_fn retrace;
     vga_update_retrace_info_fn update_retrace_info;
@@ -162,6 +164,7 @@ static inline int c6_to_8(int v)
 }
 
 bool vga_common_init(VGACommonState *s, Object *obj, Error **errp);
+void vga_common_exit(VGACommonState *s);
 void vga_init(VGACommonState *s, Object *obj, MemoryRegion *address_space,
               MemoryRegion *address_space_io, bool init_vga_ports);
 MemoryRegion *vga_init_io(VGACommonState *s, Object *obj,
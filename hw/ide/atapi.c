@@ -25,6 +25,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
 #include "hw/scsi/scsi.h"
 #include "sysemu/block-backend.h"
 #include "scsi/constants.h"
@@ -34,6 +37,12 @@
 #define ATAPI_SECTOR_BITS (2 + BDRV_SECTOR_BITS)
 #define ATAPI_SECTOR_SIZE (1 << ATAPI_SECTOR_BITS)
 
+/* Upper bound for the ide-cd "readahead" property */
+#define ATAPI_READAHEAD_MAX (16 * MiB)
+
+/* Sectors that must be read back to back before read-ahead kicks in */
+#define ATAPI_READAHEAD_MIN_RUN 16
+
 static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret);
 
 static void padstr8(uint8_t *buf, int buf_size, const char *src)
@@ -88,10 +97,206 @@ static void cd_data_to_raw(uint8_t *buf, int lba)
     memset(buf, 0, 288);
 }
 
+/*
+ * Sequential read-ahead
+ *
+ * Guests read CD-ROMs one sector (PIO) or one DMA chunk at a time, so a
+ * streaming read pays the backend latency for every small request.  Once
+ * the drive sees a sequential stream, two buffers are kept filled with
+ * the sectors that follow the current command: while the guest consumes
+ * one, the other is being read.  The buffers are only a cache of the
+ * medium; they are dropped on reset and medium change and not migrated.
+ */
+
+bool ide_atapi_readahead_init(IDEState *s, uint32_t size, Error **errp)
+{
+    int i;
+
+    if (size > ATAPI_READAHEAD_MAX) {
+        error_setg(errp, "readahead must be at most %" PRId64 " MiB",
+                   ATAPI_READAHEAD_MAX / MiB);
+        return false;
+    }
+
+    s->cd_ra_sectors = size / 2 / ATAPI_SECTOR_SIZE;
+    for (i = 0; i < ARRAY_SIZE(s->cd_ra); i++) {
+        s->cd_ra[i].s = s;
+        s->cd_ra[i].lba = -1;
+        if (s->cd_ra_sectors) {
+            s->cd_ra[i].buf = blk_blockalign(s->blk, s->cd_ra_sectors *
+                                                     ATAPI_SECTOR_SIZE);
+        }
+    }
+    s->cd_ra_next_lba = -1;
+    return true;
+}
+
+void ide_atapi_readahead_reset(IDEState *s)
+{
+    int i;
+
+    /* Reads still in flight are discarded when they complete */
+    s->cd_ra_generation++;
+    for (i = 0; i < ARRAY_SIZE(s->cd_ra); i++) {
+        if (!s->cd_ra[i].aiocb) {
+            s->cd_ra[i].lba = -1;
+        }
+    }
+    s->cd_ra_next_lba = -1;
+    s->cd_ra_run = 0;
+}
+
+void ide_atapi_readahead_exit(IDEState *s)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->cd_ra); i++) {
+        if (s->cd_ra[i].aiocb) {
+            blk_aio_cancel(s->cd_ra[i].aiocb);
+        }
+        qemu_vfree(s->cd_ra[i].buf);
+        s->cd_ra[i].buf = NULL;
+    }
+    s->cd_ra_sectors = 0;
+}
+
+static void cd_readahead_cb(void *opaque, int ret)
+{
+    IDECDReadahead *ra = opaque;
+
+    trace_cd_readahead_cb(ra->lba, ra->nb_sectors, ret);
+    ra->aiocb = NULL;
+    if (ret < 0 || ra->generation != ra->s->cd_ra_generation) {
+        ra->lba = -1;
+    }
+}
+
+static bool cd_readahead_covers(IDECDReadahead *ra, int lba)
+{
+    return ra->lba != -1 && ra->lba <= lba && lba < ra->lba + ra->nb_sectors;
+}
+
+static void cd_readahead_update(IDEState *s, int lba, int nb_sectors)
+{
+    int total = s->nb_sectors >> 2;
+    int start, end, i;
+    IDECDReadahead *ra, *idle = NULL;
+
+    if (lba == s->cd_ra_next_lba) {
+        s->cd_ra_run += nb_sectors;
+    } else {
+        s->cd_ra_run = nb_sectors;
+    }
+    s->cd_ra_next_lba = lba + nb_sectors;
+    if (!s->cd_ra_sectors || s->cd_ra_run < ATAPI_READAHEAD_MIN_RUN) {
+        return;
+    }
+
+    /*
+     * The rest of the current command is read directly, read ahead from
+     * the first sector after it that is not buffered or being read yet.
+     */
+    start = lba + DIV_ROUND_UP(s->packet_transfer_size, s->cd_sector_size);
+    end = start;
+    for (i = 0; i < 2 * ARRAY_SIZE(s->cd_ra); i++) {
+        ra = &s->cd_ra[i % ARRAY_SIZE(s->cd_ra)];
+        if (cd_readahead_covers(ra, end)) {
+            end = ra->lba + ra->nb_sectors;
+        }
+    }
+    if (end >= total) {
+        return;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->cd_ra); i++) {
+        ra = &s->cd_ra[i];
+        if (!ra->aiocb && (ra->lba == -1 || ra->lba >= end ||
+                           ra->lba + ra->nb_sectors <= start)) {
+            idle = ra;
+        }
+    }
+    if (!idle) {
+        return;
+    }
+
+    idle->lba = end;
+    idle->nb_sectors = MIN(s->cd_ra_sectors, total - end);
+    idle->generation = s->cd_ra_generation;
+    trace_cd_readahead(idle->lba, idle->nb_sectors);
+    qemu_iovec_init_buf(&idle->qiov, idle->buf,
+                        idle->nb_sectors * ATAPI_SECTOR_SIZE);
+    idle->aiocb = blk_aio_preadv(s->blk,
+                                 (int64_t)idle->lba << ATAPI_SECTOR_BITS,
+                                 &idle->qiov, 0, cd_readahead_cb, idle);
+}
+
+/*
+ * Copy nb_sectors sectors starting at lba into buf if they are all
+ * buffered, and start reading ahead if the guest is streaming.
+ */
+static bool cd_readahead_read(IDEState *s, int lba, int nb_sectors,
+                              uint8_t *buf)
+{
+    int cur = lba, n, i;
+    bool hit = true;
+
+    while (hit && cur < lba + nb_sectors) {
+        hit = false;
+        for (i = 0; i < ARRAY_SIZE(s->cd_ra); i++) {
+            IDECDReadahead *ra = &s->cd_ra[i];
+
+            if (!ra->aiocb && cd_readahead_covers(ra, cur)) {
+                n = MIN(lba + nb_sectors, ra->lba + ra->nb_sectors) - cur;
+                memcpy(buf + (cur - lba) * ATAPI_SECTOR_SIZE,
+                       ra->buf + (cur - ra->lba) * ATAPI_SECTOR_SIZE,
+                       n * ATAPI_SECTOR_SIZE);
+                cur += n;
+                hit = true;
+                break;
+            }
+        }
+    }
+
+    trace_cd_readahead_read(lba, nb_sectors, hit);
+    cd_readahead_update(s, lba, nb_sectors);
+    return hit;
+}
+
+/* Serve sector s->lba from the read-ahead buffers if possible */
+static bool cd_read_sector_buffered(IDEState *s)
+{
+    uint8_t *buf;
+
+    if (s->cd_sector_size != 2048 && s->cd_sector_size != 2352) {
+        return false;
+    }
+
+    buf = (s->cd_sector_size == 2352) ? s->io_buffer + 16 : s->io_buffer;
+    if (!cd_readahead_read(s, s->lba, 1, buf)) {
+        return false;
+    }
+
+    block_acct_start(blk_get_stats(s->blk), &s->acct,
+                     ATAPI_SECTOR_SIZE, BLOCK_ACCT_READ);
+    block_acct_done(blk_get_stats(s->blk), &s->acct);
+
+    if (s->cd_sector_size == 2352) {
+        cd_data_to_raw(s->io_buffer, s->lba);
+    }
+
+    s->lba++;
+    s->io_buffer_index = 0;
+    return true;
+}
+
 static int
 cd_read_sector_sync(IDEState *s)
 {
     int ret;
+
+    if (cd_read_sector_buffered(s)) {
+        return 0;
+    }
+
     block_acct_start(blk_get_stats(s->blk), &s->acct,
                      ATAPI_SECTOR_SIZE, BLOCK_ACCT_READ);
 
@@ -150,6 +355,10 @@ static void cd_read_sector_cb(void *opaque, int ret)
     ide_atapi_cmd_reply_end(s);
 }
 
+/*
+ * Returns 1 if the sector was already buffered and is in s->io_buffer,
+ * 0 if a read was started and cd_read_sector_cb() will be called.
+ */
 static int cd_read_sector(IDEState *s)
 {
     void *buf;
@@ -159,6 +368,10 @@ static int cd_read_sector(IDEState *s)
         return -EINVAL;
     }
 
+    if (cd_read_sector_buffered(s)) {
+        return 1;
+    }
+
     buf = (s->cd_sector_size == 2352) ? s->io_buffer + 16 : s->io_buffer;
     qemu_iovec_init_buf(&s->qiov, buf, ATAPI_SECTOR_SIZE);
 
@@ -234,7 +447,10 @@ void ide_atapi_cmd_reply_end(IDEState *s)
                 if (ret < 0) {
                     ide_atapi_io_error(s, ret);
                 }
-                return;
+                if (ret <= 0) {
+                    return;
+                }
+                /* the sector was already buffered, carry on */
             } else {
                 /* rebuffering within an elementary transfer is
                  * only possible with a sync request because we
@@ -360,6 +576,7 @@ static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret)
         }
     }
 
+next_chunk:
     if (s->io_buffer_size > 0) {
         /*
          * For a cdrom read sector command (s->lba != -1),
@@ -401,6 +618,10 @@ static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret)
         s->io_buffer_size = n * 2048;
         data_offset = 0;
     }
+    if (cd_readahead_read(s, s->lba, n, s->io_buffer + data_offset)) {
+        goto next_chunk;
+    }
+
     trace_ide_atapi_cmd_read_dma_cb_aio(s, s->lba, n);
     qemu_iovec_init_buf(&s->bus->dma->qiov, s->io_buffer + data_offset,
                         n * ATAPI_SECTOR_SIZE);
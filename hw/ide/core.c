@@ -1198,6 +1198,7 @@ static void ide_cd_change_cb(void *opaque, bool load, Error **errp)
     s->tray_open = !load;
     blk_get_geometry(s->blk, &nb_sectors);
     s->nb_sectors = nb_sectors;
+    ide_atapi_readahead_reset(s);
 
     /*
      * First indicate to the guest that a CD has been removed.  That's
@@ -1395,6 +1396,9 @@ static void ide_reset(IDEState *s)
     s->atapi_dma = 0;
     s->tray_locked = 0;
     s->tray_open = 0;
+    if (s->drive_kind == IDE_CD) {
+        ide_atapi_readahead_reset(s);
+    }
     /* ATA DMA state */
     s->io_buffer_size = 0;
     s->req_nb_sectors = 0;
@@ -2624,6 +2628,9 @@ int ide_init_drive(IDEState *s, IDEDevice *dev, IDEDriveKind kind, Error **errp)
     s->smart_errors = 0;
     s->smart_selftest_count = 0;
     if (kind == IDE_CD) {
+        if (!ide_atapi_readahead_init(s, dev->readahead, errp)) {
+            return -1;
+        }
         blk_set_dev_ops(s->blk, &ide_cd_block_ops, s);
     } else {
         if (!blk_is_inserted(s->blk)) {
@@ -2817,6 +2824,7 @@ void ide_bus_set_irq(IDEBus *bus)
 void ide_exit(IDEState *s)
 {
     timer_free(s->sector_write_timer);
+    ide_atapi_readahead_exit(s);
     qemu_vfree(s->smart_selftest_data);
     qemu_vfree(s->io_buffer);
 }
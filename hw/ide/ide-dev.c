@@ -22,6 +22,7 @@
 #include "qapi/qapi-types-block.h"
 #include "qemu/error-report.h"
 #include "qemu/module.h"
+#include "qemu/units.h"
 #include "hw/ide/ide-dev.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/blockdev.h"
@@ -220,6 +221,7 @@ static const TypeInfo ide_hd_info = {
 
 static Property ide_cd_properties[] = {
     DEFINE_IDE_DEV_PROPERTIES(),
+    DEFINE_PROP_SIZE32("readahead", IDEDrive, dev.readahead, 512 * KiB),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -442,6 +442,9 @@ void ide_cancel_dma_sync(IDEState *s);
 /* hw/ide/atapi.c */
 void ide_atapi_cmd(IDEState *s);
 void ide_atapi_cmd_reply_end(IDEState *s);
+bool ide_atapi_readahead_init(IDEState *s, uint32_t size, Error **errp);
+void ide_atapi_readahead_reset(IDEState *s);
+void ide_atapi_readahead_exit(IDEState *s);
 
 int ide_handle_rw_error(IDEState *s, int error, int op);
 
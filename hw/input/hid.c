@@ -336,6 +336,84 @@ static void hid_keyboard_process_keycode(HIDState *hs)
     }
 }
 
+static void hid_gamepad_event(DeviceState *dev, QemuConsole *src,
+                              InputEvent *evt)
+{
+    HIDState *hs = (HIDState *)dev;
+    InputPadBtnEvent *btn;
+    InputPadAxisEvent *axis;
+
+    switch (evt->type) {
+    case INPUT_EVENT_KIND_PAD_BTN:
+        btn = evt->u.pad_btn.data;
+        if (btn->down) {
+            hs->pad.buttons |= 1u << btn->button;
+        } else {
+            hs->pad.buttons &= ~(1u << btn->button);
+        }
+        break;
+
+    case INPUT_EVENT_KIND_PAD_AXIS:
+        axis = evt->u.pad_axis.data;
+        hs->pad.axis[axis->axis] = axis->value;
+        break;
+
+    default:
+        /* keep gcc happy */
+        break;
+    }
+}
+
+static void hid_gamepad_build_report(HIDState *hs, uint8_t *report)
+{
+    /* Hat switch positions, clockwise from north; 8 is the null state */
+    static const uint8_t hat[16] = {
+        8, 0, 4, 8, 6, 7, 5, 6, 2, 1, 3, 2, 8, 0, 4, 8,
+    };
+    uint32_t buttons = hs->pad.buttons;
+    uint32_t face = buttons & ((1u << INPUT_PAD_BUTTON_DPAD_UP) - 1);
+    int dpad = 0, i;
+
+    if (buttons & (1u << INPUT_PAD_BUTTON_DPAD_UP)) {
+        dpad |= 1;
+    }
+    if (buttons & (1u << INPUT_PAD_BUTTON_DPAD_DOWN)) {
+        dpad |= 2;
+    }
+    if (buttons & (1u << INPUT_PAD_BUTTON_DPAD_LEFT)) {
+        dpad |= 4;
+    }
+    if (buttons & (1u << INPUT_PAD_BUTTON_DPAD_RIGHT)) {
+        dpad |= 8;
+    }
+
+    report[0] = face & 0xff;
+    report[1] = face >> 8;
+    report[2] = hat[dpad];
+    for (i = 0; i < INPUT_PAD_AXIS__MAX; i++) {
+        report[3 + i] = (uint8_t)MAX(hs->pad.axis[i] >> 8, -127);
+    }
+}
+
+/*
+ * Reports are only built once per sync, so all the button and axis
+ * changes of one host poll reach the guest in a single interrupt
+ * transfer, and a sync that changes nothing wakes nobody.
+ */
+static void hid_gamepad_sync(DeviceState *dev)
+{
+    HIDState *hs = (HIDState *)dev;
+    uint8_t report[HID_GAMEPAD_REPORT_LEN];
+
+    hid_gamepad_build_report(hs, report);
+    if (!memcmp(report, hs->pad.report, sizeof(report))) {
+        return;
+    }
+    memcpy(hs->pad.report, report, sizeof(report));
+    hs->n = 1;
+    hs->event(hs);
+}
+
 static inline int int_clamp(int val, int vmin, int vmax)
 {
     if (val < vmin) {
@@ -458,6 +536,16 @@ int hid_keyboard_poll(HIDState *hs, uint8_t *buf, int len)
     return MIN(8, len);
 }
 
+int hid_gamepad_poll(HIDState *hs, uint8_t *buf, int len)
+{
+    int l = MIN(len, HID_GAMEPAD_REPORT_LEN);
+
+    hs->idle_pending = false;
+    hs->n = 0;
+    memcpy(buf, hs->pad.report, l);
+    return l;
+}
+
 int hid_keyboard_write(HIDState *hs, uint8_t *buf, int len)
 {
     if (len > 0) {
@@ -495,6 +583,11 @@ void hid_reset(HIDState *hs)
     case HID_TABLET:
         memset(hs->ptr.queue, 0, sizeof(hs->ptr.queue));
         break;
+    case HID_GAMEPAD:
+        hs->pad.buttons = 0;
+        memset(hs->pad.axis, 0, sizeof(hs->pad.axis));
+        hid_gamepad_build_report(hs, hs->pad.report);
+        break;
     }
     hs->head = 0;
     hs->n = 0;
@@ -530,6 +623,13 @@ static const QemuInputHandler hid_tablet_handler = {
     .sync  = hid_pointer_sync,
 };
 
+static const QemuInputHandler hid_gamepad_handler = {
+    .name  = "QEMU HID Gamepad",
+    .mask  = INPUT_EVENT_MASK_PAD,
+    .event = hid_gamepad_event,
+    .sync  = hid_gamepad_sync,
+};
+
 void hid_init(HIDState *hs, int kind, HIDEventFunc event)
 {
     hs->kind = kind;
@@ -545,6 +645,11 @@ void hid_init(HIDState *hs, int kind, HIDEventFunc event)
     } else if (hs->kind == HID_TABLET) {
         hs->s = qemu_input_handler_register((DeviceState *)hs,
                                             &hid_tablet_handler);
+    } else if (hs->kind == HID_GAMEPAD) {
+        hs->s = qemu_input_handler_register((DeviceState *)hs,
+                                            &hid_gamepad_handler);
+        qemu_input_handler_activate(hs->s);
+        hid_gamepad_build_report(hs, hs->pad.report);
     }
 }
 
@@ -624,3 +729,18 @@ const VMStateDescription vmstate_hid_keyboard_device = {
         VMSTATE_END_OF_LIST(),
     }
 };
+
+const VMStateDescription vmstate_hid_gamepad_device = {
+    .name = "HIDGamepadDevice",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = hid_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(pad.buttons, HIDState),
+        VMSTATE_INT32_ARRAY(pad.axis, HIDState, INPUT_PAD_AXIS__MAX),
+        VMSTATE_UINT8_ARRAY(pad.report, HIDState, HID_GAMEPAD_REPORT_LEN),
+        VMSTATE_UINT32(n, HIDState),
+        VMSTATE_UINT8(idle, HIDState),
+        VMSTATE_END_OF_LIST(),
+    }
+};
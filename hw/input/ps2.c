@@ -163,6 +163,7 @@ void ps2_queue_noirq(PS2State *s, int b)
     PS2Queue *q = &s->queue;
 
     if (q->count >= PS2_QUEUE_SIZE) {
+        trace_ps2_queue_full(s);
         return;
     }
 
@@ -171,10 +172,12 @@ void ps2_queue_noirq(PS2State *s, int b)
         q->wptr = 0;
     }
     q->count++;
+    trace_ps2_queue_depth(s, q->count);
 }
 
 static void ps2_raise_irq(PS2State *s)
 {
+    qemu_input_latency_delivered();
     qemu_set_irq(s->irq, 1);
 }
 
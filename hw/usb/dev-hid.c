@@ -53,13 +53,16 @@ enum {
     STR_PRODUCT_MOUSE,
     STR_PRODUCT_TABLET,
     STR_PRODUCT_KEYBOARD,
+    STR_PRODUCT_GAMEPAD,
     STR_SERIAL_COMPAT,
     STR_CONFIG_MOUSE,
     STR_CONFIG_TABLET,
     STR_CONFIG_KEYBOARD,
+    STR_CONFIG_GAMEPAD,
     STR_SERIAL_MOUSE,
     STR_SERIAL_TABLET,
     STR_SERIAL_KEYBOARD,
+    STR_SERIAL_GAMEPAD,
 };
 
 static const USBDescStrings desc_strings = {
@@ -67,13 +70,16 @@ static const USBDescStrings desc_strings = {
     [STR_PRODUCT_MOUSE]    = "QEMU USB Mouse",
     [STR_PRODUCT_TABLET]   = "QEMU USB Tablet",
     [STR_PRODUCT_KEYBOARD] = "QEMU USB Keyboard",
+    [STR_PRODUCT_GAMEPAD]  = "QEMU USB Gamepad",
     [STR_SERIAL_COMPAT]    = "42",
     [STR_CONFIG_MOUSE]     = "HID Mouse",
     [STR_CONFIG_TABLET]    = "HID Tablet",
     [STR_CONFIG_KEYBOARD]  = "HID Keyboard",
+    [STR_CONFIG_GAMEPAD]   = "HID Gamepad",
     [STR_SERIAL_MOUSE]     = "89126",
     [STR_SERIAL_TABLET]    = "28754",
     [STR_SERIAL_KEYBOARD]  = "68284",
+    [STR_SERIAL_GAMEPAD]   = "51647",
 };
 
 static const USBDescIface desc_iface_mouse = {
@@ -260,6 +266,66 @@ static const USBDescIface desc_iface_keyboard2 = {
     },
 };
 
+static const USBDescIface desc_iface_gamepad = {
+    .bInterfaceNumber              = 0,
+    .bNumEndpoints                 = 1,
+    .bInterfaceClass               = USB_CLASS_HID,
+    .bInterfaceProtocol            = 0x00,
+    .ndesc                         = 1,
+    .descs = (USBDescOther[]) {
+        {
+            /* HID descriptor */
+            .data = (uint8_t[]) {
+                0x09,          /*  u8  bLength */
+                USB_DT_HID,    /*  u8  bDescriptorType */
+                0x11, 0x01,    /*  u16 HID_class */
+                0x00,          /*  u8  country_code */
+                0x01,          /*  u8  num_descriptors */
+                USB_DT_REPORT, /*  u8  type: Report */
+                74, 0,         /*  u16 len */
+            },
+        },
+    },
+    .eps = (USBDescEndpoint[]) {
+        {
+            .bEndpointAddress      = USB_DIR_IN | 0x01,
+            .bmAttributes          = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize        = 8,
+            .bInterval             = 0x0a,
+        },
+    },
+};
+
+static const USBDescIface desc_iface_gamepad2 = {
+    .bInterfaceNumber              = 0,
+    .bNumEndpoints                 = 1,
+    .bInterfaceClass               = USB_CLASS_HID,
+    .bInterfaceProtocol            = 0x00,
+    .ndesc                         = 1,
+    .descs = (USBDescOther[]) {
+        {
+            /* HID descriptor */
+            .data = (uint8_t[]) {
+                0x09,          /*  u8  bLength */
+                USB_DT_HID,    /*  u8  bDescriptorType */
+                0x11, 0x01,    /*  u16 HID_class */
+                0x00,          /*  u8  country_code */
+                0x01,          /*  u8  num_descriptors */
+                USB_DT_REPORT, /*  u8  type: Report */
+                74, 0,         /*  u16 len */
+            },
+        },
+    },
+    .eps = (USBDescEndpoint[]) {
+        {
+            .bEndpointAddress      = USB_DIR_IN | 0x01,
+            .bmAttributes          = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize        = 8,
+            .bInterval             = 4, /* 2 ^ (4-1) * 125 usecs = 1 ms */
+        },
+    },
+};
+
 static const USBDescDevice desc_device_mouse = {
     .bcdUSB                        = 0x0100,
     .bMaxPacketSize0               = 8,
@@ -362,6 +428,40 @@ static const USBDescDevice desc_device_keyboard2 = {
     },
 };
 
+static const USBDescDevice desc_device_gamepad = {
+    .bcdUSB                        = 0x0100,
+    .bMaxPacketSize0               = 8,
+    .bNumConfigurations            = 1,
+    .confs = (USBDescConfig[]) {
+        {
+            .bNumInterfaces        = 1,
+            .bConfigurationValue   = 1,
+            .iConfiguration        = STR_CONFIG_GAMEPAD,
+            .bmAttributes          = USB_CFG_ATT_ONE | USB_CFG_ATT_WAKEUP,
+            .bMaxPower             = 50,
+            .nif = 1,
+            .ifs = &desc_iface_gamepad,
+        },
+    },
+};
+
+static const USBDescDevice desc_device_gamepad2 = {
+    .bcdUSB                        = 0x0200,
+    .bMaxPacketSize0               = 64,
+    .bNumConfigurations            = 1,
+    .confs = (USBDescConfig[]) {
+        {
+            .bNumInterfaces        = 1,
+            .bConfigurationValue   = 1,
+            .iConfiguration        = STR_CONFIG_GAMEPAD,
+            .bmAttributes          = USB_CFG_ATT_ONE | USB_CFG_ATT_WAKEUP,
+            .bMaxPower             = 50,
+            .nif = 1,
+            .ifs = &desc_iface_gamepad2,
+        },
+    },
+};
+
 static const USBDescMSOS desc_msos_suspend = {
     .SelectiveSuspendEnabled = true,
 };
@@ -453,6 +553,35 @@ static const USBDesc desc_keyboard2 = {
     .msos = &desc_msos_suspend,
 };
 
+static const USBDesc desc_gamepad = {
+    .id = {
+        .idVendor          = 0x0627,
+        .idProduct         = 0x0001,
+        .bcdDevice         = 0,
+        .iManufacturer     = STR_MANUFACTURER,
+        .iProduct          = STR_PRODUCT_GAMEPAD,
+        .iSerialNumber     = STR_SERIAL_GAMEPAD,
+    },
+    .full = &desc_device_gamepad,
+    .str  = desc_strings,
+    .msos = &desc_msos_suspend,
+};
+
+static const USBDesc desc_gamepad2 = {
+    .id = {
+        .idVendor          = 0x0627,
+        .idProduct         = 0x0001,
+        .bcdDevice         = 0,
+        .iManufacturer     = STR_MANUFACTURER,
+        .iProduct          = STR_PRODUCT_GAMEPAD,
+        .iSerialNumber     = STR_SERIAL_GAMEPAD,
+    },
+    .full = &desc_device_gamepad,
+    .high = &desc_device_gamepad2,
+    .str  = desc_strings,
+    .msos = &desc_msos_suspend,
+};
+
 static const uint8_t qemu_mouse_hid_report_descriptor[] = {
     0x05, 0x01,		/* Usage Page (Generic Desktop) */
     0x09, 0x02,		/* Usage (Mouse) */
@@ -558,6 +687,46 @@ static const uint8_t qemu_keyboard_hid_report_descriptor[] = {
     0xc0,		/* End Collection */
 };
 
+static const uint8_t qemu_gamepad_hid_report_descriptor[] = {
+    0x05, 0x01,		/* Usage Page (Generic Desktop) */
+    0x09, 0x05,		/* Usage (Game Pad) */
+    0xa1, 0x01,		/* Collection (Application) */
+    0x05, 0x09,		/*   Usage Page (Button) */
+    0x19, 0x01,		/*   Usage Minimum (1) */
+    0x29, 0x10,		/*   Usage Maximum (16) */
+    0x15, 0x00,		/*   Logical Minimum (0) */
+    0x25, 0x01,		/*   Logical Maximum (1) */
+    0x95, 0x10,		/*   Report Count (16) */
+    0x75, 0x01,		/*   Report Size (1) */
+    0x81, 0x02,		/*   Input (Data, Variable, Absolute) */
+    0x05, 0x01,		/*   Usage Page (Generic Desktop) */
+    0x09, 0x39,		/*   Usage (Hat switch) */
+    0x15, 0x00,		/*   Logical Minimum (0) */
+    0x25, 0x07,		/*   Logical Maximum (7) */
+    0x35, 0x00,		/*   Physical Minimum (0) */
+    0x46, 0x3b, 0x01,	/*   Physical Maximum (315) */
+    0x65, 0x14,		/*   Unit (Degrees) */
+    0x95, 0x01,		/*   Report Count (1) */
+    0x75, 0x04,		/*   Report Size (4) */
+    0x81, 0x42,		/*   Input (Data, Variable, Absolute, Null State) */
+    0x65, 0x00,		/*   Unit (None) */
+    0x95, 0x01,		/*   Report Count (1) */
+    0x75, 0x04,		/*   Report Size (4) */
+    0x81, 0x01,		/*   Input (Constant) */
+    0x09, 0x30,		/*   Usage (X) */
+    0x09, 0x31,		/*   Usage (Y) */
+    0x09, 0x33,		/*   Usage (Rx) */
+    0x09, 0x34,		/*   Usage (Ry) */
+    0x15, 0x81,		/*   Logical Minimum (-0x7f) */
+    0x25, 0x7f,		/*   Logical Maximum (0x7f) */
+    0x35, 0x00,		/*   Physical Minimum (same as logical) */
+    0x45, 0x00,		/*   Physical Maximum (same as logical) */
+    0x95, 0x04,		/*   Report Count (4) */
+    0x75, 0x08,		/*   Report Size (8) */
+    0x81, 0x02,		/*   Input (Data, Variable, Absolute) */
+    0xc0,		/* End Collection */
+};
+
 static void usb_hid_changed(HIDState *hs)
 {
     USBHIDState *us = container_of(hs, USBHIDState, hid);
@@ -601,6 +770,10 @@ static void usb_hid_handle_control(USBDevice *dev, USBPacket *p,
                 memcpy(data, qemu_keyboard_hid_report_descriptor,
                        sizeof(qemu_keyboard_hid_report_descriptor));
                 p->actual_length = sizeof(qemu_keyboard_hid_report_descriptor);
+            } else if (hs->kind == HID_GAMEPAD) {
+                memcpy(data, qemu_gamepad_hid_report_descriptor,
+                       sizeof(qemu_gamepad_hid_report_descriptor));
+                p->actual_length = sizeof(qemu_gamepad_hid_report_descriptor);
             }
             break;
         default:
@@ -612,6 +785,8 @@ static void usb_hid_handle_control(USBDevice *dev, USBPacket *p,
             p->actual_length = hid_pointer_poll(hs, data, length);
         } else if (hs->kind == HID_KEYBOARD) {
             p->actual_length = hid_keyboard_poll(hs, data, length);
+        } else if (hs->kind == HID_GAMEPAD) {
+            p->actual_length = hid_gamepad_poll(hs, data, length);
         }
         break;
     case HID_SET_REPORT:
@@ -674,7 +849,10 @@ static void usb_hid_handle_data(USBDevice *dev, USBPacket *p)
                 len = hid_pointer_poll(hs, buf, p->iov.size);
             } else if (hs->kind == HID_KEYBOARD) {
                 len = hid_keyboard_poll(hs, buf, p->iov.size);
+            } else if (hs->kind == HID_GAMEPAD) {
+                len = hid_gamepad_poll(hs, buf, p->iov.size);
             }
+            qemu_input_latency_delivered();
             usb_packet_copy(p, buf, len);
         } else {
             goto fail;
@@ -741,6 +919,11 @@ static void usb_keyboard_realize(USBDevice *dev, Error **errp)
     usb_hid_initfn(dev, HID_KEYBOARD, &desc_keyboard, &desc_keyboard2, errp);
 }
 
+static void usb_gamepad_realize(USBDevice *dev, Error **errp)
+{
+    usb_hid_initfn(dev, HID_GAMEPAD, &desc_gamepad, &desc_gamepad2, errp);
+}
+
 static int usb_ptr_post_load(void *opaque, int version_id)
 {
     USBHIDState *s = opaque;
@@ -774,6 +957,17 @@ static const VMStateDescription vmstate_usb_kbd = {
     }
 };
 
+static const VMStateDescription vmstate_usb_gamepad = {
+    .name = "usb-gamepad",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_USB_DEVICE(dev, USBHIDState),
+        VMSTATE_HID_GAMEPAD_DEVICE(hid, USBHIDState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void usb_hid_class_initfn(ObjectClass *klass, void *data)
 {
     USBDeviceClass *uc = USB_DEVICE_CLASS(klass);
@@ -865,6 +1059,31 @@ static const TypeInfo usb_keyboard_info = {
     .class_init    = usb_keyboard_class_initfn,
 };
 
+static Property usb_gamepad_properties[] = {
+        DEFINE_PROP_UINT32("usb_version", USBHIDState, usb_version, 2),
+        DEFINE_PROP_STRING("display", USBHIDState, display),
+        DEFINE_PROP_UINT32("head", USBHIDState, head, 0),
+        DEFINE_PROP_END_OF_LIST(),
+};
+
+static void usb_gamepad_class_initfn(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    USBDeviceClass *uc = USB_DEVICE_CLASS(klass);
+
+    uc->realize        = usb_gamepad_realize;
+    uc->product_desc   = "QEMU USB Gamepad";
+    dc->vmsd = &vmstate_usb_gamepad;
+    device_class_set_props(dc, usb_gamepad_properties);
+    set_bit(DEVICE_CATEGORY_INPUT, dc->categories);
+}
+
+static const TypeInfo usb_gamepad_info = {
+    .name          = "usb-gamepad",
+    .parent        = TYPE_USB_HID,
+    .class_init    = usb_gamepad_class_initfn,
+};
+
 static void usb_hid_register_types(void)
 {
     type_register_static(&usb_hid_type_info);
@@ -874,6 +1093,7 @@ static void usb_hid_register_types(void)
     usb_legacy_register("usb-mouse", "mouse", NULL);
     type_register_static(&usb_keyboard_info);
     usb_legacy_register("usb-kbd", "keyboard", NULL);
+    type_register_static(&usb_gamepad_info);
 }
 
 type_init(usb_hid_register_types)
@@ -49,6 +49,13 @@
 #define QEMU_AIO_BLKDEV       0x2000
 #define QEMU_AIO_NO_FALLBACK  0x4000
 
+/*
+ * Posix file locking bytes. Libvirt takes byte 0, we start from higher bytes,
+ * leaving a few more bytes for its future use.
+ */
+#define RAW_LOCK_PERM_BASE             100
+#define RAW_LOCK_SHARED_BASE           200
+
 
 /* linux-aio.c - Linux native implementation */
 #ifdef CONFIG_LINUX_AIO
@@ -66,14 +73,24 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp);
 void luring_cleanup(LuringState *s);
 
+/* luring_co_submit() flags, each feature is only used where it works */
+#define LURING_FIXED_FILE   0x1 /* use the fd from the ring's file table */
+#define LURING_FIXED_BUF    0x2 /* use buffers from luring_register_buf() */
+
 /* luring_co_submit: submit I/O requests in the thread's current AioContext. */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type);
+                                  QEMUIOVector *qiov, int type, int flags);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
+
+/* Must be called before closing an fd that was used with LURING_FIXED_FILE */
+void luring_unregister_fd(int fd);
+/* Guest memory that LURING_FIXED_BUF requests can use */
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
 #endif
 
 #ifdef _WIN32
@@ -50,6 +50,17 @@ enum ide_dma_cmd {
     IDE_DMA__COUNT
 };
 
+/* One half of the ATAPI read-ahead buffer, see hw/ide/atapi.c */
+typedef struct IDECDReadahead {
+    IDEState *s;
+    uint8_t *buf;
+    int lba;            /* first sector held, -1 if empty */
+    int nb_sectors;
+    uint32_t generation;
+    BlockAIOCB *aiocb;  /* set while the read is in flight */
+    QEMUIOVector qiov;
+} IDECDReadahead;
+
 /* NOTE: IDEState represents in fact one drive */
 struct IDEState {
     IDEBus *bus;
@@ -108,6 +119,12 @@ struct IDEState {
     BlockAIOCB *pio_aiocb;
     QEMUIOVector qiov;
     QLIST_HEAD(, IDEBufferedRequest) buffered_requests;
+    /* ATAPI read-ahead, not migrated */
+    IDECDReadahead cd_ra[2];
+    int cd_ra_sectors;      /* per buffer, 0 if disabled */
+    int cd_ra_next_lba;
+    int cd_ra_run;          /* sectors read sequentially so far */
+    uint32_t cd_ra_generation;
     /* ATA DMA state */
     uint64_t io_buffer_offset;
     int32_t io_buffer_size;
@@ -165,6 +182,7 @@ struct IDEDevice {
      */
     uint16_t rotation_rate;
     bool win2k_install_hack;
+    uint32_t readahead;
 };
 
 typedef struct IDEDrive {
@@ -6,6 +6,7 @@
 #define HID_MOUSE     1
 #define HID_TABLET    2
 #define HID_KEYBOARD  3
+#define HID_GAMEPAD   4
 
 typedef struct HIDPointerEvent {
     int32_t xdx, ydy; /* relative iff it's a mouse, otherwise absolute */
@@ -32,10 +33,19 @@ typedef struct HIDKeyboardState {
     int32_t keys;
 } HIDKeyboardState;
 
+#define HID_GAMEPAD_REPORT_LEN 7
+
+typedef struct HIDGamepadState {
+    uint32_t buttons;
+    int32_t axis[INPUT_PAD_AXIS__MAX];
+    uint8_t report[HID_GAMEPAD_REPORT_LEN]; /* latest report for the guest */
+} HIDGamepadState;
+
 struct HIDState {
     union {
         HIDMouseState ptr;
         HIDKeyboardState kbd;
+        HIDGamepadState pad;
     };
     uint32_t head; /* index into circular queue */
     uint32_t n;
@@ -58,6 +68,7 @@ void hid_pointer_activate(HIDState *hs);
 int hid_pointer_poll(HIDState *hs, uint8_t *buf, int len);
 int hid_keyboard_poll(HIDState *hs, uint8_t *buf, int len);
 int hid_keyboard_write(HIDState *hs, uint8_t *buf, int len);
+int hid_gamepad_poll(HIDState *hs, uint8_t *buf, int len);
 
 extern const VMStateDescription vmstate_hid_keyboard_device;
 
@@ -79,5 +90,14 @@ extern const VMStateDescription vmstate_hid_ptr_device;
     .offset     = vmstate_offset_value(_state, _field, HIDState),    \
 }
 
+extern const VMStateDescription vmstate_hid_gamepad_device;
+
+#define VMSTATE_HID_GAMEPAD_DEVICE(_field, _state) {                 \
+    .name       = (stringify(_field)),                               \
+    .size       = sizeof(HIDState),                                  \
+    .vmsd       = &vmstate_hid_gamepad_device,                       \
+    .flags      = VMS_STRUCT,                                        \
+    .offset     = vmstate_offset_value(_state, _field, HIDState),    \
+}
 
 #endif /* QEMU_HID_H */
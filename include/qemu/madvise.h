@@ -14,6 +14,7 @@
 
 #define QEMU_MADV_WILLNEED  MADV_WILLNEED
 #define QEMU_MADV_DONTNEED  MADV_DONTNEED
+#define QEMU_MADV_RANDOM    MADV_RANDOM
 #ifdef MADV_DONTFORK
 #define QEMU_MADV_DONTFORK  MADV_DONTFORK
 #else
@@ -64,6 +65,7 @@
 
 #define QEMU_MADV_WILLNEED  POSIX_MADV_WILLNEED
 #define QEMU_MADV_DONTNEED  POSIX_MADV_DONTNEED
+#define QEMU_MADV_RANDOM    POSIX_MADV_RANDOM
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
@@ -78,6 +80,7 @@
 
 #define QEMU_MADV_WILLNEED  QEMU_MADV_INVALID
 #define QEMU_MADV_DONTNEED  QEMU_MADV_INVALID
+#define QEMU_MADV_RANDOM    QEMU_MADV_INVALID
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
@@ -130,4 +130,7 @@ const BdrvChild *blk_root(BlockBackend *blk);
 
 int blk_make_empty(BlockBackend *blk, Error **errp);
 
+bool blk_stats_log_start(const char *path, unsigned interval, Error **errp);
+void blk_stats_log_stop(void);
+
 #endif /* BLOCK_BACKEND_GLOBAL_STATE_H */
@@ -9,6 +9,8 @@
 #define INPUT_EVENT_MASK_REL   (1<<INPUT_EVENT_KIND_REL)
 #define INPUT_EVENT_MASK_ABS   (1<<INPUT_EVENT_KIND_ABS)
 #define INPUT_EVENT_MASK_MTT   (1<<INPUT_EVENT_KIND_MTT)
+#define INPUT_EVENT_MASK_PAD   (1<<INPUT_EVENT_KIND_PAD_BTN | \
+                                1<<INPUT_EVENT_KIND_PAD_AXIS)
 
 #define INPUT_EVENT_ABS_MIN    0x0000
 #define INPUT_EVENT_ABS_MAX    0x7FFF
@@ -69,6 +71,29 @@ void qemu_input_queue_mtt(QemuConsole *src, InputMultiTouchType type, int slot,
 void qemu_input_queue_mtt_abs(QemuConsole *src, InputAxis axis, int value,
                               int min_in, int max_in,
                               int slot, int tracking_id);
+void qemu_input_queue_pad_btn(QemuConsole *src, InputPadButton btn, bool down);
+void qemu_input_queue_pad_axis(QemuConsole *src, InputPadAxis axis, int value);
+
+/*
+ * Input-to-display latency accounting.  A UI that wants it calls
+ * qemu_input_latency_begin() after syncing an event and
+ * qemu_input_latency_presented() once a frame reached the screen; the
+ * intermediate stages are marked by the core.
+ */
+typedef enum QemuInputLatencyStage {
+    INPUT_LATENCY_QUEUE,    /* host event -> input core sync */
+    INPUT_LATENCY_DEVICE,   /* sync -> guest device interrupt */
+    INPUT_LATENCY_RENDER,   /* interrupt -> next display update */
+    INPUT_LATENCY_PRESENT,  /* display update -> frame presented */
+    INPUT_LATENCY_TOTAL,
+    INPUT_LATENCY__MAX,
+} QemuInputLatencyStage;
+
+void qemu_input_latency_begin(int64_t event_us);
+void qemu_input_latency_delivered(void);
+void qemu_input_latency_rendered(void);
+void qemu_input_latency_presented(void);
+char *qemu_input_latency_report(void);
 
 void qemu_input_check_mode_change(void);
 void qemu_add_mouse_mode_change_notifier(Notifier *notify);
@@ -30,6 +30,11 @@ case "$platform" in
         if [ "$(uname -m)" = "x86_64" ]; then
             EXTRA_CONFIGURE_ARGS=("--enable-kvm")
         fi
+        # Codecs of CHD images, the defaults of chdman are lzma and flac
+        if command -v apt-get &> /dev/null; then
+            apt-get -y install liblzma-dev libflac-dev libzstd-dev
+            EXTRA_CONFIGURE_ARGS+=("--enable-lzma" "--enable-flac" "--enable-zstd")
+        fi
         ;;
     android-*)
         apt-get -y install ninja-build flex bison libglib2.0-dev
@@ -164,6 +169,7 @@ CFLAGS="-Os -Wno-error -Wno-nested-externs -Wno-redundant-decls" ../configure \
     --disable-modules \
     --disable-plugins \
     --enable-libretro \
+    --enable-chd \
     --audio-drv-list=libretro \
     --disable-sdl \
     -Dwrap_mode=forcefallback \
@@ -49,13 +49,20 @@ void os_setup_early_signal_handling(void)
     sigaction(SIGPIPE, &act, NULL);
 }
 
+#ifndef CONFIG_LIBRETRO
 static void termsig_handler(int signal, siginfo_t *info, void *c)
 {
     qemu_system_killed(info->si_signo, info->si_pid);
 }
+#endif
 
+/*
+ * With libretro, the frontend process hosts the emulator and owns the
+ * termination signals.
+ */
 void os_setup_signal_handling(void)
 {
+#ifndef CONFIG_LIBRETRO
     struct sigaction act;
 
     memset(&act, 0, sizeof(act));
@@ -64,6 +71,7 @@ void os_setup_signal_handling(void)
     sigaction(SIGINT,  &act, NULL);
     sigaction(SIGHUP,  &act, NULL);
     sigaction(SIGTERM, &act, NULL);
+#endif
 }
 
 void os_set_proc_name(const char *s)
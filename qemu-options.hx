@@ -792,6 +792,7 @@ DEF("audiodev", HAS_ARG, QEMU_OPTION_audiodev,
     "                valid values: s8, s16, s32, u8, u16, u32, f32\n"
     "                in|out.voices= number of voices to use\n"
     "                in|out.buffer-length= length of buffer in microseconds\n"
+    "                in|out.resampler= sample rate converter (linear or sinc)\n"
     "-audiodev none,id=id,[,prop[=value][,...]]\n"
     "                dummy driver that discards all output\n"
 #ifdef CONFIG_AUDIO_ALSA
@@ -906,6 +907,12 @@ SRST
     ``in|out.buffer-length=usecs``
         Sets the size of the buffer in microseconds.
 
+    ``in|out.resampler=resampler``
+        Selects how voices whose sample rate differs from the backend
+        are resampled. ``linear`` interpolates between neighbouring
+        samples, ``sinc`` uses a windowed-sinc filter that avoids most
+        aliasing at a higher CPU cost. Default is ``linear``.
+
 ``-audiodev none,id=id[,prop[=value][,...]]``
     Creates a dummy backend that discards all outputs. This backend has
     no backend specific properties.
@@ -1385,6 +1392,17 @@ SRST
             Specifies the AIO backend (threads/native/io_uring,
             default: threads)
 
+        ``io-uring-fixed-files``
+            With ``aio=io_uring``, registers the file descriptor with
+            the io_uring instance of each event loop that accesses it.
+            (on/off, default: off)
+
+        ``io-uring-fixed-buffers``
+            With ``aio=io_uring``, registers guest RAM with io_uring so
+            that requests into it don't have to pin memory each time.
+            Only devices that register guest RAM with the block layer,
+            such as virtio-blk, make use of this. (on/off, default: off)
+
         ``locking``
             Specifies whether the image file is protected with Linux OFD
             / POSIX locks. The default is to use the Linux Open File
@@ -1570,7 +1588,10 @@ SRST
 
     ``snapshot=snapshot``
         snapshot is "on" or "off" and controls snapshot mode for the
-        given drive (see ``-snapshot``).
+        given drive (see ``-snapshot``). Options starting with
+        ``snapshot.`` are passed to the temporary overlay;
+        ``snapshot.driver=ram-overlay`` keeps the written data in
+        memory instead of a temporary qcow2 file.
 
     ``cache=cache``
         cache is "none", "writeback", "unsafe", "directsync" or
@@ -5848,7 +5869,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch,io-uring-sqpoll-idle=io-uring-sqpoll-idle``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5888,6 +5909,15 @@ SRST
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
 
+        The ``io-uring-sqpoll-idle`` parameter makes ``aio=io_uring``
+        block nodes in this IOThread submit requests through a kernel
+        thread that polls the submission queue, instead of with a system
+        call. The kernel thread goes to sleep after that many
+        milliseconds without requests. 0 (the default) disables this.
+        The value is only read when the IOThread first sets up io_uring;
+        if the kernel refuses SQPOLL, a warning is printed and requests
+        are submitted normally.
+
         The IOThread parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
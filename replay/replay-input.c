@@ -23,6 +23,8 @@ void replay_save_input_event(InputEvent *evt)
     InputBtnEvent *btn;
     InputMoveEvent *move;
     InputMultiTouchEvent *mtt;
+    InputPadBtnEvent *pad_btn;
+    InputPadAxisEvent *pad_axis;
     replay_put_dword(evt->type);
 
     switch (evt->type) {
@@ -67,6 +69,16 @@ void replay_save_input_event(InputEvent *evt)
         replay_put_dword(mtt->axis);
         replay_put_qword(mtt->value);
         break;
+    case INPUT_EVENT_KIND_PAD_BTN:
+        pad_btn = evt->u.pad_btn.data;
+        replay_put_dword(pad_btn->button);
+        replay_put_byte(pad_btn->down);
+        break;
+    case INPUT_EVENT_KIND_PAD_AXIS:
+        pad_axis = evt->u.pad_axis.data;
+        replay_put_dword(pad_axis->axis);
+        replay_put_qword(pad_axis->value);
+        break;
     case INPUT_EVENT_KIND__MAX:
         /* keep gcc happy */
         break;
@@ -83,6 +95,8 @@ InputEvent *replay_read_input_event(void)
     InputMoveEvent rel;
     InputMoveEvent abs;
     InputMultiTouchEvent mtt;
+    InputPadBtnEvent pad_btn;
+    InputPadAxisEvent pad_axis;
 
     evt.type = replay_get_dword();
     switch (evt.type) {
@@ -127,6 +141,16 @@ InputEvent *replay_read_input_event(void)
         evt.u.mtt.data->axis = (InputAxis)replay_get_dword();
         evt.u.mtt.data->value = replay_get_qword();
         break;
+    case INPUT_EVENT_KIND_PAD_BTN:
+        evt.u.pad_btn.data = &pad_btn;
+        evt.u.pad_btn.data->button = (InputPadButton)replay_get_dword();
+        evt.u.pad_btn.data->down = replay_get_byte();
+        break;
+    case INPUT_EVENT_KIND_PAD_AXIS:
+        evt.u.pad_axis.data = &pad_axis;
+        evt.u.pad_axis.data->axis = (InputPadAxis)replay_get_dword();
+        evt.u.pad_axis.data->value = replay_get_qword();
+        break;
     case INPUT_EVENT_KIND__MAX:
         /* keep gcc happy */
         break;
@@ -107,6 +107,7 @@ meson_options_help() {
   printf "%s\n" '  canokey         CanoKey support'
   printf "%s\n" '  cap-ng          cap_ng support'
   printf "%s\n" '  capstone        Whether and how to find the capstone library'
+  printf "%s\n" '  chd             chd image format support'
   printf "%s\n" '  cloop           cloop image format support'
   printf "%s\n" '  cocoa           Cocoa user interface (macOS only)'
   printf "%s\n" '  colo-proxy      colo-proxy support'
@@ -118,6 +119,7 @@ meson_options_help() {
   printf "%s\n" '  dmg             dmg image format support'
   printf "%s\n" '  docs            Documentations build support'
   printf "%s\n" '  dsound          DirectSound sound support'
+  printf "%s\n" '  flac            FLAC support for CHD images'
   printf "%s\n" '  fuse            FUSE block device export'
   printf "%s\n" '  fuse-lseek      SEEK_HOLE/SEEK_DATA support for FUSE exports'
   printf "%s\n" '  gcrypt          libgcrypt cryptography support'
@@ -150,6 +152,7 @@ meson_options_help() {
   printf "%s\n" '  linux-aio       Linux AIO support'
   printf "%s\n" '  linux-io-uring  Linux io_uring support'
   printf "%s\n" '  lzfse           lzfse support for DMG images'
+  printf "%s\n" '  lzma            lzma support for CHD images'
   printf "%s\n" '  lzo             lzo compression support'
   printf "%s\n" '  malloc-trim     enable libc malloc_trim() for memory optimization'
   printf "%s\n" '  membarrier      membarrier system call (for Linux 4.14+ or Windows'
@@ -273,6 +276,8 @@ _meson_option_parse() {
     --disable-cfi) printf "%s" -Dcfi=false ;;
     --enable-cfi-debug) printf "%s" -Dcfi_debug=true ;;
     --disable-cfi-debug) printf "%s" -Dcfi_debug=false ;;
+    --enable-chd) printf "%s" -Dchd=enabled ;;
+    --disable-chd) printf "%s" -Dchd=disabled ;;
     --enable-cloop) printf "%s" -Dcloop=enabled ;;
     --disable-cloop) printf "%s" -Dcloop=disabled ;;
     --enable-cocoa) printf "%s" -Dcocoa=enabled ;;
@@ -315,6 +320,8 @@ _meson_option_parse() {
     --enable-fdt) printf "%s" -Dfdt=enabled ;;
     --disable-fdt) printf "%s" -Dfdt=disabled ;;
     --enable-fdt=*) quote_sh "-Dfdt=$2" ;;
+    --enable-flac) printf "%s" -Dflac=enabled ;;
+    --disable-flac) printf "%s" -Dflac=disabled ;;
     --enable-fuse) printf "%s" -Dfuse=enabled ;;
     --disable-fuse) printf "%s" -Dfuse=disabled ;;
     --enable-fuse-lseek) printf "%s" -Dfuse_lseek=enabled ;;
@@ -393,6 +400,8 @@ _meson_option_parse() {
     --localstatedir=*) quote_sh "-Dlocalstatedir=$2" ;;
     --enable-lzfse) printf "%s" -Dlzfse=enabled ;;
     --disable-lzfse) printf "%s" -Dlzfse=disabled ;;
+    --enable-lzma) printf "%s" -Dlzma=enabled ;;
+    --disable-lzma) printf "%s" -Dlzma=disabled ;;
     --enable-lzo) printf "%s" -Dlzo=enabled ;;
     --disable-lzo) printf "%s" -Dlzo=disabled ;;
     --enable-malloc=*) quote_sh "-Dmalloc=$2" ;;
@@ -0,0 +1,75 @@
+/*
+ * QEMU audio resampler speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "audio/mixeng.h"
+
+#define FRAMES 4096
+#define OUT_FRAMES (FRAMES * 3)
+
+typedef struct {
+    int inrate;
+    int outrate;
+    AudioResampler resampler;
+} ResampleBenchParams;
+
+static void test(const void *opaque)
+{
+    const ResampleBenchParams *p = opaque;
+    st_sample *in = g_new0(st_sample, FRAMES);
+    st_sample *out = g_new0(st_sample, OUT_FRAMES);
+    void *rate = st_rate_start(p->inrate, p->outrate, p->resampler);
+    double total = 0.0;
+    size_t i;
+
+    for (i = 0; i < FRAMES; i++) {
+        in[i].l = g_test_rand_int();
+        in[i].r = g_test_rand_int();
+    }
+
+    g_test_timer_start();
+    do {
+        size_t isamp = FRAMES, osamp = OUT_FRAMES;
+
+        st_rate_flow(rate, in, out, &isamp, &osamp);
+        total += osamp;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    /* both channels are processed, report per-channel throughput */
+    g_test_message("%s %5d -> %5d Hz: %8.2f Msamples/sec per channel",
+                   AudioResampler_str(p->resampler), p->inrate, p->outrate,
+                   total / 1e6 / g_test_timer_last());
+
+    st_rate_stop(rate);
+    g_free(out);
+    g_free(in);
+}
+
+int main(int argc, char **argv)
+{
+    static const int rates[][2] = {
+        { 22050, 48000 }, { 44100, 48000 }, { 48000, 44100 },
+    };
+    int i, j;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        for (j = 0; j < AUDIO_RESAMPLER__MAX; j++) {
+            ResampleBenchParams *p = g_new(ResampleBenchParams, 1);
+            g_autofree char *path = NULL;
+
+            p->inrate = rates[i][0];
+            p->outrate = rates[i][1];
+            p->resampler = j;
+            path = g_strdup_printf("/audio/resample/%s/%d-%d",
+                                   AudioResampler_str(j),
+                                   p->inrate, p->outrate);
+            g_test_add_data_func_full(path, p, test, g_free);
+        }
+    }
+    return g_test_run();
+}
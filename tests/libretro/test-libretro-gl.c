@@ -0,0 +1,302 @@
+/*
+ * Headless test of the OpenGL path of the libretro core
+ *
+ * Loads the core the way a frontend does, with a surfaceless EGL context
+ * that Mesa's llvmpipe provides without a GPU or a display server, boots
+ * SeaBIOS with "-display libretro,gl=on" and checks the frames that the
+ * core draws into the frontend's framebuffer.  Guest dma-bufs, which are
+ * handed to the frontend without a copy, need a virgl guest and are not
+ * covered.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <dlfcn.h>
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+#include <libretro.h>
+
+/* Large enough for any mode SeaBIOS and the VGA BIOS set */
+#define FB_SIZE 2048
+/* Height of a text row in the VGA text mode */
+#define TEXT_ROW 16
+#define TIMEOUT_US (60 * G_USEC_PER_SEC)
+
+static const char *core_path;
+static const char *bios_dir;
+static char *tmp_dir;
+
+static struct {
+    void (*set_environment)(retro_environment_t);
+    void (*set_video_refresh)(retro_video_refresh_t);
+    void (*set_audio_sample)(retro_audio_sample_t);
+    void (*set_audio_sample_batch)(retro_audio_sample_batch_t);
+    void (*set_input_poll)(retro_input_poll_t);
+    void (*set_input_state)(retro_input_state_t);
+    void (*init)(void);
+    void (*deinit)(void);
+    bool (*load_game)(const struct retro_game_info *);
+    void (*unload_game)(void);
+    void (*run)(void);
+} core;
+
+static struct retro_hw_render_callback *hw_render;
+static GLuint fb, fb_tex;
+
+static struct {
+    unsigned frames, dupes;
+    unsigned width, height;
+    bool bad_dupe;
+} video;
+
+static uintptr_t get_current_framebuffer(void)
+{
+    return fb;
+}
+
+static retro_proc_address_t get_proc_address(const char *sym)
+{
+    return (retro_proc_address_t)eglGetProcAddress(sym);
+}
+
+static bool environment(unsigned cmd, void *data)
+{
+    switch (cmd) {
+    case RETRO_ENVIRONMENT_SET_HW_RENDER:
+        hw_render = data;
+        if (hw_render->context_type != RETRO_HW_CONTEXT_OPENGL_CORE) {
+            return false;
+        }
+        hw_render->get_current_framebuffer = get_current_framebuffer;
+        hw_render->get_proc_address = get_proc_address;
+        return true;
+    case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
+    case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
+        *(const char **)data = tmp_dir;
+        return true;
+    case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+        *(bool *)data = true;
+        return true;
+    case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
+        return *(enum retro_pixel_format *)data == RETRO_PIXEL_FORMAT_XRGB8888;
+    default:
+        return false;
+    }
+}
+
+static void video_refresh(const void *data, unsigned width, unsigned height,
+                          size_t pitch)
+{
+    if (!data) {
+        /* A dupe repeats the last frame, at its size */
+        video.dupes++;
+        if (width != video.width || height != video.height) {
+            video.bad_dupe = true;
+        }
+        return;
+    }
+    g_assert(data == RETRO_HW_FRAME_BUFFER_VALID);
+    g_assert_cmpuint(width, <=, FB_SIZE);
+    g_assert_cmpuint(height, <=, FB_SIZE);
+    video.frames++;
+    video.width = width;
+    video.height = height;
+}
+
+static void audio_sample(int16_t left, int16_t right)
+{
+}
+
+static size_t audio_sample_batch(const int16_t *data, size_t frames)
+{
+    return frames;
+}
+
+static void input_poll(void)
+{
+}
+
+static int16_t input_state(unsigned port, unsigned device, unsigned index,
+                           unsigned id)
+{
+    return 0;
+}
+
+static void *core_sym(void *handle, const char *name)
+{
+    void *sym = dlsym(handle, name);
+
+    if (!sym) {
+        g_error("%s", dlerror());
+    }
+    return sym;
+}
+
+/* A current GL 3.2 core context without any window system */
+static bool init_egl(void)
+{
+    static const EGLint config_attrs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE,
+    };
+    static const EGLint ctx_attrs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE,
+    };
+    EGLDisplay dpy;
+    EGLConfig config;
+    EGLContext ctx;
+    EGLint n;
+
+    if (!epoxy_has_egl_extension(EGL_NO_DISPLAY,
+                                 "EGL_MESA_platform_surfaceless")) {
+        return false;
+    }
+    dpy = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+                                   EGL_DEFAULT_DISPLAY, NULL);
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL) ||
+        !epoxy_has_egl_extension(dpy, "EGL_KHR_surfaceless_context") ||
+        !eglBindAPI(EGL_OPENGL_API) ||
+        !eglChooseConfig(dpy, config_attrs, &config, 1, &n) || !n) {
+        return false;
+    }
+    ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, ctx_attrs);
+    if (ctx == EGL_NO_CONTEXT) {
+        return false;
+    }
+    return eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
+}
+
+/* Whether any pixel of the framebuffer rows [y, y + h) is lit */
+static bool rows_lit(int y, int h)
+{
+    g_autofree uint8_t *pixels = g_malloc(video.width * h * 4);
+    size_t i;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fb);
+    glReadPixels(0, y, video.width, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    for (i = 0; i < video.width * h * 4; i += 4) {
+        if (pixels[i] || pixels[i + 1] || pixels[i + 2]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_gl_boot(void)
+{
+    g_autofree char *cmd_line_path = NULL;
+    g_autofree char *cmd_line = NULL;
+    struct retro_game_info game = { 0 };
+    gint64 deadline;
+    void *handle;
+
+    if (!init_egl()) {
+        g_test_skip("no surfaceless EGL with OpenGL 3.2");
+        return;
+    }
+
+    glGenTextures(1, &fb_tex);
+    glBindTexture(GL_TEXTURE_2D, fb_tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, FB_SIZE, FB_SIZE, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &fb);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, fb_tex, 0);
+    g_assert_cmphex(glCheckFramebufferStatus(GL_FRAMEBUFFER), ==,
+                    GL_FRAMEBUFFER_COMPLETE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    handle = dlopen(core_path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        g_error("%s", dlerror());
+    }
+    core.set_environment = core_sym(handle, "retro_set_environment");
+    core.set_video_refresh = core_sym(handle, "retro_set_video_refresh");
+    core.set_audio_sample = core_sym(handle, "retro_set_audio_sample");
+    core.set_audio_sample_batch = core_sym(handle,
+                                           "retro_set_audio_sample_batch");
+    core.set_input_poll = core_sym(handle, "retro_set_input_poll");
+    core.set_input_state = core_sym(handle, "retro_set_input_state");
+    core.init = core_sym(handle, "retro_init");
+    core.deinit = core_sym(handle, "retro_deinit");
+    core.load_game = core_sym(handle, "retro_load_game");
+    core.unload_game = core_sym(handle, "retro_unload_game");
+    core.run = core_sym(handle, "retro_run");
+
+    cmd_line_path = g_build_filename(tmp_dir, "gl.qemu_cmd_line", NULL);
+    cmd_line = g_strdup_printf("qemu-system-x86_64 -nodefaults -vga std "
+                               "-display libretro,gl=on -L '%s'", bios_dir);
+    g_assert(g_file_set_contents(cmd_line_path, cmd_line, -1, NULL));
+    game.path = cmd_line_path;
+
+    core.set_environment(environment);
+    core.set_video_refresh(video_refresh);
+    core.set_audio_sample(audio_sample);
+    core.set_audio_sample_batch(audio_sample_batch);
+    core.set_input_poll(input_poll);
+    core.set_input_state(input_state);
+    core.init();
+    g_assert(core.load_game(&game));
+
+    /* The core must have asked for a context, which frontends reset once */
+    g_assert(hw_render);
+    hw_render->context_reset();
+
+    /*
+     * SeaBIOS prints its banner in the first text row, while the last one
+     * stays empty.  The core asks for a bottom-left origin, so the first
+     * text row is at the end of the framebuffer.
+     */
+    deadline = g_get_monotonic_time() + TIMEOUT_US;
+    for (;;) {
+        core.run();
+        if (video.height >= 2 * TEXT_ROW &&
+            rows_lit(video.height - TEXT_ROW, TEXT_ROW)) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+    g_assert(!rows_lit(0, TEXT_ROW));
+
+    /* Nothing changes on a halted screen, so there have to be dupes */
+    while (video.dupes < 10) {
+        core.run();
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+    g_assert(!video.bad_dupe);
+
+    if (hw_render->context_destroy) {
+        hw_render->context_destroy();
+    }
+    core.unload_game();
+    core.deinit();
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    if (argc != 3) {
+        g_printerr("usage: %s CORE BIOS_DIR\n", argv[0]);
+        return 1;
+    }
+    core_path = argv[1];
+    bios_dir = argv[2];
+    tmp_dir = g_dir_make_tmp("qemu-libretro-gl-XXXXXX", NULL);
+    g_assert(tmp_dir);
+
+    g_test_add_func("/libretro/gl/boot", test_gl_boot);
+    ret = g_test_run();
+
+    g_rmdir(tmp_dir);
+    g_free(tmp_dir);
+    return ret;
+}
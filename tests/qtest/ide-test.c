@@ -1081,6 +1081,49 @@ static void test_cdrom_dma(void)
     test_bmdma_teardown(qts);
 }
 
+static void test_cdrom_dma_readahead(void)
+{
+    QTestState *qts;
+    static const int nblocks = 64, chunk = 4;
+    static const size_t len = ATAPI_BLOCK_SIZE * chunk;
+    size_t ret;
+    char *pattern = g_malloc(ATAPI_BLOCK_SIZE * nblocks);
+    char *rx = g_malloc0(len);
+    uintptr_t guest_buf;
+    PrdtEntry prdt[1];
+    FILE *fh;
+    int lba;
+
+    /* Two 4-block read-ahead buffers, so that they are refilled a lot */
+    qts = ide_test_start(
+            "-drive if=none,file=%s,media=cdrom,format=raw,id=sr0,index=0 "
+            "-device ide-cd,drive=sr0,bus=ide.0,readahead=16k", tmp_path[0]);
+    qtest_irq_intercept_in(qts, "ioapic");
+
+    guest_buf = guest_alloc(&guest_malloc, len);
+    prdt[0].addr = cpu_to_le32(guest_buf);
+    prdt[0].size = cpu_to_le32(len | PRDT_EOT);
+
+    generate_pattern(pattern, ATAPI_BLOCK_SIZE * nblocks, ATAPI_BLOCK_SIZE);
+    fh = fopen(tmp_path[0], "wb+");
+    ret = fwrite(pattern, ATAPI_BLOCK_SIZE, nblocks, fh);
+    g_assert_cmpint(ret, ==, nblocks);
+    fclose(fh);
+
+    /* Stream through the whole medium, twice to hit stale buffers */
+    for (lba = 0; lba < 2 * nblocks; lba += chunk) {
+        send_dma_request(qts, CMD_PACKET, lba % nblocks, chunk, prdt, 1,
+                         send_scsi_cdb_read10);
+        qtest_memread(qts, guest_buf, rx, len);
+        g_assert_cmpint(memcmp(pattern + (lba % nblocks) * ATAPI_BLOCK_SIZE,
+                               rx, len), ==, 0);
+    }
+
+    g_free(pattern);
+    g_free(rx);
+    test_bmdma_teardown(qts);
+}
+
 int main(int argc, char **argv)
 {
     const char *base;
@@ -1139,6 +1182,7 @@ int main(int argc, char **argv)
     qtest_add_func("/ide/cdrom/pio", test_cdrom_pio);
     qtest_add_func("/ide/cdrom/pio_large", test_cdrom_pio_large);
     qtest_add_func("/ide/cdrom/dma", test_cdrom_dma);
+    qtest_add_func("/ide/cdrom/dma_readahead", test_cdrom_dma_readahead);
 
     ret = g_test_run();
 
@@ -0,0 +1,88 @@
+/*
+ * Block statistics log tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+
+/* Run the main loop until @path contains @needle, for at most 10 seconds */
+static char *wait_for_log(const char *path, const char *needle)
+{
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 10000;
+    char *contents = NULL;
+
+    for (;;) {
+        g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+        if (strstr(contents, needle)) {
+            return contents;
+        }
+        g_free(contents);
+        g_assert(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) < deadline);
+        main_loop_wait(false);
+    }
+}
+
+static void test_stats_log(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    BlockAcctStats *stats = blk_get_stats(blk);
+    BlockAcctCookie cookie;
+    Error *local_err = NULL;
+    g_autofree char *path = NULL;
+    char *contents;
+    int fd, i;
+
+    fd = g_file_open_tmp("qemu-blk-stats-log-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    monitor_add_blk(blk, "drive0", &error_abort);
+    g_assert(blk_stats_log_start(path, 1, &error_abort));
+
+    /* Only one log at a time */
+    g_assert(!blk_stats_log_start(path, 1, &local_err));
+    error_free_or_abort(&local_err);
+
+    /* Histograms are enabled by the first sample */
+    contents = wait_for_log(path, "drive0: stats");
+    g_free(contents);
+    g_assert_cmpint(stats->latency_histogram[BLOCK_ACCT_READ].nbins, ==, 15);
+
+    for (i = 0; i < 10; i++) {
+        block_acct_start(stats, &cookie, 4096, BLOCK_ACCT_READ);
+        block_acct_done(stats, &cookie);
+    }
+    block_acct_start(stats, &cookie, 4096, BLOCK_ACCT_WRITE);
+    block_acct_failed(stats, &cookie);
+
+    contents = wait_for_log(path, "drive0 write:");
+    g_assert(strstr(contents, "drive0 read: "));
+    g_assert(strstr(contents, "p50 <0.05 ms, p90 <0.05 ms, p99 <0.05 ms"));
+    g_assert(strstr(contents, ", 1 failed\n"));
+    g_free(contents);
+
+    blk_stats_log_stop();
+    monitor_remove_blk(blk);
+    blk_unref(blk);
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/blk-stats-log/log", test_stats_log);
+
+    return g_test_run();
+}
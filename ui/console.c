@@ -812,6 +812,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
         return;
     }
     dpy_gfx_update_texture(con, con->surface, x, y, w, h);
+    qemu_input_latency_rendered();
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != dcl->con) {
             continue;
@@ -1145,6 +1146,7 @@ void dpy_gl_update(QemuConsole *con,
     assert(con->gl);
 
     graphic_hw_gl_block(con, true);
+    qemu_input_latency_rendered();
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != dcl->con) {
             continue;
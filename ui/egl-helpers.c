@@ -482,8 +482,15 @@ static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
                              EGLenum platform,
                              DisplayGLMode mode)
 {
-    static const EGLint conf_att_core[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+#ifdef EGL_MESA_platform_surfaceless
+    /* the surfaceless platform has no window configs */
+    EGLint surface_type = platform == EGL_PLATFORM_SURFACELESS_MESA ?
+        EGL_PBUFFER_BIT : EGL_WINDOW_BIT;
+#else
+    EGLint surface_type = EGL_WINDOW_BIT;
+#endif
+    const EGLint conf_att_core[] = {
+        EGL_SURFACE_TYPE, surface_type,
         EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
         EGL_RED_SIZE,   5,
         EGL_GREEN_SIZE, 5,
@@ -491,8 +498,8 @@ static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
         EGL_ALPHA_SIZE, 0,
         EGL_NONE,
     };
-    static const EGLint conf_att_gles[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    const EGLint conf_att_gles[] = {
+        EGL_SURFACE_TYPE, surface_type,
         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
         EGL_RED_SIZE,   5,
         EGL_GREEN_SIZE, 5,
@@ -557,6 +564,21 @@ int qemu_egl_init_dpy_mesa(EGLNativeDisplayType dpy, DisplayGLMode mode)
     return qemu_egl_init_dpy(dpy, 0, mode);
 #endif
 }
+
+int qemu_egl_init_dpy_surfaceless(DisplayGLMode mode)
+{
+#ifdef EGL_MESA_platform_surfaceless
+    if (!epoxy_has_egl_extension(NULL, "EGL_MESA_platform_surfaceless")) {
+        error_report("egl: EGL_MESA_platform_surfaceless not supported");
+        return -1;
+    }
+    return qemu_egl_init_dpy(EGL_DEFAULT_DISPLAY,
+                             EGL_PLATFORM_SURFACELESS_MESA, mode);
+#else
+    error_report("egl: surfaceless platform not available");
+    return -1;
+#endif
+}
 #endif
 
 
@@ -672,3 +694,38 @@ bool egl_init(const char *rendernode, DisplayGLMode mode, Error **errp)
     display_opengl = 1;
     return true;
 }
+
+/*
+ * Like egl_init(), but without a DRM render node: let Mesa pick the
+ * device itself.  This also works with a pure software driver (llvmpipe),
+ * in which case dma-buf export is typically unavailable and display
+ * code has to read the rendered frames back.
+ */
+bool egl_init_surfaceless(DisplayGLMode mode, Error **errp)
+{
+    if (mode == DISPLAYGL_MODE_OFF) {
+        error_setg(errp, "egl: turning off GL doesn't make sense");
+        return false;
+    }
+
+#if defined(CONFIG_X11) || defined(CONFIG_GBM)
+    if (qemu_egl_init_dpy_surfaceless(mode) < 0) {
+        error_setg(errp, "egl: surfaceless init failed");
+        return false;
+    }
+    if (!epoxy_has_egl_extension(qemu_egl_display,
+                                 "EGL_KHR_surfaceless_context")) {
+        error_setg(errp, "egl: EGL_KHR_surfaceless_context not supported");
+        return false;
+    }
+    qemu_egl_rn_ctx = qemu_egl_init_ctx();
+#endif
+
+    if (!qemu_egl_rn_ctx) {
+        error_setg(errp, "egl: not available on this platform");
+        return false;
+    }
+
+    display_opengl = 1;
+    return true;
+}
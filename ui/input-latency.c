@@ -0,0 +1,150 @@
+/*
+ * Input-to-display latency accounting
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/stats64.h"
+#include "ui/input.h"
+#include "trace.h"
+
+/*
+ * Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, bucket 0
+ * also takes anything below 1 us and the last one everything above.
+ */
+#define INPUT_LATENCY_BUCKETS    21
+
+/* A probe that has not completed by then is dropped */
+#define INPUT_LATENCY_TIMEOUT_US (1000 * 1000)
+
+typedef struct InputLatencyHist {
+    Stat64 count;
+    Stat64 sum_us;
+    Stat64 max_us;
+    Stat64 buckets[INPUT_LATENCY_BUCKETS];
+} InputLatencyHist;
+
+typedef enum InputLatencyState {
+    INPUT_LATENCY_IDLE,
+    INPUT_LATENCY_WAIT_DELIVERY,
+    INPUT_LATENCY_WAIT_RENDER,
+    INPUT_LATENCY_WAIT_PRESENT,
+} InputLatencyState;
+
+static const char *const input_latency_stage_names[INPUT_LATENCY__MAX] = {
+    [INPUT_LATENCY_QUEUE]   = "queue",
+    [INPUT_LATENCY_DEVICE]  = "device",
+    [INPUT_LATENCY_RENDER]  = "render",
+    [INPUT_LATENCY_PRESENT] = "present",
+    [INPUT_LATENCY_TOTAL]   = "total",
+};
+
+static InputLatencyHist input_latency_hist[INPUT_LATENCY__MAX];
+static Stat64 input_latency_dropped;
+
+/* Only one event is followed through the pipeline at a time */
+static struct {
+    InputLatencyState state;
+    int64_t event_us;
+    int64_t sync_us;
+    int64_t delivered_us;
+    int64_t rendered_us;
+} probe;
+
+static void input_latency_account(QemuInputLatencyStage stage, int64_t us)
+{
+    InputLatencyHist *h = &input_latency_hist[stage];
+    uint64_t v = MAX(us, 0);
+    int bucket = v > 1 ? 63 - clz64(v) : 0;
+
+    stat64_add(&h->count, 1);
+    stat64_add(&h->sum_us, v);
+    stat64_max(&h->max_us, v);
+    stat64_add(&h->buckets[MIN(bucket, INPUT_LATENCY_BUCKETS - 1)], 1);
+    trace_input_latency(input_latency_stage_names[stage], v);
+}
+
+void qemu_input_latency_begin(int64_t event_us)
+{
+    int64_t now = g_get_monotonic_time();
+
+    if (probe.state != INPUT_LATENCY_IDLE) {
+        if (now - probe.event_us < INPUT_LATENCY_TIMEOUT_US) {
+            return;
+        }
+        stat64_add(&input_latency_dropped, 1);
+    }
+    probe.event_us = event_us;
+    probe.sync_us = now;
+    probe.state = INPUT_LATENCY_WAIT_DELIVERY;
+}
+
+void qemu_input_latency_delivered(void)
+{
+    if (probe.state == INPUT_LATENCY_WAIT_DELIVERY) {
+        probe.delivered_us = g_get_monotonic_time();
+        probe.state = INPUT_LATENCY_WAIT_RENDER;
+    }
+}
+
+void qemu_input_latency_rendered(void)
+{
+    if (probe.state == INPUT_LATENCY_WAIT_RENDER) {
+        probe.rendered_us = g_get_monotonic_time();
+        probe.state = INPUT_LATENCY_WAIT_PRESENT;
+    }
+}
+
+void qemu_input_latency_presented(void)
+{
+    int64_t now;
+
+    if (probe.state != INPUT_LATENCY_WAIT_PRESENT) {
+        return;
+    }
+    now = g_get_monotonic_time();
+    input_latency_account(INPUT_LATENCY_QUEUE,
+                          probe.sync_us - probe.event_us);
+    input_latency_account(INPUT_LATENCY_DEVICE,
+                          probe.delivered_us - probe.sync_us);
+    input_latency_account(INPUT_LATENCY_RENDER,
+                          probe.rendered_us - probe.delivered_us);
+    input_latency_account(INPUT_LATENCY_PRESENT, now - probe.rendered_us);
+    input_latency_account(INPUT_LATENCY_TOTAL, now - probe.event_us);
+    probe.state = INPUT_LATENCY_IDLE;
+}
+
+char *qemu_input_latency_report(void)
+{
+    GString *buf = g_string_new("input latency (us):\n");
+    int stage, i;
+
+    for (stage = 0; stage < INPUT_LATENCY__MAX; stage++) {
+        InputLatencyHist *h = &input_latency_hist[stage];
+        uint64_t count = stat64_get(&h->count);
+
+        g_string_append_printf(buf, "  %-8s count %" PRIu64,
+                               input_latency_stage_names[stage], count);
+        if (!count) {
+            g_string_append_c(buf, '\n');
+            continue;
+        }
+        g_string_append_printf(buf, ", mean %" PRIu64 ", max %" PRIu64 "\n",
+                               stat64_get(&h->sum_us) / count,
+                               stat64_get(&h->max_us));
+        for (i = 0; i < INPUT_LATENCY_BUCKETS; i++) {
+            uint64_t n = stat64_get(&h->buckets[i]);
+
+            if (n) {
+                g_string_append_printf(buf, "    >= %-8" PRIu64 " %" PRIu64
+                                       "\n", i ? UINT64_C(1) << i : 0, n);
+            }
+        }
+    }
+    g_string_append_printf(buf, "  dropped  %" PRIu64 "\n",
+                           stat64_get(&input_latency_dropped));
+    return g_string_free(buf, false);
+}
@@ -213,6 +213,8 @@ static void qemu_input_event_trace(QemuConsole *src, InputEvent *evt)
     InputBtnEvent *btn;
     InputMoveEvent *move;
     InputMultiTouchEvent *mtt;
+    InputPadBtnEvent *pad_btn;
+    InputPadAxisEvent *pad_axis;
 
     if (src) {
         idx = qemu_console_get_index(src);
@@ -256,6 +258,16 @@ static void qemu_input_event_trace(QemuConsole *src, InputEvent *evt)
         name = InputAxis_str(mtt->axis);
         trace_input_event_mtt(idx, name, mtt->value);
         break;
+    case INPUT_EVENT_KIND_PAD_BTN:
+        pad_btn = evt->u.pad_btn.data;
+        name = InputPadButton_str(pad_btn->button);
+        trace_input_event_pad_btn(idx, name, pad_btn->down);
+        break;
+    case INPUT_EVENT_KIND_PAD_AXIS:
+        pad_axis = evt->u.pad_axis.data;
+        name = InputPadAxis_str(pad_axis->axis);
+        trace_input_event_pad_axis(idx, name, pad_axis->value);
+        break;
     case INPUT_EVENT_KIND__MAX:
         /* keep gcc happy */
         break;
@@ -583,6 +595,34 @@ void qemu_input_queue_mtt_abs(QemuConsole *src, InputAxis axis, int value,
     qemu_input_event_send(src, &evt);
 }
 
+void qemu_input_queue_pad_btn(QemuConsole *src, InputPadButton btn, bool down)
+{
+    InputPadBtnEvent pad_btn = {
+        .button = btn,
+        .down = down,
+    };
+    InputEvent evt = {
+        .type = INPUT_EVENT_KIND_PAD_BTN,
+        .u.pad_btn.data = &pad_btn,
+    };
+
+    qemu_input_event_send(src, &evt);
+}
+
+void qemu_input_queue_pad_axis(QemuConsole *src, InputPadAxis axis, int value)
+{
+    InputPadAxisEvent pad_axis = {
+        .axis = axis,
+        .value = value,
+    };
+    InputEvent evt = {
+        .type = INPUT_EVENT_KIND_PAD_AXIS,
+        .u.pad_axis.data = &pad_axis,
+    };
+
+    qemu_input_event_send(src, &evt);
+}
+
 void qemu_add_mouse_mode_change_notifier(Notifier *notify)
 {
     notifier_list_add(&mouse_mode_notifiers, notify);
@@ -0,0 +1,27 @@
+// Runs the VM of the libretro core in its own process: loads the core given
+// as the first argument and hands over to it. See remote_spawn() in
+// ui/libretro.c for the other arguments.
+
+#include <dlfcn.h>
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s CORE ...\n", argv[0]);
+		return 1;
+	}
+
+	void *core = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+	if (!core) {
+		fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+		return 1;
+	}
+	int (*remote_main)(int argc, char **argv) =
+		(int (*)(int, char **))dlsym(core, "retro_qemu_remote_main");
+	if (!remote_main) {
+		fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+		return 1;
+	}
+	return remote_main(argc, argv);
+}
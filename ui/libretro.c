@@ -2,23 +2,44 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sched.h>
 #include <glib/gstdio.h>
 
 #include "retro-gen.h"
 #include "qemu/datadir.h"
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "qemu/module.h"
 #include "qemu/main-loop.h"
 #include "qemu/error-report.h"
 #include "qemu-main.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/runstate.h"
+#include "sysemu/block-backend.h"
 #include "ui/console.h"
 #include "ui/kbd-state.h"
 #include "audio/audio.h"
 #include "audio/audio_int.h"
+#include "qapi/error.h"
+#ifdef CONFIG_LINUX
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#endif
+#ifdef CONFIG_TRACE_SIMPLE
+#include "trace/simple.h"
+#endif
+#ifdef CONFIG_OPENGL
+#include "ui/egl-helpers.h"
+#include "ui/egl-context.h"
+#include "ui/dmabuf.h"
+#endif
 
 #define QEMU_CMD_PREFIX "qemu-system-"
 #define DEFAULT_ARCH "x86_64"
@@ -27,29 +48,109 @@
 		"libretro,id=snd0", "-machine", "pcspk-audiodev=snd0",         \
 		"-device", "AC97,audiodev=snd0"
 
+// Frame rate reported to the frontend until it tells us its real frame time
+#define DEFAULT_FPS 60
+
 void rcu_init(void);
 
 static const char *game_path;
 static const char *system_dir;
+static const char *save_dir;
 static const char *target_arch;
 static pthread_t emu_thread;
 static DisplaySurface *surface;
 static QKbdState *kbd;
+static DisplayChangeListener dcl;
 static bool exited = false;
 
 static HWVoiceOut *hw_voice_out = NULL;
 static pthread_mutex_t hw_voice_out_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Input
-#define KEY_EVENT_QUEUE_LEN 32
-struct key_event {
-	bool down;
-	QKeyCode key;
+// In pull mode, each frame's audio is mixed right before the frame is handed
+// to the main thread, and retro_run passes exactly one frame's worth of
+// samples to the frontend. Otherwise QEMU's audio timer fills the buffer and
+// the frontend drains it from its audio callback.
+static bool audio_pull = true;
+static size_t audio_pull_frames; // Frames to hand over in this retro_run
+static size_t audio_pull_left; // Frames the voice may still produce
+static double audio_pull_frac;
+
+// Input, queued by whichever thread the frontend reports it on and
+// delivered by the emu thread as soon as it runs
+enum input_event_type {
+	INPUT_EVENT_KEY,
+	INPUT_EVENT_BTN,
+	INPUT_EVENT_REL,
+	INPUT_EVENT_ABS,
+	INPUT_EVENT_PAD_BTN,
+	INPUT_EVENT_PAD_AXIS,
+};
+struct input_event {
+	QSLIST_ENTRY(input_event) next;
+	int64_t time_usec; // Host monotonic time the frontend reported it at
+	enum input_event_type type;
+	union {
+		struct {
+			QKeyCode key;
+			bool down;
+		} key;
+		struct {
+			InputButton button;
+			bool down;
+		} btn;
+		struct {
+			int dx, dy;
+		} rel;
+		struct {
+			int x, y; // -0x7fff to 0x7fff, as the frontend reports it
+		} abs;
+		struct {
+			InputPadButton button;
+			bool down;
+		} pad_btn;
+		struct {
+			InputPadAxis axis;
+			int value;
+		} pad_axis;
+	};
 };
-static struct key_event key_event_queue[KEY_EVENT_QUEUE_LEN];
-static size_t num_pending_keys = 0;
-static int mouse_dx, mouse_dy;
+static QSLIST_HEAD(, input_event) input_queue =
+	QSLIST_HEAD_INITIALIZER(input_queue);
+static QEMUBH *input_bh;
 static bool buttons_down[INPUT_BUTTON__MAX];
+// The RetroPad on port 0 drives a usb-gamepad in the guest, unless the user
+// picked the keyboard-only device type for that port
+static bool pad_enabled = true;
+static bool pad_buttons_down[INPUT_PAD_BUTTON__MAX];
+static int pad_axes[INPUT_PAD_AXIS__MAX];
+// Follow key and button presses to the frame that shows them, see
+// qemu_input_latency_begin()
+static bool latency_stats;
+// Log the I/O statistics of every drive, see blk_stats_log_start()
+static bool block_stats;
+#define BLOCK_STATS_INTERVAL 10 // seconds
+// Record every block request with the block_acct_io trace event
+static bool block_trace;
+// Read .iso files through the file-mmap driver instead of the file driver
+static bool iso_mmap;
+// Where absolute pointer positions come from. Relative motion is always
+// queued too, and the emu thread delivers whichever the guest can take.
+enum pointer_source {
+	POINTER_SOURCE_POINTER,
+	POINTER_SOURCE_LIGHTGUN,
+	POINTER_SOURCE_NONE,
+};
+static enum pointer_source pointer_source = POINTER_SOURCE_POINTER;
+static int pointer_x = INT_MIN, pointer_y = INT_MIN;
+// Set once the position has moved, frontends without the device report 0
+static bool pointer_active = false;
+
+#ifdef CONFIG_LINUX
+// The VM's pid when it runs in a child process, see remote_spawn()
+static pid_t remote_pid;
+static void remote_queue_key(bool down, unsigned keycode, uint32_t character,
+			     uint16_t key_modifiers);
+#endif
 
 // Synchronization
 static bool emu_waiting = false;
@@ -59,6 +160,59 @@ static pthread_cond_t main_cv = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t emu_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t main_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Frame pacing
+static retro_usec_t frame_time_usec = 1000000 / DEFAULT_FPS;
+static int64_t last_run_end_usec;
+static uint64_t refresh_interval_ms = 1000 / DEFAULT_FPS;
+static uint64_t active_refresh_interval_ms;
+static bool can_dupe = false;
+static bool frame_dirty = true;
+// Size of the last frame handed to the frontend, which a dupe repeats
+static int frame_width, frame_height;
+
+// Fixed output resolution, with the guest surface scaled in the core so that
+// guest mode switches don't make the frontend reinitialize its video driver
+static int output_width, output_height; // 0 to follow the guest
+static bool output_smooth = true;
+static int guest_width, guest_height;
+static bool changed_geometry = false;
+static pixman_region32_t dirty_region;
+static pixman_image_t *scaled_image;
+static pixman_image_t *scale_src;
+static DisplaySurface *scale_src_surface;
+static pixman_fixed_t *scale_kernel;
+static int scale_kernel_len;
+
+#ifdef CONFIG_OPENGL
+// GL scanout (virtio-gpu-gl/virgl), rendered by QEMU on the emu thread
+static EGLDisplay emu_egl_display = EGL_NO_DISPLAY;
+static EGLContext emu_egl_ctx = EGL_NO_CONTEXT;
+static bool gl_scanout_active = false;
+static egl_fb guest_fb = EGL_FB_INIT;
+static egl_fb blit_fb = EGL_FB_INIT;
+static bool guest_fb_y_0_top;
+// Read back target used when the scanout can't be shared with the frontend
+static DisplaySurface *gl_surface;
+// dma-buf export of the scanout, imported into the frontend's context
+static struct {
+	int fd;
+	int width, height;
+	int stride, fourcc;
+	uint64_t modifier;
+	bool y_0_top;
+	bool changed;
+} gl_dmabuf = { .fd = -1 };
+static bool dmabuf_import_failed = false;
+// Guest dma-buf in gl_dmabuf, imported here only if the frontend can't
+static QemuDmaBuf *gl_guest_dmabuf;
+
+// Frontend-owned HW rendering context, only touched on the main thread
+static bool hw_render_enabled = false;
+static struct retro_hw_render_callback hw_render;
+static GLuint hw_tex, hw_read_fb;
+static int hw_tex_width, hw_tex_height;
+#endif
+
 static const QKeyCode key_map[RETROK_LAST] = {
 #define KEY(q, r) [RETROK_##r] = Q_KEY_CODE_##q
 	KEY(SHIFT, LSHIFT),
@@ -253,6 +407,7 @@ static void emu_thread_exit(void)
 
 void retro_init(void)
 {
+	pixman_region32_init(&dirty_region);
 }
 
 void retro_deinit(void)
@@ -268,7 +423,7 @@ void retro_get_system_info(struct retro_system_info *info)
 {
 	memset(info, 0, sizeof(*info));
 	info->need_fullpath = true;
-	info->valid_extensions = "qemu_cmd_line|iso|img|qcow|qcow2";
+	info->valid_extensions = "qemu_cmd_line|iso|chd|img|qcow|qcow2";
 	info->library_version = "0.1.0";
 	info->library_name = "qemu";
 }
@@ -284,7 +439,7 @@ static struct retro_system_av_info av_info = {
 		.aspect_ratio = 0.0,
 	},
 	.timing = {
-		.fps = 0.0,
+		.fps = DEFAULT_FPS,
 		.sample_rate = 0.0,
 	},
 };
@@ -294,13 +449,35 @@ void retro_get_system_av_info(struct retro_system_av_info *info)
 	*info = av_info;
 }
 
+static struct input_event *new_input_event(enum input_event_type type)
+{
+	struct input_event *ev = g_new0(struct input_event, 1);
+
+	ev->time_usec = g_get_monotonic_time();
+	ev->type = type;
+	return ev;
+}
+
+// Lock-free, so it's safe from any frontend thread
+static void queue_input_event(struct input_event *ev)
+{
+	QSLIST_INSERT_HEAD_ATOMIC(&input_queue, ev, next);
+
+	QEMUBH *bh = qatomic_read(&input_bh);
+	if (bh && !exited) {
+		CALL_QEMU_FUNC(qemu_bh_schedule, bh);
+	}
+}
+
 static void keyboard_event(bool down, unsigned keycode, uint32_t character,
 			   uint16_t key_modifiers)
 {
-	g_assert(num_pending_keys <= KEY_EVENT_QUEUE_LEN);
-	if (num_pending_keys == KEY_EVENT_QUEUE_LEN) {
+#ifdef CONFIG_LINUX
+	if (remote_pid) {
+		remote_queue_key(down, keycode, character, key_modifiers);
 		return;
 	}
+#endif
 	if (keycode >= RETROK_LAST) {
 		return;
 	}
@@ -308,10 +485,127 @@ static void keyboard_event(bool down, unsigned keycode, uint32_t character,
 	if (!qc) {
 		return;
 	}
-	key_event_queue[num_pending_keys++] = (struct key_event){
-		.down = down,
-		.key = qc,
-	};
+
+	struct input_event *ev = new_input_event(INPUT_EVENT_KEY);
+	ev->key.key = qc;
+	ev->key.down = down;
+	queue_input_event(ev);
+}
+
+static void flush_motion(int *dx, int *dy)
+{
+	if (!*dx && !*dy) {
+		return;
+	}
+	CALL_QEMU_FUNC(qemu_input_queue_rel, dcl.con, INPUT_AXIS_X, *dx);
+	CALL_QEMU_FUNC(qemu_input_queue_rel, dcl.con, INPUT_AXIS_Y, *dy);
+	CALL_QEMU_FUNC(qemu_input_event_sync);
+	*dx = *dy = 0;
+}
+
+static void flush_position(int *x, int *y)
+{
+	if (*x == INT_MIN) {
+		return;
+	}
+	CALL_QEMU_FUNC(qemu_input_queue_abs, dcl.con, INPUT_AXIS_X, *x,
+		       -0x7fff, 0x7fff);
+	CALL_QEMU_FUNC(qemu_input_queue_abs, dcl.con, INPUT_AXIS_Y, *y,
+		       -0x7fff, 0x7fff);
+	CALL_QEMU_FUNC(qemu_input_event_sync);
+	*x = *y = INT_MIN;
+}
+
+// Deliver queued input in the order it arrived. Runs on the emu thread.
+static void drain_input(void)
+{
+	QSLIST_HEAD(, input_event) events, ordered = { NULL };
+	struct input_event *ev;
+	int dx = 0, dy = 0;
+	int x = INT_MIN, y = INT_MIN;
+	bool pending = false;
+	int64_t first_usec = 0;
+
+	QSLIST_MOVE_ATOMIC(&events, &input_queue);
+	if (QSLIST_EMPTY(&events)) {
+		return;
+	}
+
+	// The queue is LIFO
+	while ((ev = QSLIST_FIRST(&events))) {
+		QSLIST_REMOVE_HEAD(&events, next);
+		QSLIST_INSERT_HEAD(&ordered, ev, next);
+	}
+
+	// Prefer absolute positions whenever the guest has a device that takes
+	// them (usb-tablet, virtio-tablet), which avoids PS/2 mouse emulation
+	bool absolute = pointer_active &&
+			CALL_QEMU_FUNC(qemu_input_is_absolute, dcl.con);
+
+	while ((ev = QSLIST_FIRST(&ordered))) {
+		QSLIST_REMOVE_HEAD(&ordered, next);
+
+		switch (ev->type) {
+		case INPUT_EVENT_REL:
+			// Merge motion, but only up to the next key or button
+			// event, so clicks land where the pointer was then
+			if (!absolute) {
+				dx += ev->rel.dx;
+				dy += ev->rel.dy;
+			}
+			break;
+		case INPUT_EVENT_ABS:
+			if (absolute) {
+				x = ev->abs.x;
+				y = ev->abs.y;
+			}
+			break;
+		case INPUT_EVENT_BTN:
+			flush_motion(&dx, &dy);
+			flush_position(&x, &y);
+			CALL_QEMU_FUNC(qemu_input_queue_btn, dcl.con,
+				       ev->btn.button, ev->btn.down);
+			pending = true;
+			break;
+		case INPUT_EVENT_KEY:
+			flush_motion(&dx, &dy);
+			flush_position(&x, &y);
+			CALL_QEMU_FUNC(qkbd_state_key_event, kbd, ev->key.key,
+				       ev->key.down);
+			pending = true;
+			break;
+		case INPUT_EVENT_PAD_BTN:
+			// Goes to its own device, so the pointer needn't be
+			// flushed first
+			CALL_QEMU_FUNC(qemu_input_queue_pad_btn, dcl.con,
+				       ev->pad_btn.button, ev->pad_btn.down);
+			pending = true;
+			break;
+		case INPUT_EVENT_PAD_AXIS:
+			CALL_QEMU_FUNC(qemu_input_queue_pad_axis, dcl.con,
+				       ev->pad_axis.axis, ev->pad_axis.value);
+			pending = true;
+			break;
+		}
+		if (pending && !first_usec) {
+			first_usec = ev->time_usec;
+		}
+		g_free(ev);
+	}
+
+	flush_motion(&dx, &dy);
+	flush_position(&x, &y);
+	if (pending) {
+		CALL_QEMU_FUNC(qemu_input_event_sync);
+		if (latency_stats) {
+			CALL_QEMU_FUNC(qemu_input_latency_begin, first_usec);
+		}
+	}
+}
+
+static void input_bh_cb(void *opaque)
+{
+	drain_input();
 }
 
 static retro_audio_sample_t cb_audio_sample;
@@ -328,33 +622,63 @@ void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb)
 	cb_audio_sample_batch = cb;
 }
 
-static void audio_callback(void)
+// Called with hw_voice_out_mutex held. Returns the number of frames written.
+static size_t drain_audio(size_t max_frames)
 {
-	pthread_mutex_lock(&hw_voice_out_mutex);
+	size_t frames = 0;
 
 	if (!hw_voice_out) {
-		goto out;
+		return 0;
 	}
 
-	while (hw_voice_out->pending_emul) {
+	while (hw_voice_out->pending_emul && frames < max_frames) {
 		size_t start = audio_ring_posb(hw_voice_out->pos_emul,
 					       hw_voice_out->pending_emul,
 					       hw_voice_out->size_emul);
 		g_assert(start < hw_voice_out->size_emul);
 		size_t write_len = MIN(hw_voice_out->pending_emul,
 				       hw_voice_out->size_emul - start);
+		write_len = MIN(write_len, (max_frames - frames) * 4);
 
 		size_t written = cb_audio_sample_batch(
 			hw_voice_out->buf_emul + start, write_len / 4);
 		g_assert(hw_voice_out->pending_emul >= written * 4);
 		hw_voice_out->pending_emul -= written * 4;
 		g_assert(write_len == written * 4);
+		frames += written;
 	}
 
-out:
+	return frames;
+}
+
+static void audio_callback(void)
+{
+	pthread_mutex_lock(&hw_voice_out_mutex);
+	drain_audio(SIZE_MAX);
 	pthread_mutex_unlock(&hw_voice_out_mutex);
 }
 
+// Hand the frame's audio to the frontend, padding with silence if the guest
+// didn't produce enough so that every frame has the same number of samples
+static void present_audio_frame(void)
+{
+	static const int16_t silence[2 * 256];
+
+	pthread_mutex_lock(&hw_voice_out_mutex);
+	size_t frames = drain_audio(audio_pull_frames);
+	pthread_mutex_unlock(&hw_voice_out_mutex);
+
+	while (frames < audio_pull_frames) {
+		size_t written = cb_audio_sample_batch(
+			silence, MIN(audio_pull_frames - frames,
+				     G_N_ELEMENTS(silence) / 2));
+		if (!written) {
+			break;
+		}
+		frames += written;
+	}
+}
+
 static retro_environment_t cb_env;
 
 void retro_set_environment(retro_environment_t cb)
@@ -369,19 +693,17 @@ void retro_set_environment(retro_environment_t cb)
 	   (struct retro_controller_info[]){
 		   {
 			   .types = (struct retro_controller_description[]){ {
+				   .desc = "Gamepad",
+				   .id = RETRO_DEVICE_ANALOG,
+			   }, {
 				   .desc = "Keyboard",
 				   .id = RETRO_DEVICE_KEYBOARD,
 			   } },
-			   .num_types = 1,
+			   .num_types = 2,
 		   },
 		   { 0 } });
 	cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir);
-
-	cb(RETRO_ENVIRONMENT_SET_AUDIO_CALLBACK,
-	   &(struct retro_audio_callback){
-		   .callback = audio_callback,
-		   .set_state = NULL,
-	   });
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void *)core_options);
 }
 
 static retro_video_refresh_t cb_video_refresh;
@@ -407,10 +729,23 @@ void retro_set_input_state(retro_input_state_t cb)
 
 void retro_set_controller_port_device(unsigned port, unsigned device)
 {
+	if (port != 0) {
+		return;
+	}
+
+	unsigned base = device & RETRO_DEVICE_MASK;
+	pad_enabled = base == RETRO_DEVICE_JOYPAD ||
+		      base == RETRO_DEVICE_ANALOG;
 }
 
 void retro_reset(void)
 {
+#ifdef CONFIG_LINUX
+	if (remote_pid) {
+		remote->reset = true;
+		return;
+	}
+#endif
 	if (!exited) {
 		CALL_QEMU_FUNC(qemu_system_reset_request,
 			       SHUTDOWN_CAUSE_HOST_UI);
@@ -435,11 +770,17 @@ static int audio_init_out(HWVoiceOut *hw, struct audsettings *as,
 	pthread_mutex_lock(&av_info_lock);
 	av_info.timing.sample_rate = as->freq;
 	changed_av_info = true;
+	double fps = av_info.timing.fps;
 	pthread_mutex_unlock(&av_info_lock);
 
 	CALL_QEMU_FUNC(audio_pcm_init_info, &hw->info, as);
 
 	hw->samples = 1024;
+	if (audio_pull) {
+		// The mixer is run from refresh instead of the audio timer
+		hw->poll_mode = 1;
+		hw->samples = MAX(hw->samples, 2 * (int)ceil(as->freq / fps));
+	}
 
 	pthread_mutex_lock(&hw_voice_out_mutex);
 	g_assert(!hw_voice_out);
@@ -473,6 +814,10 @@ static size_t audio_buffer_get_free(HWVoiceOut *hw)
 {
 	pthread_mutex_lock(&hw_voice_out_mutex);
 	size_t ret = CALL_QEMU_FUNC(audio_generic_buffer_get_free, hw);
+	if (audio_pull) {
+		// Only ask the card for what the frontend wants this frame
+		ret = MIN(ret, audio_pull_left * hw->info.bytes_per_frame);
+	}
 	pthread_mutex_unlock(&hw_voice_out_mutex);
 	return ret;
 }
@@ -481,6 +826,10 @@ static void *audio_get_buffer_out(HWVoiceOut *hw, size_t *size)
 {
 	pthread_mutex_lock(&hw_voice_out_mutex);
 	void *ret = CALL_QEMU_FUNC(audio_generic_get_buffer_out, hw, size);
+	if (audio_pull) {
+		// Anything mixed beyond that stays in the mix buffer
+		*size = MIN(*size, audio_pull_left * hw->info.bytes_per_frame);
+	}
 	pthread_mutex_unlock(&hw_voice_out_mutex);
 	return ret;
 }
@@ -490,28 +839,101 @@ static size_t audio_put_buffer_out(HWVoiceOut *hw, void *buf, size_t size)
 	pthread_mutex_lock(&hw_voice_out_mutex);
 	size_t ret =
 		CALL_QEMU_FUNC(audio_generic_put_buffer_out, hw, buf, size);
+	if (audio_pull) {
+		audio_pull_left -= ret / hw->info.bytes_per_frame;
+	}
 	pthread_mutex_unlock(&hw_voice_out_mutex);
 	return ret;
 }
 
-static void gfx_update(DisplayChangeListener *dcl, int x, int y, int w, int h)
+// Mix exactly the number of frames the frontend consumes per video frame.
+// The card's callbacks are asked for that much data and nothing more.
+static void run_audio_frame(void)
 {
+	pthread_mutex_lock(&av_info_lock);
+	double frames = av_info.timing.sample_rate / av_info.timing.fps;
+	pthread_mutex_unlock(&av_info_lock);
+
+	audio_pull_frac += frames;
+	audio_pull_frames = (size_t)audio_pull_frac;
+	audio_pull_frac -= audio_pull_frames;
+
+	pthread_mutex_lock(&hw_voice_out_mutex);
+	HWVoiceOut *hw = hw_voice_out;
+	audio_pull_left = audio_pull_frames;
+	pthread_mutex_unlock(&hw_voice_out_mutex);
+
+	if (hw) {
+		CALL_QEMU_FUNC(audio_run, hw->s, "libretro");
+	}
 }
 
-static void gfx_switch(DisplayChangeListener *dcl, DisplaySurface *new_surface)
+// Called with av_info_lock held
+static void apply_geometry(void)
 {
-	int w = surface_width(new_surface);
-	int h = surface_height(new_surface);
-	bool changed_resolution = !surface || !(surface_width(surface) == w &&
-						surface_height(surface) == h);
-	if (changed_resolution) {
-		pthread_mutex_lock(&av_info_lock);
-		av_info.geometry.base_width = av_info.geometry.max_width = w;
-		av_info.geometry.base_height = av_info.geometry.max_height = h;
+	if (output_width) {
+		// Only the aspect ratio changes, which is cheap for the frontend
+		av_info.geometry.base_width = av_info.geometry.max_width =
+			output_width;
+		av_info.geometry.base_height = av_info.geometry.max_height =
+			output_height;
+		av_info.geometry.aspect_ratio =
+			guest_height ? (float)guest_width / guest_height : 0.0;
+		changed_geometry = true;
+	} else {
+		av_info.geometry.base_width = av_info.geometry.max_width =
+			guest_width;
+		av_info.geometry.base_height = av_info.geometry.max_height =
+			guest_height;
+		av_info.geometry.aspect_ratio = 0.0;
 		changed_av_info = true;
-		pthread_mutex_unlock(&av_info_lock);
 	}
+}
+
+static void update_geometry(int w, int h)
+{
+	pthread_mutex_lock(&av_info_lock);
+	if (guest_width != w || guest_height != h) {
+		guest_width = w;
+		guest_height = h;
+		apply_geometry();
+	}
+	pthread_mutex_unlock(&av_info_lock);
+}
+
+static void mark_dirty(int x, int y, int w, int h)
+{
+	frame_dirty = true;
+	pixman_region32_union_rect(&dirty_region, &dirty_region, x, y, w, h);
+}
+
+static void gfx_update(DisplayChangeListener *dcl, int x, int y, int w, int h)
+{
+	mark_dirty(x, y, w, h);
+}
+
+// scale_src wraps the pixels of a surface, forget it before the surface is
+// freed. A new surface may well be allocated at the same address.
+static void drop_scale_src(DisplaySurface *old)
+{
+	if (scale_src && scale_src_surface == old) {
+		pixman_image_unref(scale_src);
+		scale_src = NULL;
+		scale_src_surface = NULL;
+	}
+}
+
+static void gfx_switch(DisplayChangeListener *dcl, DisplaySurface *new_surface)
+{
+	drop_scale_src(surface);
 	surface = new_surface;
+#ifdef CONFIG_OPENGL
+	if (gl_scanout_active) {
+		return;
+	}
+#endif
+	update_geometry(surface_width(surface), surface_height(surface));
+	frame_dirty = true;
 }
 
 static bool gfx_check_format(DisplayChangeListener *dcl,
@@ -520,30 +942,177 @@ static bool gfx_check_format(DisplayChangeListener *dcl,
 	return format == PIXMAN_x8r8g8b8;
 }
 
+#ifdef CONFIG_OPENGL
+static void gl_dmabuf_close(void)
+{
+	if (gl_dmabuf.fd >= 0) {
+		close(gl_dmabuf.fd);
+		gl_dmabuf.fd = -1;
+	}
+	gl_dmabuf.changed = true;
+}
+
+static void gl_setup_readback(int w, int h)
+{
+	if (blit_fb.width != w || blit_fb.height != h) {
+		CALL_QEMU_FUNC(egl_fb_destroy, &blit_fb);
+		CALL_QEMU_FUNC(egl_fb_setup_new_tex, &blit_fb, w, h);
+	}
+	if (!gl_surface || surface_width(gl_surface) != w ||
+	    surface_height(gl_surface) != h) {
+		if (gl_surface) {
+			drop_scale_src(gl_surface);
+			CALL_QEMU_FUNC(qemu_free_displaysurface, gl_surface);
+		}
+		gl_surface = CALL_QEMU_FUNC(qemu_create_displaysurface, w, h);
+	}
+}
+
+static void gl_scanout_disable(DisplayChangeListener *dcl)
+{
+	gl_scanout_active = false;
+	gl_guest_dmabuf = NULL;
+	gl_dmabuf_close();
+	CALL_QEMU_FUNC(egl_fb_destroy, &guest_fb);
+	CALL_QEMU_FUNC(egl_fb_destroy, &blit_fb);
+	if (surface) {
+		update_geometry(surface_width(surface), surface_height(surface));
+	}
+	frame_dirty = true;
+}
+
+static void gl_scanout_texture(DisplayChangeListener *dcl, uint32_t backing_id,
+			       bool backing_y_0_top, uint32_t backing_width,
+			       uint32_t backing_height, uint32_t x, uint32_t y,
+			       uint32_t w, uint32_t h, void *d3d_tex2d)
+{
+	gl_scanout_active = true;
+	gl_guest_dmabuf = NULL;
+	guest_fb_y_0_top = backing_y_0_top;
+	CALL_QEMU_FUNC(egl_fb_setup_for_tex, &guest_fb, backing_width,
+		       backing_height, backing_id, false);
+	update_geometry(backing_width, backing_height);
+
+	gl_dmabuf_close();
+#ifdef CONFIG_GBM
+	// Hand the texture to the frontend without a copy if we can
+	if (hw_render_enabled && !dmabuf_import_failed) {
+		EGLint stride, fourcc;
+		EGLuint64KHR modifier;
+
+		gl_dmabuf.fd = CALL_QEMU_FUNC(egl_get_fd_for_texture,
+					      backing_id, &stride, &fourcc,
+					      &modifier);
+		gl_dmabuf.width = backing_width;
+		gl_dmabuf.height = backing_height;
+		gl_dmabuf.stride = stride;
+		gl_dmabuf.fourcc = fourcc;
+		gl_dmabuf.modifier = modifier;
+		gl_dmabuf.y_0_top = backing_y_0_top;
+	}
+#endif
+	if (gl_dmabuf.fd < 0) {
+		gl_setup_readback(backing_width, backing_height);
+	}
+}
+
+#ifdef CONFIG_GBM
+static void gl_scanout_dmabuf(DisplayChangeListener *dcl, QemuDmaBuf *dmabuf)
+{
+	uint32_t width = CALL_QEMU_FUNC(qemu_dmabuf_get_width, dmabuf);
+	uint32_t height = CALL_QEMU_FUNC(qemu_dmabuf_get_height, dmabuf);
+
+	// Give the guest's buffer to the frontend as is, rather than importing
+	// it into a texture here only to export that again
+	if (hw_render_enabled && !dmabuf_import_failed) {
+		gl_dmabuf_close();
+		gl_dmabuf.fd = CALL_QEMU_FUNC(qemu_dmabuf_dup_fd, dmabuf);
+		if (gl_dmabuf.fd >= 0) {
+			gl_scanout_active = true;
+			gl_guest_dmabuf = dmabuf;
+			gl_dmabuf.width = width;
+			gl_dmabuf.height = height;
+			gl_dmabuf.stride =
+				CALL_QEMU_FUNC(qemu_dmabuf_get_stride, dmabuf);
+			gl_dmabuf.fourcc =
+				CALL_QEMU_FUNC(qemu_dmabuf_get_fourcc, dmabuf);
+			gl_dmabuf.modifier =
+				CALL_QEMU_FUNC(qemu_dmabuf_get_modifier, dmabuf);
+			gl_dmabuf.y_0_top =
+				CALL_QEMU_FUNC(qemu_dmabuf_get_y0_top, dmabuf);
+			update_geometry(width, height);
+			return;
+		}
+	}
+
+	CALL_QEMU_FUNC(egl_dmabuf_import_texture, dmabuf);
+	uint32_t texture = CALL_QEMU_FUNC(qemu_dmabuf_get_texture, dmabuf);
+	if (!texture) {
+		return;
+	}
+	gl_scanout_texture(dcl, texture, false, width, height, 0, 0, width,
+			   height, NULL);
+}
+
+static void gl_release_dmabuf(DisplayChangeListener *dcl, QemuDmaBuf *dmabuf)
+{
+	if (gl_guest_dmabuf == dmabuf) {
+		gl_guest_dmabuf = NULL;
+	}
+	CALL_QEMU_FUNC(egl_dmabuf_release_texture, dmabuf);
+}
+#endif
+
+static void gl_update(DisplayChangeListener *dcl, uint32_t x, uint32_t y,
+		      uint32_t w, uint32_t h)
+{
+	if (!gl_scanout_active) {
+		return;
+	}
+
+	if (gl_dmabuf.fd >= 0 && dmabuf_import_failed) {
+		// The frontend can't import it, fall back to reading back
+		gl_dmabuf_close();
+		if (gl_guest_dmabuf) {
+			gl_scanout_dmabuf(dcl, gl_guest_dmabuf);
+		} else {
+			gl_setup_readback(guest_fb.width, guest_fb.height);
+		}
+	}
+
+	if (gl_dmabuf.fd >= 0) {
+		// The frontend samples the buffer from another context
+		glFinish();
+		mark_dirty(0, 0, gl_dmabuf.width, gl_dmabuf.height);
+	} else {
+		CALL_QEMU_FUNC(egl_fb_blit, &blit_fb, &guest_fb,
+			       guest_fb_y_0_top);
+		CALL_QEMU_FUNC(egl_fb_read, gl_surface, &blit_fb);
+		mark_dirty(0, 0, guest_fb.width, guest_fb.height);
+	}
+}
+#endif
+
 static void refresh(DisplayChangeListener *dcl)
 {
 	CALL_QEMU_FUNC(graphic_hw_update, dcl->con);
 
-	switch_to_main_thread();
-
-	// Flush keyboard event queue
-	for (size_t i = 0; i < num_pending_keys; i++) {
-		CALL_QEMU_FUNC(qkbd_state_key_event, kbd,
-			       key_event_queue[i].key, key_event_queue[i].down);
+	if (audio_pull) {
+		run_audio_frame();
 	}
-	num_pending_keys = 0;
 
-	// Update mouse
-	CALL_QEMU_FUNC(qemu_input_queue_rel, dcl->con, INPUT_AXIS_X, mouse_dx);
-	CALL_QEMU_FUNC(qemu_input_queue_rel, dcl->con, INPUT_AXIS_Y, mouse_dy);
+	switch_to_main_thread();
 
-	// Update buttons
-	for (size_t i = 0; i < INPUT_BUTTON__MAX; i++) {
-		CALL_QEMU_FUNC(qemu_input_queue_btn, dcl->con, i,
-			       buttons_down[i]);
+	// Run the guest for as long as the frontend leaves us before its next
+	// frame is due
+	if (refresh_interval_ms != active_refresh_interval_ms) {
+		active_refresh_interval_ms = refresh_interval_ms;
+		CALL_QEMU_FUNC(update_displaychangelistener, dcl,
+			       active_refresh_interval_ms);
 	}
 
-	CALL_QEMU_FUNC(qemu_input_event_sync);
+	// Input polled by retro_run is delivered before the guest runs again
+	drain_input();
 }
 
 static DisplayChangeListener dcl = {
@@ -553,18 +1122,118 @@ static DisplayChangeListener dcl = {
 		.dpy_gfx_switch = gfx_switch,
 		.dpy_gfx_check_format = gfx_check_format,
 		.dpy_refresh = refresh,
+#ifdef CONFIG_OPENGL
+		.dpy_gl_scanout_disable = gl_scanout_disable,
+		.dpy_gl_scanout_texture = gl_scanout_texture,
+#ifdef CONFIG_GBM
+		.dpy_gl_scanout_dmabuf = gl_scanout_dmabuf,
+		.dpy_gl_release_dmabuf = gl_release_dmabuf,
+#endif
+		.dpy_gl_update = gl_update,
+#endif
+	} },
+};
+
+#ifdef CONFIG_OPENGL
+static QEMUGLContext gl_ctx_create(DisplayGLCtx *dgc, QEMUGLParams *params)
+{
+	// New contexts share objects with the one egl_init_surfaceless made
+	eglMakeCurrent(emu_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       emu_egl_ctx);
+	return CALL_QEMU_FUNC(qemu_egl_create_context, dgc, params);
+}
+
+static void gl_ctx_destroy(DisplayGLCtx *dgc, QEMUGLContext ctx)
+{
+	CALL_QEMU_FUNC(qemu_egl_destroy_context, dgc, ctx);
+}
+
+static int gl_ctx_make_current(DisplayGLCtx *dgc, QEMUGLContext ctx)
+{
+	return CALL_QEMU_FUNC(qemu_egl_make_context_current, dgc, ctx);
+}
+
+static bool gl_ctx_is_compatible_dcl(DisplayGLCtx *dgc,
+				     DisplayChangeListener *listener)
+{
+	return !listener->ops->dpy_gl_update || listener == &dcl;
+}
+
+static DisplayGLCtx gl_ctx = {
+	.ops = (DisplayGLCtxOps[]){ {
+		.dpy_gl_ctx_is_compatible_dcl = gl_ctx_is_compatible_dcl,
+		.dpy_gl_ctx_create = gl_ctx_create,
+		.dpy_gl_ctx_destroy = gl_ctx_destroy,
+		.dpy_gl_ctx_make_current = gl_ctx_make_current,
 	} },
 };
+#endif
+
+// Where the core writes logs: the frontend's save directory, or else next to
+// the content, which is the emu thread's working directory
+static char *save_file_path(const char *name)
+{
+	return save_dir ? g_build_filename(save_dir, name, NULL) :
+			  g_strdup(name);
+}
+
+static void display_early_init(DisplayOptions *opts)
+{
+#ifdef CONFIG_OPENGL
+	Error *err = NULL;
+
+	if (!opts->has_gl || opts->gl == DISPLAYGL_MODE_OFF) {
+		return;
+	}
+	if (!CALL_QEMU_FUNC(egl_init_surfaceless, opts->gl, &err)) {
+		early_error_report("%s",
+				   CALL_QEMU_FUNC(error_get_pretty, err));
+		return;
+	}
+	emu_egl_display = eglGetCurrentDisplay();
+	emu_egl_ctx = eglGetCurrentContext();
+#endif
+}
 
 static void display_init(DisplayState *ds, DisplayOptions *o)
 {
 	dcl.con = CALL_QEMU_FUNC(qemu_console_lookup_by_index, 0);
 	kbd = CALL_QEMU_FUNC(qkbd_state_init, dcl.con);
+	qatomic_set(&input_bh, CALL_QEMU_FUNC(qemu_bh_new_full, input_bh_cb,
+					      NULL, "libretro-input", NULL));
+	active_refresh_interval_ms = refresh_interval_ms;
+	dcl.update_interval = active_refresh_interval_ms;
+#ifdef CONFIG_OPENGL
+	if (emu_egl_ctx != EGL_NO_CONTEXT) {
+		CALL_QEMU_FUNC(qemu_console_set_display_gl_ctx, dcl.con,
+			       &gl_ctx);
+	}
+#endif
 	CALL_QEMU_FUNC(register_displaychangelistener, &dcl);
+
+	// The drives and their devices have been created by now
+	if (block_stats) {
+		char *path = save_file_path("qemu-block-stats.log");
+		Error *err = NULL;
+
+		if (!CALL_QEMU_FUNC(blk_stats_log_start, path,
+				    BLOCK_STATS_INTERVAL, &err)) {
+			CALL_QEMU_FUNC(warn_report_err, err);
+		}
+		g_free(path);
+	}
+
+	// Let guests that honor UI info (e.g. virtio-gpu) match the frontend
+	if (CALL_QEMU_FUNC(dpy_ui_info_supported, dcl.con)) {
+		QemuUIInfo info = *CALL_QEMU_FUNC(dpy_get_ui_info, dcl.con);
+		info.refresh_rate = 1000000000 / frame_time_usec; // mHz
+		CALL_QEMU_FUNC(dpy_set_ui_info, dcl.con, &info, false);
+	}
 }
 
 static QemuDisplay display = {
 	.type = DISPLAY_TYPE_LIBRETRO,
+	.early_init = display_early_init,
 	.init = display_init,
 };
 
@@ -645,13 +1314,19 @@ static void early_error_report(const char *fmt, ...)
 	va_end(ap);
 }
 
-static void start_qemu_with_args(const char *argv[])
+// Doubles the commas in a path, so it can be used as an option value of
+// -drive or -trace
+static char *escape_option_commas(const char *path)
 {
-	int argc = 0;
-	while (argv[argc]) {
-		argc++;
-	}
+	char **parts = g_strsplit(path, ",", -1);
+	char *escaped = g_strjoinv(",,", parts);
+
+	g_strfreev(parts);
+	return escaped;
+}
 
+static void start_qemu_with_args(const char *argv[])
+{
 	if (!system_dir) {
 		early_error_report("failed finding libretro system directory");
 		return;
@@ -659,11 +1334,47 @@ static void start_qemu_with_args(const char *argv[])
 	CALL_QEMU_FUNC(qemu_add_data_dir,
 		       g_build_filename(system_dir, "qemu", NULL));
 
+	GPtrArray *args = g_ptr_array_new();
+	for (int i = 0; argv[i]; i++) {
+		g_ptr_array_add(args, g_strdup(argv[i]));
+	}
+
+	if (block_trace) {
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_LOG)
+		// Binary with the simple backend, text with the log backend
+		char *path = save_file_path("qemu-block-trace");
+		char *file = escape_option_commas(path);
+
+		g_ptr_array_add(args, g_strdup("-trace"));
+		g_ptr_array_add(args, g_strdup_printf(
+			"enable=block_acct_io,file=%s", file));
+		// Names the drive behind the stats pointer of block_acct_io
+		g_ptr_array_add(args, g_strdup("-trace"));
+		g_ptr_array_add(args, g_strdup("blk_acct_name"));
+		g_free(file);
+		g_free(path);
+#else
+		fprintf(stderr, "qemu: block I/O trace needs the simple or "
+				"log trace backend\n");
+#endif
+	}
+
+	// qemu_init() keeps pointers into argv
+	int argc = args->len;
+	g_ptr_array_add(args, NULL);
+
 	CALL_QEMU_FUNC(register_module_init, register_libretro,
 		       MODULE_INIT_QOM);
 	CALL_QEMU_FUNC(rcu_init);
-	CALL_QEMU_FUNC(qemu_init, argc, (char **)argv);
+	CALL_QEMU_FUNC(qemu_init, argc, (char **)args->pdata);
 	CALL_QEMU_FUNC(qemu_default_main);
+	CALL_QEMU_FUNC(blk_stats_log_stop);
+#ifdef CONFIG_TRACE_SIMPLE
+	// The trace would only be flushed at exit(), which a core never calls
+	if (block_trace) {
+		CALL_QEMU_FUNC(st_flush_trace_buffer);
+	}
+#endif
 
 	emu_thread_exit();
 }
@@ -691,9 +1402,55 @@ void retro_cheat_set(unsigned index, bool enabled, const char *code)
 {
 }
 
+// Whether a CHD image holds a CD-ROM rather than a hard disk, going by the
+// track metadata that only CD-ROM images have. This has to agree with
+// chd_find_cd_track() in block/chd.c, which only supports v5 images and
+// the CHTR and CHT2 track tags.
+static bool chd_is_cdrom(const char *path)
+{
+	FILE *f = g_fopen(path, "rb");
+	uint8_t buf[56];
+	bool ret = false;
+
+	if (!f) {
+		return false;
+	}
+	// Magic, header length, version, and then the offset of the first
+	// metadata entry at 48
+	if (fread(buf, sizeof(buf), 1, f) != 1 ||
+	    memcmp(buf, "MComprHD", 8) || ldl_be_p(buf + 8) != 124 ||
+	    ldl_be_p(buf + 12) != 5) {
+		goto out;
+	}
+	uint64_t offset = ldq_be_p(buf + 48);
+	for (int i = 0; offset && i < 4096; i++) {
+		if (fseeko(f, offset, SEEK_SET) || fread(buf, 16, 1, f) != 1) {
+			break;
+		}
+		if (!memcmp(buf, "CHT2", 4) || !memcmp(buf, "CHTR", 4)) {
+			ret = true;
+			break;
+		}
+		offset = ldq_be_p(buf + 8);
+	}
+
+out:
+	fclose(f);
+	return ret;
+}
+
 static void *emu_thread_fn(void *arg)
 {
 	char *game_dir = g_path_get_dirname(game_path);
+#ifdef CONFIG_LINUX
+	// Give the VM's threads a working directory of their own, so that it
+	// doesn't move the frontend's. Without it, fall back to changing the
+	// process-wide one.
+	if (unshare(CLONE_FS) < 0) {
+		perror("qemu: unshare(CLONE_FS), changing the working "
+		       "directory of the whole process");
+	}
+#endif
 	g_chdir(game_dir);
 	g_free(game_dir);
 
@@ -731,8 +1488,39 @@ static void *emu_thread_fn(void *arg)
 		start_qemu_with_args((const char **)argv);
 	} else if (g_str_has_suffix(game_path, ".iso")) {
 		target_arch = DEFAULT_ARCH;
-		start_qemu_with_args((const char *[]){ QEMU_CMD, "-cdrom",
-						       game_path, NULL });
+		// Same as -cdrom. With file-mmap, cached data is copied straight
+		// out of a mapping of the ISO instead of going through the
+		// thread pool, but the whole image has to fit into the address
+		// space, which DVD images don't on 32-bit hosts.
+		char *file = escape_option_commas(game_path);
+		char *drive = g_strdup_printf(
+			"file=%s%s,index=2,media=cdrom",
+			iso_mmap ? "file-mmap:" : "", file);
+
+		start_qemu_with_args((const char *[]){
+			QEMU_CMD, "-drive", drive, NULL });
+		g_free(drive);
+		g_free(file);
+	} else if (g_str_has_suffix(game_path, ".chd")) {
+		target_arch = DEFAULT_ARCH;
+		// CHD images are read-only, so hard disks get a temporary
+		// overlay for the guest to write to. It is thrown away at exit,
+		// so keep it in memory rather than on the frontend's storage.
+		if (chd_is_cdrom(game_path)) {
+			start_qemu_with_args((const char *[]){
+				QEMU_CMD, "-cdrom", game_path, NULL });
+		} else {
+			char *file = escape_option_commas(game_path);
+			char *drive = g_strdup_printf(
+				"file=%s,media=disk,snapshot=on,"
+				"snapshot.driver=ram-overlay",
+				file);
+
+			start_qemu_with_args((const char *[]){
+				QEMU_CMD, "-drive", drive, NULL });
+			g_free(drive);
+			g_free(file);
+		}
 	} else {
 		target_arch = DEFAULT_ARCH;
 		start_qemu_with_args(
@@ -741,61 +1529,1200 @@ static void *emu_thread_fn(void *arg)
 	return NULL;
 }
 
-bool retro_load_game(const struct retro_game_info *game)
+#ifdef CONFIG_OPENGL
+// Whether the command line asks for "-display libretro,gl=...". This has to
+// be known before the emu thread parses it, since the frontend only sets up
+// HW rendering from retro_load_game.
+static bool cmd_line_wants_gl(const char *path)
 {
-	if (!game) {
-		return false;
+	char *cmd_line = NULL;
+	char **argv = NULL;
+	bool ret = false;
+
+	if (!g_str_has_suffix(path, ".qemu_cmd_line") ||
+	    !g_file_get_contents(path, &cmd_line, NULL, NULL) ||
+	    !g_shell_parse_argv(cmd_line, NULL, &argv, NULL)) {
+		goto out;
+	}
+	for (size_t i = 0; argv[i] && argv[i + 1]; i++) {
+		if (!strcmp(argv[i], "-display") &&
+		    g_str_has_prefix(argv[i + 1], "libretro") &&
+		    strstr(argv[i + 1], ",gl=") &&
+		    !strstr(argv[i + 1], ",gl=off")) {
+			ret = true;
+		}
 	}
 
-	game_path = game->path;
-	pthread_create(&emu_thread, NULL, emu_thread_fn, NULL);
-	return true;
+out:
+	g_strfreev(argv);
+	g_free(cmd_line);
+	return ret;
 }
 
-bool retro_load_game_special(unsigned game_type,
-			     const struct retro_game_info *info,
-			     size_t num_info)
+static void hw_context_reset(void)
 {
-	return false;
+	glGenTextures(1, &hw_tex);
+	glBindTexture(GL_TEXTURE_2D, hw_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glGenFramebuffers(1, &hw_read_fb);
+	hw_tex_width = hw_tex_height = 0;
+	// Re-import the current scanout into the new context
+	gl_dmabuf.changed = true;
+	frame_dirty = true;
 }
 
-void retro_unload_game(void)
+static void hw_context_destroy(void)
 {
-	if (!exited) {
-		// Request shutdown
-		CALL_QEMU_FUNC(qemu_system_shutdown_request,
-			       SHUTDOWN_CAUSE_HOST_UI);
-	}
-	join_emu_thread();
+	glDeleteFramebuffers(1, &hw_read_fb);
+	glDeleteTextures(1, &hw_tex);
+	hw_read_fb = hw_tex = 0;
 }
 
-unsigned retro_get_region(void)
+static bool hw_import_dmabuf(void)
 {
-	return RETRO_REGION_NTSC;
+	EGLDisplay dpy = eglGetCurrentDisplay();
+	EGLint attrs[32];
+	int i = 0;
+
+	// Only possible if the frontend itself renders through EGL
+	if (dpy == EGL_NO_DISPLAY ||
+	    !epoxy_has_egl_extension(dpy, "EGL_EXT_image_dma_buf_import")) {
+		return false;
+	}
+
+	attrs[i++] = EGL_WIDTH;
+	attrs[i++] = gl_dmabuf.width;
+	attrs[i++] = EGL_HEIGHT;
+	attrs[i++] = gl_dmabuf.height;
+	attrs[i++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attrs[i++] = gl_dmabuf.fourcc;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_FD_EXT;
+	attrs[i++] = gl_dmabuf.fd;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
+	attrs[i++] = gl_dmabuf.stride;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+	attrs[i++] = 0;
+#ifdef EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT
+	if (gl_dmabuf.modifier) {
+		attrs[i++] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+		attrs[i++] = (gl_dmabuf.modifier >> 0) & 0xffffffff;
+		attrs[i++] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+		attrs[i++] = (gl_dmabuf.modifier >> 32) & 0xffffffff;
+	}
+#endif
+	attrs[i++] = EGL_NONE;
+
+	EGLImageKHR image = eglCreateImageKHR(dpy, EGL_NO_CONTEXT,
+					      EGL_LINUX_DMA_BUF_EXT, NULL,
+					      attrs);
+	if (image == EGL_NO_IMAGE_KHR) {
+		return false;
+	}
+
+	// The texture keeps the buffer alive after the image is gone
+	glBindTexture(GL_TEXTURE_2D, hw_tex);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)image);
+	eglDestroyImageKHR(dpy, image);
+	// Storage is no longer ours, reallocate before the next upload
+	hw_tex_width = hw_tex_height = 0;
+	return true;
 }
 
-void *retro_get_memory_data(unsigned id)
+static void hw_upload_surface(DisplaySurface *src)
 {
-	return NULL;
+	int w = surface_width(src);
+	int h = surface_height(src);
+
+	glBindTexture(GL_TEXTURE_2D, hw_tex);
+	if (hw_tex_width != w || hw_tex_height != h) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_BGRA,
+			     GL_UNSIGNED_BYTE, NULL);
+		hw_tex_width = w;
+		hw_tex_height = h;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, surface_stride(src) / 4);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_BGRA,
+			GL_UNSIGNED_BYTE, surface_data(src));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
 
-size_t retro_get_memory_size(unsigned id)
+// Draw the current frame into the frontend's framebuffer
+static void hw_render_present(void)
+{
+	int w, h;
+	bool top_down = true;
+
+	if (gl_scanout_active && gl_dmabuf.fd >= 0) {
+		if (gl_dmabuf.changed) {
+			gl_dmabuf.changed = false;
+			if (!hw_import_dmabuf()) {
+				// gl_update switches to reading back
+				dmabuf_import_failed = true;
+				cb_video_refresh(NULL, frame_width,
+						 frame_height, 0);
+				return;
+			}
+		}
+		w = gl_dmabuf.width;
+		h = gl_dmabuf.height;
+		top_down = gl_dmabuf.y_0_top;
+	} else {
+		DisplaySurface *src = gl_scanout_active ? gl_surface : surface;
+		hw_upload_surface(src);
+		w = surface_width(src);
+		h = surface_height(src);
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, hw_read_fb);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, hw_tex, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER,
+			  hw_render.get_current_framebuffer());
+	// The frontend wants the bottom row first
+	glBlitFramebuffer(0, 0, w, h, 0, top_down ? h : 0, w, top_down ? 0 : h,
+			  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	cb_video_refresh(RETRO_HW_FRAME_BUFFER_VALID, w, h, 0);
+	frame_width = w;
+	frame_height = h;
+}
+#endif
+
+static void set_output_resolution(int w, int h)
+{
+	if (output_width == w && output_height == h) {
+		return;
+	}
+	output_width = w;
+	output_height = h;
+	if (scaled_image) {
+		pixman_image_unref(scaled_image);
+		scaled_image = NULL;
+	}
+	// The last frame can't be duped at the new size
+	frame_dirty = true;
+
+	pthread_mutex_lock(&av_info_lock);
+	apply_geometry();
+	// The frame size itself changed, a geometry update isn't enough
+	changed_av_info = true;
+	pthread_mutex_unlock(&av_info_lock);
+}
+
+// Prepare the source image and its filter for scaling src to the output size.
+// The separable convolution kernel only depends on the scale factors, so it is
+// only rebuilt when the guest or the output resolution changes.
+static void setup_scale_src(DisplaySurface *src)
+{
+	int w = surface_width(src);
+	int h = surface_height(src);
+	double scale_x = (double)w / output_width;
+	double scale_y = (double)h / output_height;
+	pixman_transform_t transform;
+
+	if (scale_src) {
+		pixman_image_unref(scale_src);
+	}
+	scale_src = pixman_image_create_bits(surface_format(src), w, h,
+					     (uint32_t *)surface_data(src),
+					     surface_stride(src));
+	scale_src_surface = src;
+
+	pixman_transform_init_scale(&transform, pixman_double_to_fixed(scale_x),
+				    pixman_double_to_fixed(scale_y));
+	pixman_image_set_transform(scale_src, &transform);
+	pixman_image_set_repeat(scale_src, PIXMAN_REPEAT_PAD);
+
+	if (!output_smooth) {
+		pixman_image_set_filter(scale_src, PIXMAN_FILTER_NEAREST, NULL,
+					0);
+		return;
+	}
+
+	static double kernel_scale_x, kernel_scale_y;
+	if (!scale_kernel || kernel_scale_x != scale_x ||
+	    kernel_scale_y != scale_y) {
+		free(scale_kernel);
+		// Interpolate when magnifying, average when minifying
+		scale_kernel = pixman_filter_create_separable_convolution(
+			&scale_kernel_len, pixman_double_to_fixed(scale_x),
+			pixman_double_to_fixed(scale_y), PIXMAN_KERNEL_LINEAR,
+			PIXMAN_KERNEL_LINEAR,
+			scale_x > 1 ? PIXMAN_KERNEL_BOX : PIXMAN_KERNEL_IMPULSE,
+			scale_y > 1 ? PIXMAN_KERNEL_BOX : PIXMAN_KERNEL_IMPULSE,
+			4, 4);
+		kernel_scale_x = scale_x;
+		kernel_scale_y = scale_y;
+	}
+	pixman_image_set_filter(scale_src, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+				scale_kernel, scale_kernel_len);
+}
+
+// Scale the parts of src that changed since the last frame into scaled_image
+static void scale_output(DisplaySurface *src)
+{
+	int w = surface_width(src);
+	int h = surface_height(src);
+
+	if (!scaled_image) {
+		scaled_image = pixman_image_create_bits(
+			PIXMAN_x8r8g8b8, output_width, output_height, NULL, 0);
+		scale_src_surface = NULL;
+	}
+	if (src != scale_src_surface || !scale_src ||
+	    pixman_image_get_width(scale_src) != w ||
+	    pixman_image_get_height(scale_src) != h) {
+		setup_scale_src(src);
+		pixman_region32_reset(&dirty_region,
+				      &(pixman_box32_t){ 0, 0, w, h });
+	}
+
+	// Filter taps reach into neighbouring output pixels
+	double scale_x = (double)output_width / w;
+	double scale_y = (double)output_height / h;
+	int margin_x = (int)ceil(scale_x) + 1;
+	int margin_y = (int)ceil(scale_y) + 1;
+	int n;
+	pixman_box32_t *boxes = pixman_region32_rectangles(&dirty_region, &n);
+
+	for (int i = 0; i < n; i++) {
+		int x1 = MAX(0, (int)floor(boxes[i].x1 * scale_x) - margin_x);
+		int y1 = MAX(0, (int)floor(boxes[i].y1 * scale_y) - margin_y);
+		int x2 = MIN(output_width,
+			     (int)ceil(boxes[i].x2 * scale_x) + margin_x);
+		int y2 = MIN(output_height,
+			     (int)ceil(boxes[i].y2 * scale_y) + margin_y);
+		if (x1 >= x2 || y1 >= y2) {
+			continue;
+		}
+		pixman_image_composite32(PIXMAN_OP_SRC, scale_src, NULL,
+					 scaled_image, x1, y1, 0, 0, x1, y1,
+					 x2 - x1, y2 - y1);
+	}
+}
+
+static const struct retro_variable core_options[] = {
+	{ "qemu_output_resolution",
+	  "Output resolution; guest|640x480|800x600|1024x768|1280x720|"
+	  "1280x960|1280x1024|1600x1200|1920x1080" },
+	{ "qemu_output_filter", "Output scaling filter; smooth|nearest" },
+	{ "qemu_audio_timing", "Audio timing (restart); frontend|timer" },
+	{ "qemu_pointer_input", "Absolute pointer input; pointer|lightgun|off" },
+	{ "qemu_latency_stats", "Input latency statistics; off|on" },
+	{ "qemu_vm_process", "VM process (restart); frontend|child" },
+	{ "qemu_block_stats", "Block I/O statistics log (restart); off|on" },
+	{ "qemu_block_trace", "Block I/O request trace (restart); off|on" },
+	{ "qemu_iso_mmap", "Memory-mapped ISO images (restart); off|on" },
+	{ NULL, NULL },
+};
+
+static const char *get_core_option(const char *key)
+{
+	struct retro_variable var = { .key = key };
+
+	if (!cb_env(RETRO_ENVIRONMENT_GET_VARIABLE, &var)) {
+		return NULL;
+	}
+	return var.value;
+}
+
+static void read_core_options(void)
+{
+	const char *value;
+	int w = 0, h = 0;
+
+	value = get_core_option("qemu_output_resolution");
+	if (value && sscanf(value, "%dx%d", &w, &h) != 2) {
+		w = h = 0;
+	}
+#ifdef CONFIG_OPENGL
+	// The GPU scales HW rendered frames for free
+	if (hw_render_enabled) {
+		w = h = 0;
+	}
+#endif
+
+	value = get_core_option("qemu_output_filter");
+	bool smooth = !value || strcmp(value, "nearest");
+	if (smooth != output_smooth) {
+		output_smooth = smooth;
+		scale_src_surface = NULL;
+	}
+
+	set_output_resolution(w, h);
+
+	value = get_core_option("qemu_pointer_input");
+	if (value && !strcmp(value, "lightgun")) {
+		pointer_source = POINTER_SOURCE_LIGHTGUN;
+	} else if (value && !strcmp(value, "off")) {
+		pointer_source = POINTER_SOURCE_NONE;
+	} else {
+		pointer_source = POINTER_SOURCE_POINTER;
+	}
+
+	value = get_core_option("qemu_latency_stats");
+	latency_stats = value && !strcmp(value, "on");
+}
+
+static void frame_time_callback(retro_usec_t usec)
+{
+	// The frontend passes the reference time while fast-forwarding or
+	// paused, and 0 on the first frame
+	if (usec > 0) {
+		frame_time_usec = usec;
+	}
+}
+
+// Starts the emu thread, in the frontend's process or in the child
+static void start_vm(const char *path)
+{
+#ifdef CONFIG_OPENGL
+	if (cmd_line_wants_gl(path)) {
+		hw_render = (struct retro_hw_render_callback){
+			.context_type = RETRO_HW_CONTEXT_OPENGL_CORE,
+			.version_major = 3,
+			.version_minor = 2,
+			.context_reset = hw_context_reset,
+			.context_destroy = hw_context_destroy,
+			.bottom_left_origin = true,
+		};
+		hw_render_enabled =
+			cb_env(RETRO_ENVIRONMENT_SET_HW_RENDER, &hw_render);
+	}
+#endif
+
+	read_core_options();
+
+	const char *value = get_core_option("qemu_block_stats");
+	block_stats = value && !strcmp(value, "on");
+	value = get_core_option("qemu_block_trace");
+	block_trace = value && !strcmp(value, "on");
+	value = get_core_option("qemu_iso_mmap");
+	iso_mmap = value && !strcmp(value, "on");
+
+	const char *audio_timing = get_core_option("qemu_audio_timing");
+	if (audio_timing && !strcmp(audio_timing, "timer")) {
+		// Fall back to pull mode if there's no audio callback
+		audio_pull = !cb_env(RETRO_ENVIRONMENT_SET_AUDIO_CALLBACK,
+				     &(struct retro_audio_callback){
+					     .callback = audio_callback,
+					     .set_state = NULL,
+				     });
+	}
+
+	game_path = path;
+	pthread_create(&emu_thread, NULL, emu_thread_fn, NULL);
+}
+
+#ifdef CONFIG_LINUX
+// Out-of-process mode. The frontend's process only forwards frames, audio
+// and input: retro_load_game spawns qemu_libretro_helper, which loads this
+// core again in a fresh process and calls retro_qemu_remote_main(). That
+// runs the emu thread and the regular retro_run with the frontend callbacks
+// replaced by the shims below, which talk to the parent through a shared
+// memfd region. Each frame the parent snapshots input into it, kicks
+// remote_run_fd and waits on remote_done_fd, so both sides touch the region
+// strictly in turn. The memfd and the two eventfds are the only file
+// descriptors the child gets, and it starts from a clean address space
+// rather than a copy of the frontend's threads, GL and audio state.
+
+#define REMOTE_FB_MAX_PIXELS (4096 * 4096)
+#define REMOTE_AUDIO_FRAMES 8192
+#define REMOTE_KEYS 256
+#define REMOTE_INPUT_DEVICES (RETRO_DEVICE_POINTER + 1)
+#define REMOTE_INPUT_INDICES 2
+#define REMOTE_INPUT_IDS 16
+#define REMOTE_OPTION_LEN 64
+// How often to check whether the child is still alive while waiting for it
+#define REMOTE_POLL_MS 1000
+// How long the child gets to shut the VM down before it's killed
+#define REMOTE_EXIT_TIMEOUT_US (10 * 1000 * 1000)
+// Installed next to the core
+#define REMOTE_HELPER "qemu_libretro_helper"
+// The helper's argv: helper, core, memfd, run eventfd, done eventfd, parent
+// pid, game path, system directory and save directory
+#define REMOTE_ARGC 9
+
+struct remote_key {
+	bool down;
+	unsigned keycode;
+	uint32_t character;
+	uint16_t modifiers;
+};
+
+enum remote_frame {
+	REMOTE_FRAME_NONE,
+	REMOTE_FRAME_DUPE,
+	REMOTE_FRAME_NEW,
+};
+
+struct remote_shm {
+	// Written by the parent. The key ring may be filled while the child
+	// runs, everything else only before kicking it.
+	uint32_t key_head, key_tail;
+	struct remote_key keys[REMOTE_KEYS];
+	int16_t input[REMOTE_INPUT_DEVICES][REMOTE_INPUT_INDICES]
+		     [REMOTE_INPUT_IDS];
+	char options[G_N_ELEMENTS(core_options)][REMOTE_OPTION_LEN];
+	bool options_updated;
+	bool pad_enabled;
+	bool reset;
+	bool stop;
+	retro_usec_t frame_time_usec;
+
+	// Written by the child before it signals the end of a frame
+	bool shutdown;
+	bool av_info_changed;
+	bool geometry_changed;
+	struct retro_system_av_info av_info;
+	bool message_pending;
+	enum retro_log_level message_level;
+	unsigned message_duration;
+	char message[512];
+	size_t audio_frames;
+	int16_t audio[REMOTE_AUDIO_FRAMES * 2];
+	enum remote_frame frame;
+	unsigned width, height;
+	uint32_t fb[]; // REMOTE_FB_MAX_PIXELS, packed rows
+};
+
+#define REMOTE_SHM_SIZE \
+	(sizeof(struct remote_shm) + REMOTE_FB_MAX_PIXELS * sizeof(uint32_t))
+
+// Input the core reads through cb_input_state, all on port 0
+static const struct {
+	unsigned device, index, ids;
+} remote_inputs[] = {
+	{ RETRO_DEVICE_JOYPAD, 0, 16 },
+	{ RETRO_DEVICE_MOUSE, 0, 11 },
+	{ RETRO_DEVICE_LIGHTGUN, 0, 16 },
+	{ RETRO_DEVICE_ANALOG, RETRO_DEVICE_INDEX_ANALOG_LEFT, 2 },
+	{ RETRO_DEVICE_ANALOG, RETRO_DEVICE_INDEX_ANALOG_RIGHT, 2 },
+	{ RETRO_DEVICE_POINTER, 0, 3 },
+};
+
+static struct remote_shm *remote;
+static int remote_run_fd = -1, remote_done_fd = -1;
+static bool remote_exited;
+// Where the frame in the region was copied from, to copy only dirty rows
+static const void *remote_fb_src;
+
+static bool remote_env(unsigned cmd, void *data)
+{
+	switch (cmd) {
+	case RETRO_ENVIRONMENT_GET_VARIABLE: {
+		struct retro_variable *var = data;
+		for (size_t i = 0; core_options[i].key; i++) {
+			if (!strcmp(var->key, core_options[i].key)) {
+				var->value = remote->options[i][0] ?
+						     remote->options[i] :
+						     NULL;
+				return var->value != NULL;
+			}
+		}
+		return false;
+	}
+	case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
+		*(bool *)data = remote->options_updated;
+		remote->options_updated = false;
+		return true;
+	case RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO:
+		remote->av_info = *(const struct retro_system_av_info *)data;
+		remote->av_info_changed = true;
+		return true;
+	case RETRO_ENVIRONMENT_SET_GEOMETRY:
+		remote->av_info.geometry =
+			*(const struct retro_game_geometry *)data;
+		remote->geometry_changed = true;
+		return true;
+	case RETRO_ENVIRONMENT_SET_MESSAGE_EXT: {
+		const struct retro_message_ext *msg = data;
+		g_strlcpy(remote->message, msg->msg, sizeof(remote->message));
+		remote->message_level = msg->level;
+		remote->message_duration = msg->duration;
+		remote->message_pending = true;
+		return true;
+	}
+	case RETRO_ENVIRONMENT_SHUTDOWN:
+		remote->shutdown = true;
+		return true;
+	default:
+		// Anything else would need the frontend itself, like a GL
+		// context, so the child goes without
+		return false;
+	}
+}
+
+static void remote_video_refresh(const void *data, unsigned width,
+				 unsigned height, size_t pitch)
+{
+	if (!data || (size_t)width * height > REMOTE_FB_MAX_PIXELS) {
+		remote->frame = REMOTE_FRAME_DUPE;
+		return;
+	}
+
+	unsigned x1 = 0, y1 = 0, x2 = width, y2 = height;
+	// The dirty region is in surface coordinates and still holds this
+	// frame's changes, so an unscaled frame of the same surface only needs
+	// those rows
+	if (data == remote_fb_src && width == remote->width &&
+	    height == remote->height && !output_width && surface &&
+	    data == surface_data(surface)) {
+		pixman_box32_t *box = pixman_region32_extents(&dirty_region);
+		x1 = MIN(MAX(box->x1, 0), width);
+		y1 = MIN(MAX(box->y1, 0), height);
+		x2 = MIN(MAX(box->x2, x1), width);
+		y2 = MIN(MAX(box->y2, y1), height);
+	}
+	for (unsigned y = y1; y < y2; y++) {
+		memcpy(remote->fb + y * width + x1,
+		       (const uint8_t *)data + y * pitch + x1 * 4,
+		       (x2 - x1) * 4);
+	}
+	remote_fb_src = data;
+	remote->width = width;
+	remote->height = height;
+	remote->frame = REMOTE_FRAME_NEW;
+}
+
+static size_t remote_audio_sample_batch(const int16_t *data, size_t frames)
+{
+	size_t n = MIN(frames, REMOTE_AUDIO_FRAMES - remote->audio_frames);
+	memcpy(remote->audio + remote->audio_frames * 2, data, n * 4);
+	remote->audio_frames += n;
+	// Drop what doesn't fit, like a frontend with a full buffer would
+	return frames;
+}
+
+static void remote_input_poll(void)
+{
+}
+
+static int16_t remote_input_state(unsigned port, unsigned device,
+				  unsigned index, unsigned id)
+{
+	if (port || device >= REMOTE_INPUT_DEVICES ||
+	    index >= REMOTE_INPUT_INDICES || id >= REMOTE_INPUT_IDS) {
+		return 0;
+	}
+	return remote->input[device][index][id];
+}
+
+static void remote_read_options(void)
+{
+	for (size_t i = 0; core_options[i].key; i++) {
+		const char *value = get_core_option(core_options[i].key);
+		g_strlcpy(remote->options[i], value ? value : "",
+			  sizeof(remote->options[i]));
+	}
+}
+
+static void remote_queue_key(bool down, unsigned keycode, uint32_t character,
+			     uint16_t key_modifiers)
+{
+	uint32_t head = remote->key_head;
+	if (head - qatomic_load_acquire(&remote->key_tail) == REMOTE_KEYS) {
+		return;
+	}
+	remote->keys[head % REMOTE_KEYS] = (struct remote_key){
+		.down = down,
+		.keycode = keycode,
+		.character = character,
+		.modifiers = key_modifiers,
+	};
+	qatomic_store_release(&remote->key_head, head + 1);
+}
+
+static void remote_cleanup(void)
+{
+	if (remote) {
+		munmap(remote, REMOTE_SHM_SIZE);
+		remote = NULL;
+	}
+	if (remote_run_fd >= 0) {
+		close(remote_run_fd);
+		remote_run_fd = -1;
+	}
+	if (remote_done_fd >= 0) {
+		close(remote_done_fd);
+		remote_done_fd = -1;
+	}
+}
+
+// Returns true once the child is running, and false when the VM has to stay
+// in this process
+static bool remote_spawn(const char *path)
+{
+	Dl_info info;
+	if (!dladdr((void *)remote_spawn, &info) || !info.dli_fname) {
+		fprintf(stderr, "qemu: can't find the path of the core\n");
+		return false;
+	}
+	g_autofree char *dir = g_path_get_dirname(info.dli_fname);
+	g_autofree char *helper = g_build_filename(dir, REMOTE_HELPER, NULL);
+	if (access(helper, X_OK) < 0) {
+		fprintf(stderr, "qemu: %s: %s\n", helper, strerror(errno));
+		return false;
+	}
+
+	int fd = memfd_create("qemu-libretro", MFD_CLOEXEC);
+	if (fd < 0) {
+		perror("qemu: memfd_create");
+		return false;
+	}
+	if (ftruncate(fd, REMOTE_SHM_SIZE) < 0) {
+		perror("qemu: ftruncate");
+		close(fd);
+		return false;
+	}
+	remote = mmap(NULL, REMOTE_SHM_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	if (remote == MAP_FAILED) {
+		perror("qemu: mmap");
+		remote = NULL;
+		close(fd);
+		return false;
+	}
+
+	// Everything stays close-on-exec until the child clears it on these
+	remote_run_fd = eventfd(0, EFD_CLOEXEC);
+	remote_done_fd = eventfd(0, EFD_CLOEXEC);
+	if (remote_run_fd < 0 || remote_done_fd < 0) {
+		perror("qemu: eventfd");
+		close(fd);
+		remote_cleanup();
+		return false;
+	}
+
+	remote_read_options();
+	remote->av_info = av_info;
+	remote->pad_enabled = pad_enabled;
+	remote->frame_time_usec = frame_time_usec;
+
+	g_autofree char *fd_arg = g_strdup_printf("%d", fd);
+	g_autofree char *run_arg = g_strdup_printf("%d", remote_run_fd);
+	g_autofree char *done_arg = g_strdup_printf("%d", remote_done_fd);
+	g_autofree char *pid_arg = g_strdup_printf("%d", (int)getpid());
+	char *argv[REMOTE_ARGC + 1] = {
+		helper,
+		(char *)info.dli_fname,
+		fd_arg,
+		run_arg,
+		done_arg,
+		pid_arg,
+		(char *)path,
+		(char *)(system_dir ? system_dir : ""),
+		(char *)(save_dir ? save_dir : ""),
+		NULL,
+	};
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// The frontend may have other threads, so only async-signal-safe
+		// calls until exec
+		if (fcntl(fd, F_SETFD, 0) < 0 ||
+		    fcntl(remote_run_fd, F_SETFD, 0) < 0 ||
+		    fcntl(remote_done_fd, F_SETFD, 0) < 0) {
+			_exit(127);
+		}
+		execv(helper, argv);
+		_exit(127);
+	}
+	close(fd);
+	if (pid < 0) {
+		perror("qemu: fork");
+		remote_cleanup();
+		return false;
+	}
+	remote_pid = pid;
+	return true;
+}
+
+static G_NORETURN void remote_child_loop(void)
+{
+	for (;;) {
+		eventfd_t value;
+		if (eventfd_read(remote_run_fd, &value) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (remote->stop) {
+			break;
+		}
+
+		frame_time_usec = remote->frame_time_usec;
+		pad_enabled = remote->pad_enabled;
+		if (remote->reset) {
+			remote->reset = false;
+			retro_reset();
+		}
+		uint32_t head = qatomic_load_acquire(&remote->key_head);
+		uint32_t tail = remote->key_tail;
+		for (; tail != head; tail++) {
+			struct remote_key *key = &remote->keys[tail % REMOTE_KEYS];
+			keyboard_event(key->down, key->keycode, key->character,
+				       key->modifiers);
+		}
+		qatomic_store_release(&remote->key_tail, tail);
+
+		remote->frame = REMOTE_FRAME_NONE;
+		remote->audio_frames = 0;
+		retro_run();
+
+		eventfd_write(remote_done_fd, 1);
+		if (remote->shutdown) {
+			_exit(0);
+		}
+	}
+
+	retro_unload_game();
+	_exit(0);
+}
+
+RETRO_API int retro_qemu_remote_main(int argc, char **argv);
+
+// Entry point of the child, called by qemu_libretro_helper with the argv
+// remote_spawn() built
+RETRO_API int retro_qemu_remote_main(int argc, char **argv)
+{
+	if (argc != REMOTE_ARGC) {
+		fprintf(stderr, "qemu: %s: wrong number of arguments\n",
+			argv[0]);
+		return 1;
+	}
+	int fd = atoi(argv[2]);
+	remote_run_fd = atoi(argv[3]);
+	remote_done_fd = atoi(argv[4]);
+	pid_t parent = atoi(argv[5]);
+
+	// Don't outlive a crashed frontend
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != parent) {
+		return 1;
+	}
+
+	remote = mmap(NULL, REMOTE_SHM_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	close(fd);
+	if (remote == MAP_FAILED) {
+		perror("qemu: mmap");
+		return 1;
+	}
+	// Keep them out of the processes QEMU starts
+	fcntl(remote_run_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(remote_done_fd, F_SETFD, FD_CLOEXEC);
+
+	system_dir = *argv[7] ? argv[7] : NULL;
+	save_dir = *argv[8] ? argv[8] : NULL;
+	av_info = remote->av_info;
+	pad_enabled = remote->pad_enabled;
+	frame_time_usec = remote->frame_time_usec;
+
+	cb_env = remote_env;
+	cb_video_refresh = remote_video_refresh;
+	cb_audio_sample_batch = remote_audio_sample_batch;
+	cb_input_poll = remote_input_poll;
+	cb_input_state = remote_input_state;
+	// The parent decides whether the frontend gets a dupe or the last frame
+	can_dupe = true;
+
+	retro_init();
+	start_vm(argv[6]);
+	remote_child_loop();
+}
+
+static void remote_reap(bool force)
+{
+	int64_t deadline = g_get_monotonic_time() + REMOTE_EXIT_TIMEOUT_US;
+
+	while (!force && waitpid(remote_pid, NULL, WNOHANG) == 0) {
+		if (g_get_monotonic_time() > deadline) {
+			fprintf(stderr, "qemu: VM process did not exit, "
+					"killing it\n");
+			force = true;
+			break;
+		}
+		g_usleep(10 * 1000);
+	}
+	if (force) {
+		kill(remote_pid, SIGKILL);
+		waitpid(remote_pid, NULL, 0);
+	}
+	remote_exited = true;
+}
+
+// Waits for the child to finish a frame, false if it died instead
+static bool remote_wait(void)
+{
+	for (;;) {
+		struct pollfd pfd = { .fd = remote_done_fd, .events = POLLIN };
+		int ret = poll(&pfd, 1, REMOTE_POLL_MS);
+		if (ret > 0) {
+			eventfd_t value;
+			return eventfd_read(remote_done_fd, &value) == 0;
+		}
+		if (ret < 0 && errno != EINTR) {
+			return false;
+		}
+		if (waitpid(remote_pid, NULL, WNOHANG) != 0) {
+			remote_exited = true;
+			return false;
+		}
+	}
+}
+
+static void remote_run(void)
+{
+	if (remote_exited) {
+		return;
+	}
+
+	cb_input_poll();
+	for (size_t i = 0; i < G_N_ELEMENTS(remote_inputs); i++) {
+		unsigned device = remote_inputs[i].device;
+		unsigned index = remote_inputs[i].index;
+		for (unsigned id = 0; id < remote_inputs[i].ids; id++) {
+			remote->input[device][index][id] =
+				cb_input_state(0, device, index, id);
+		}
+	}
+	bool options_updated = false;
+	if (cb_env(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &options_updated) &&
+	    options_updated) {
+		remote_read_options();
+		remote->options_updated = true;
+	}
+	remote->pad_enabled = pad_enabled;
+	remote->frame_time_usec = frame_time_usec;
+
+	eventfd_write(remote_run_fd, 1);
+	if (!remote_wait()) {
+		if (!remote_exited) {
+			remote_reap(true);
+		}
+		cb_env(RETRO_ENVIRONMENT_SET_MESSAGE_EXT,
+		       &(struct retro_message_ext){
+			       .msg = "VM process exited unexpectedly",
+			       .duration = 3000,
+			       .level = RETRO_LOG_ERROR,
+			       .target = RETRO_MESSAGE_TARGET_ALL,
+			       .type = RETRO_MESSAGE_TYPE_NOTIFICATION,
+		       });
+		cb_env(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
+		return;
+	}
+
+	if (remote->av_info_changed) {
+		av_info = remote->av_info;
+		cb_env(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &av_info);
+	} else if (remote->geometry_changed) {
+		av_info.geometry = remote->av_info.geometry;
+		cb_env(RETRO_ENVIRONMENT_SET_GEOMETRY, &av_info.geometry);
+	}
+	remote->av_info_changed = remote->geometry_changed = false;
+
+	if (remote->message_pending) {
+		remote->message_pending = false;
+		cb_env(RETRO_ENVIRONMENT_SET_MESSAGE_EXT,
+		       &(struct retro_message_ext){
+			       .msg = remote->message,
+			       .duration = remote->message_duration,
+			       .level = remote->message_level,
+			       .target = RETRO_MESSAGE_TARGET_ALL,
+			       .type = RETRO_MESSAGE_TYPE_NOTIFICATION,
+		       });
+	}
+
+	if (remote->frame == REMOTE_FRAME_NEW || !can_dupe) {
+		// Without dupe support the frame in the region is resent
+		if (remote->width) {
+			cb_video_refresh(remote->fb, remote->width,
+					 remote->height, remote->width * 4);
+		}
+	} else {
+		cb_video_refresh(NULL, remote->width, remote->height, 0);
+	}
+
+	for (size_t done = 0; done < remote->audio_frames;) {
+		size_t n = cb_audio_sample_batch(remote->audio + done * 2,
+						 remote->audio_frames - done);
+		if (!n) {
+			break;
+		}
+		done += n;
+	}
+
+	if (remote->shutdown) {
+		remote_reap(false);
+		cb_env(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
+	}
+}
+
+static void remote_stop(void)
+{
+	if (!remote_exited) {
+		remote->stop = true;
+		eventfd_write(remote_run_fd, 1);
+		remote_reap(false);
+	}
+	remote_cleanup();
+	remote_pid = 0;
+	remote_exited = false;
+}
+#endif
+
+bool retro_load_game(const struct retro_game_info *game)
+{
+	if (!game) {
+		return false;
+	}
+
+	float target_refresh_rate;
+	if (cb_env(RETRO_ENVIRONMENT_GET_TARGET_REFRESH_RATE,
+		   &target_refresh_rate) &&
+	    target_refresh_rate > 0) {
+		frame_time_usec = 1000000 / target_refresh_rate;
+		av_info.timing.fps = target_refresh_rate;
+	}
+	cb_env(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK,
+	       &(struct retro_frame_time_callback){
+		       .callback = frame_time_callback,
+		       .reference = frame_time_usec,
+	       });
+	if (!cb_env(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe)) {
+		can_dupe = false;
+	}
+	if (!cb_env(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &save_dir)) {
+		save_dir = NULL;
+	}
+
+#ifdef CONFIG_LINUX
+	const char *vm_process = get_core_option("qemu_vm_process");
+	if (vm_process && !strcmp(vm_process, "child") &&
+	    remote_spawn(game->path)) {
+		return true;
+	}
+#endif
+
+	start_vm(game->path);
+	return true;
+}
+
+bool retro_load_game_special(unsigned game_type,
+			     const struct retro_game_info *info,
+			     size_t num_info)
+{
+	return false;
+}
+
+void retro_unload_game(void)
+{
+#ifdef CONFIG_LINUX
+	if (remote_pid) {
+		remote_stop();
+		return;
+	}
+#endif
+	if (!exited) {
+		// Request shutdown
+		CALL_QEMU_FUNC(qemu_system_shutdown_request,
+			       SHUTDOWN_CAUSE_HOST_UI);
+	}
+	join_emu_thread();
+
+	if (latency_stats) {
+		char *report = CALL_QEMU_FUNC(qemu_input_latency_report);
+		fprintf(stderr, "%s", report);
+		g_free(report);
+	}
+}
+
+unsigned retro_get_region(void)
+{
+	return RETRO_REGION_NTSC;
+}
+
+void *retro_get_memory_data(unsigned id)
+{
+	return NULL;
+}
+
+size_t retro_get_memory_size(unsigned id)
 {
 	return 0;
 }
 
+static void queue_button_event(InputButton button, bool down)
+{
+	struct input_event *ev = new_input_event(INPUT_EVENT_BTN);
+	ev->btn.button = button;
+	ev->btn.down = down;
+	queue_input_event(ev);
+}
+
+static void queue_button(InputButton button, bool down)
+{
+	// The frontend reports a wheel step as a press during one frame
+	if (button == INPUT_BUTTON_WHEEL_UP ||
+	    button == INPUT_BUTTON_WHEEL_DOWN) {
+		if (down) {
+			queue_button_event(button, true);
+			queue_button_event(button, false);
+		}
+		return;
+	}
+
+	if (buttons_down[button] != down) {
+		buttons_down[button] = down;
+		queue_button_event(button, down);
+	}
+}
+
+// Queue the RetroPad state that changed since the last frame. All of it is
+// delivered with a single sync, so the guest sees at most one report per frame.
+static void poll_pad(void)
+{
+	static const InputPadButton button_map[] = {
+		[RETRO_DEVICE_ID_JOYPAD_B] = INPUT_PAD_BUTTON_SOUTH,
+		[RETRO_DEVICE_ID_JOYPAD_Y] = INPUT_PAD_BUTTON_WEST,
+		[RETRO_DEVICE_ID_JOYPAD_SELECT] = INPUT_PAD_BUTTON_SELECT,
+		[RETRO_DEVICE_ID_JOYPAD_START] = INPUT_PAD_BUTTON_START,
+		[RETRO_DEVICE_ID_JOYPAD_UP] = INPUT_PAD_BUTTON_DPAD_UP,
+		[RETRO_DEVICE_ID_JOYPAD_DOWN] = INPUT_PAD_BUTTON_DPAD_DOWN,
+		[RETRO_DEVICE_ID_JOYPAD_LEFT] = INPUT_PAD_BUTTON_DPAD_LEFT,
+		[RETRO_DEVICE_ID_JOYPAD_RIGHT] = INPUT_PAD_BUTTON_DPAD_RIGHT,
+		[RETRO_DEVICE_ID_JOYPAD_A] = INPUT_PAD_BUTTON_EAST,
+		[RETRO_DEVICE_ID_JOYPAD_X] = INPUT_PAD_BUTTON_NORTH,
+		[RETRO_DEVICE_ID_JOYPAD_L] = INPUT_PAD_BUTTON_L1,
+		[RETRO_DEVICE_ID_JOYPAD_R] = INPUT_PAD_BUTTON_R1,
+		[RETRO_DEVICE_ID_JOYPAD_L2] = INPUT_PAD_BUTTON_L2,
+		[RETRO_DEVICE_ID_JOYPAD_R2] = INPUT_PAD_BUTTON_R2,
+		[RETRO_DEVICE_ID_JOYPAD_L3] = INPUT_PAD_BUTTON_L3,
+		[RETRO_DEVICE_ID_JOYPAD_R3] = INPUT_PAD_BUTTON_R3,
+	};
+	static const struct {
+		unsigned index, id;
+	} axis_map[INPUT_PAD_AXIS__MAX] = {
+		[INPUT_PAD_AXIS_LX] = { RETRO_DEVICE_INDEX_ANALOG_LEFT,
+					RETRO_DEVICE_ID_ANALOG_X },
+		[INPUT_PAD_AXIS_LY] = { RETRO_DEVICE_INDEX_ANALOG_LEFT,
+					RETRO_DEVICE_ID_ANALOG_Y },
+		[INPUT_PAD_AXIS_RX] = { RETRO_DEVICE_INDEX_ANALOG_RIGHT,
+					RETRO_DEVICE_ID_ANALOG_X },
+		[INPUT_PAD_AXIS_RY] = { RETRO_DEVICE_INDEX_ANALOG_RIGHT,
+					RETRO_DEVICE_ID_ANALOG_Y },
+	};
+
+	// Switching the port away from the pad releases everything still held
+	for (unsigned id = 0; id < G_N_ELEMENTS(button_map); id++) {
+		InputPadButton button = button_map[id];
+		bool down = pad_enabled &&
+			    cb_input_state(0, RETRO_DEVICE_JOYPAD, 0, id);
+		if (pad_buttons_down[button] == down) {
+			continue;
+		}
+		pad_buttons_down[button] = down;
+
+		struct input_event *ev = new_input_event(INPUT_EVENT_PAD_BTN);
+		ev->pad_btn.button = button;
+		ev->pad_btn.down = down;
+		queue_input_event(ev);
+	}
+
+	for (int axis = 0; axis < INPUT_PAD_AXIS__MAX; axis++) {
+		int value = pad_enabled ?
+			cb_input_state(0, RETRO_DEVICE_ANALOG,
+				       axis_map[axis].index, axis_map[axis].id) :
+			0;
+		if (pad_axes[axis] == value) {
+			continue;
+		}
+		pad_axes[axis] = value;
+
+		struct input_event *ev = new_input_event(INPUT_EVENT_PAD_AXIS);
+		ev->pad_axis.axis = axis;
+		ev->pad_axis.value = value;
+		queue_input_event(ev);
+	}
+}
+
+// Work out how long the guest may run before handing the next frame back, so
+// that guest frame production follows the frontend's vsync instead of QEMU's
+// own refresh timer
+static void update_refresh_interval(void)
+{
+	int64_t now = g_get_monotonic_time();
+	int64_t frontend_usec = last_run_end_usec ? now - last_run_end_usec : 0;
+	int64_t budget_usec = frame_time_usec - frontend_usec;
+
+	refresh_interval_ms = MAX(1, MIN(budget_usec / 1000,
+					 GUI_REFRESH_INTERVAL_DEFAULT));
+}
+
 void retro_run(void)
 {
+#ifdef CONFIG_LINUX
+	if (remote_pid) {
+		remote_run();
+		return;
+	}
+#endif
+	update_refresh_interval();
+
 	cb_input_poll();
 
-	mouse_dx = cb_input_state(0, RETRO_DEVICE_MOUSE, 0,
-				  RETRO_DEVICE_ID_MOUSE_X);
-	mouse_dy = cb_input_state(0, RETRO_DEVICE_MOUSE, 0,
-				  RETRO_DEVICE_ID_MOUSE_Y);
+	int mouse_dx = cb_input_state(0, RETRO_DEVICE_MOUSE, 0,
+				      RETRO_DEVICE_ID_MOUSE_X);
+	int mouse_dy = cb_input_state(0, RETRO_DEVICE_MOUSE, 0,
+				      RETRO_DEVICE_ID_MOUSE_Y);
+	if (mouse_dx || mouse_dy) {
+		struct input_event *ev = new_input_event(INPUT_EVENT_REL);
+		ev->rel.dx = mouse_dx;
+		ev->rel.dy = mouse_dy;
+		queue_input_event(ev);
+	}
+
+	int x = INT_MIN, y = INT_MIN;
+	switch (pointer_source) {
+	case POINTER_SOURCE_POINTER:
+		x = cb_input_state(0, RETRO_DEVICE_POINTER, 0,
+				   RETRO_DEVICE_ID_POINTER_X);
+		y = cb_input_state(0, RETRO_DEVICE_POINTER, 0,
+				   RETRO_DEVICE_ID_POINTER_Y);
+		break;
+	case POINTER_SOURCE_LIGHTGUN:
+		if (!cb_input_state(0, RETRO_DEVICE_LIGHTGUN, 0,
+				    RETRO_DEVICE_ID_LIGHTGUN_IS_OFFSCREEN)) {
+			x = cb_input_state(0, RETRO_DEVICE_LIGHTGUN, 0,
+					   RETRO_DEVICE_ID_LIGHTGUN_SCREEN_X);
+			y = cb_input_state(0, RETRO_DEVICE_LIGHTGUN, 0,
+					   RETRO_DEVICE_ID_LIGHTGUN_SCREEN_Y);
+		}
+		break;
+	case POINTER_SOURCE_NONE:
+		break;
+	}
+	if (x == INT_MIN) {
+		pointer_active = false;
+	} else if (x != pointer_x || y != pointer_y) {
+		pointer_active |= pointer_x != INT_MIN;
+		pointer_x = x;
+		pointer_y = y;
+
+		struct input_event *ev = new_input_event(INPUT_EVENT_ABS);
+		ev->abs.x = x;
+		ev->abs.y = y;
+		queue_input_event(ev);
+	}
 
 #define BTN(q, r)                                                              \
-	buttons_down[INPUT_BUTTON_##q] = cb_input_state(                       \
-		0, RETRO_DEVICE_MOUSE, 0, RETRO_DEVICE_ID_MOUSE_##r)
+	queue_button(INPUT_BUTTON_##q,                                         \
+		     cb_input_state(0, RETRO_DEVICE_MOUSE, 0,                  \
+				    RETRO_DEVICE_ID_MOUSE_##r))
 	BTN(LEFT, LEFT);
 	BTN(RIGHT, RIGHT);
 	BTN(MIDDLE, MIDDLE);
@@ -803,6 +2730,8 @@ void retro_run(void)
 	BTN(WHEEL_DOWN, WHEELDOWN);
 #undef BTN
 
+	poll_pad();
+
 	if (exited) {
 		join_emu_thread();
 		cb_env(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
@@ -817,15 +2746,64 @@ void retro_run(void)
 		return;
 	}
 
-	int w = surface_width(surface);
-	int h = surface_height(surface);
+	bool options_updated = false;
+	if (cb_env(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &options_updated) &&
+	    options_updated) {
+		read_core_options();
+	}
+
+	DisplaySurface *src = surface;
+#ifdef CONFIG_OPENGL
+	if (gl_scanout_active && gl_surface) {
+		src = gl_surface;
+	}
+#endif
+	int w = surface_width(src);
+	int h = surface_height(src);
 
 	pthread_mutex_lock(&av_info_lock);
 	if (changed_av_info) {
 		changed_av_info = false;
+		changed_geometry = false;
 		cb_env(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &av_info);
+	} else if (changed_geometry) {
+		changed_geometry = false;
+		cb_env(RETRO_ENVIRONMENT_SET_GEOMETRY, &av_info.geometry);
 	}
 	pthread_mutex_unlock(&av_info_lock);
 
-	cb_video_refresh(surface_data(surface), w, h, surface_stride(surface));
+	if (!frame_dirty && can_dupe) {
+		cb_video_refresh(NULL, frame_width, frame_height, 0);
+	} else {
+		frame_dirty = false;
+#ifdef CONFIG_OPENGL
+		if (hw_render_enabled) {
+			hw_render_present();
+		} else
+#endif
+		if (output_width) {
+			scale_output(src);
+			cb_video_refresh(pixman_image_get_data(scaled_image),
+					 output_width, output_height,
+					 pixman_image_get_stride(scaled_image));
+			frame_width = output_width;
+			frame_height = output_height;
+		} else {
+			cb_video_refresh(surface_data(src), w, h,
+					 surface_stride(src));
+			frame_width = w;
+			frame_height = h;
+		}
+		pixman_region32_fini(&dirty_region);
+		pixman_region32_init(&dirty_region);
+		if (latency_stats) {
+			CALL_QEMU_FUNC(qemu_input_latency_presented);
+		}
+	}
+
+	if (audio_pull) {
+		present_audio_frame();
+	}
+
+	last_run_end_usec = g_get_monotonic_time();
 }